@@ -1,5 +1,6 @@
 /*
- *	The in-kernel 9p server
+ *	The 9p server: the 9P2000.L op handlers over the files of a
+ *	p9_vfs_ops backend, shared by the module and the vhost-user daemon
  *
  *	Copyright (C) 2016 by Yuankai Guo <yuankai.guo@intel.com>
  *	Copyright (C) 2017 by Anthony Xu <anthony.xu@intel.com>
@@ -16,199 +17,282 @@
  *
  */
 
-#include <linux/fs.h>
-#include <linux/xattr.h>
-#include <linux/stat.h>
-#include <linux/statfs.h>
-#include <linux/in.h>
-#include <linux/namei.h>
-#include <linux/net.h>
-#include <linux/ipv6.h>
-#include <linux/kthread.h>
-#include <linux/errno.h>
-#include <linux/kernel.h>
-#include <linux/un.h>
-#include <linux/uaccess.h>
-#include <linux/inet.h>
-#include <linux/idr.h>
-#include <linux/file.h>
-#include <linux/parser.h>
-#include <linux/slab.h>
-#include <linux/syscalls.h>
-#include <net/9p/9p.h>
-
-#include "vhost-9p.h"
+#include "p9-compat.h"
 #include "protocol.h"
+#include "9p-server.h"
+#include "9p-vfs.h"
 
 #define MAX_FILE_NAME (NAME_MAX + 1)
+/* qid[13] offset[8] type[1] name[s] */
+#define P9_DIRENT_LEN(namlen) (13 + 8 + 1 + 2 + (namlen))
 const size_t P9_PDU_HDR_LEN = sizeof(u32) + sizeof(u8) + sizeof(u16);
 
-struct p9_server_fid {
-	u32 fid;
-	u32 uid;
-	struct path path;
-	struct file *filp;
-	struct rb_node node;
-};
+static void free_fid(struct kref *ref)
+{
+	struct p9_server_fid *fid =
+		container_of(ref, struct p9_server_fid, ref);
 
-/* 9p helper routines */
-/* clear SUID/SGID when writing to the file by non-owner */
-static void p9_clear_sugid(struct p9_server *s, struct p9_server_fid *fid)
+	fid->ops->release(fid->file);
+	kfree(fid);
+}
+
+void p9_fid_put(struct p9_server_fid *fid)
 {
-	int err;
-	struct kstat st;
+	kref_put(&fid->ref, free_fid);
+}
 
-	err = vfs_getattr(&fid->path, &st);
-	if (err)
-		return;
-	p9s_debug("p9_clear_sugid: user  %d, file user %d\n",
-			fid->uid, st.uid.val);
-	if (st.uid.val == fid->uid)
-		return;
-	if (st.mode & (S_ISUID | S_ISGID)) {
-		struct iattr iattr;
-		struct dentry *dentry = fid->path.dentry;
-
-		memset(&iattr, 0, sizeof(struct iattr));
-		iattr.ia_valid |= ATTR_MODE;
-		iattr.ia_mode = st.mode & (~S_ISUID);
-		iattr.ia_mode &= ~S_ISGID;
-		iattr.ia_ctime = current_time(dentry->d_inode);
-		inode_lock(dentry->d_inode);
-		notify_change(dentry, &iattr, NULL);
-		inode_unlock(dentry->d_inode);
-	}
+static struct hlist_head *p9_fid_bucket(struct p9_server *s, u32 fid_val)
+{
+	return &s->fids[hash_32(fid_val, s->fid_bits)];
 }
 
-static struct dentry *p9_lookup_one_len(
-		const char *name, struct dentry *dentry, int len)
+static struct hlist_head *p9_fid_buckets_alloc(unsigned int bits)
+{
+	size_t size = sizeof(struct hlist_head) << bits;
+	struct hlist_head *buckets;
+
+	buckets = kzalloc(size, GFP_KERNEL | __GFP_NOWARN);
+	return buckets ?: vzalloc(size);
+}
+
+/*
+ * Doubles the fid table. The new buckets are allocated unlocked, the
+ * fids moved over under fid_lock. Lost races leave the table as is.
+ */
+static void p9_fid_table_grow(struct p9_server *s, unsigned int bits)
 {
+	struct hlist_head *buckets, *old;
+	struct p9_server_fid *fid;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	buckets = p9_fid_buckets_alloc(bits);
+	if (!buckets)
+		return;
 
-	if (!inode_is_locked(dentry->d_inode)) {
-		p9s_debug("lookup_one_len: inode %s is not locked\n",
-				dentry->d_name.name);
-		return lookup_one_len_unlocked(name, dentry, len);
+	spin_lock(&s->fid_lock);
+	if (s->fid_bits >= bits) {
+		spin_unlock(&s->fid_lock);
+		kvfree(buckets);
+		return;
 	}
-	p9s_debug("lookup_one_len: inode %s is locked\n",
-			dentry->d_name.name);
-	return lookup_one_len(name, dentry, len);
+	for (bkt = 0; bkt < 1U << s->fid_bits; bkt++)
+		hlist_for_each_entry_safe(fid, tmp, &s->fids[bkt], node) {
+			hlist_del_init(&fid->node);
+			hlist_add_head(&fid->node,
+				       &buckets[hash_32(fid->fid, bits)]);
+		}
+	old = s->fids;
+	s->fids = buckets;
+	s->fid_bits = bits;
+	spin_unlock(&s->fid_lock);
+
+	kvfree(old);
 }
 
-static struct p9_server_fid *lookup_fid(struct p9_server *s, u32 fid_val)
+/* Also returns stale fids, for Tclunk and Tremove. */
+static struct p9_server_fid *lookup_fid_any(struct p9_server *s, u32 fid_val)
 {
-	struct rb_node *node = s->fids.rb_node;
 	struct p9_server_fid *cur;
 
 	p9s_debug("find fid : %d\n", fid_val);
-	while (node) {
-		cur = rb_entry(node, struct p9_server_fid, node);
-
-		if (fid_val < cur->fid)
-			node = node->rb_left;
-		else if (fid_val > cur->fid)
-			node = node->rb_right;
-		else{
+	spin_lock(&s->fid_lock);
+	hlist_for_each_entry(cur, p9_fid_bucket(s, fid_val), node) {
+		if (cur->fid == fid_val) {
+			kref_get(&cur->ref);
+			spin_unlock(&s->fid_lock);
 			p9s_debug("fid : %d is found\n", cur->fid);
 			return cur;
 		}
 	}
+	spin_unlock(&s->fid_lock);
 
 	return ERR_PTR(-ENOENT);
 }
 
-static struct p9_server_fid *new_fid(struct p9_server *s, u32 fid_val,
-						struct path *path)
+static struct p9_server_fid *lookup_fid(struct p9_server *s, u32 fid_val)
+{
+	struct p9_server_fid *fid = lookup_fid_any(s, fid_val);
+
+	if (!IS_ERR(fid) && unlikely(fid->stale)) {
+		p9_fid_put(fid);
+		return ERR_PTR(-ESTALE);
+	}
+	return fid;
+}
+
+/* A fid with one reference, or NULL with file released. */
+static struct p9_server_fid *p9_fid_alloc(struct p9_server *s, u32 fid_val,
+					  u32 uid, struct p9_vfs_file *file)
 {
 	struct p9_server_fid *fid;
-	struct rb_node **node = &(s->fids.rb_node), *parent = NULL;
 
-	p9s_debug("create fid : %d\n", fid_val);
-	while (*node) {
-		int result = fid_val
-			- rb_entry(*node, struct p9_server_fid, node)->fid;
-
-		parent = *node;
-		if (result < 0)
-			node = &((*node)->rb_left);
-		else if (result > 0)
-			node = &((*node)->rb_right);
-		else
-			return ERR_PTR(-EEXIST);
+	fid = kmalloc_node(sizeof(struct p9_server_fid), GFP_KERNEL,
+			   READ_ONCE(s->node));
+	if (!fid) {
+		s->ops->release(file);
+		return NULL;
 	}
+	fid->fid = fid_val;
+	fid->uid = uid;
+	fid->file = file;
+	fid->ops = s->ops;
+	fid->stale = false;
+	INIT_HLIST_NODE(&fid->node);
+	kref_init(&fid->ref);
+	return fid;
+}
 
-	fid = kmalloc(sizeof(struct p9_server_fid), GFP_KERNEL);
+struct p9_server_fid *p9_fid_new(struct p9_server *s, u32 fid_val,
+				 struct p9_vfs_file *file)
+{
+	struct p9_server_fid *fid, *cur;
+	unsigned int bits;
+
+	p9s_debug("create fid : %d\n", fid_val);
+
+	fid = p9_fid_alloc(s, fid_val, s->uid, file);
 	if (!fid)
 		return ERR_PTR(-ENOMEM);
-	fid->fid = fid_val;
-	fid->uid = s->uid;
-	fid->filp = NULL;
-	fid->path = *path;
+	/* One reference for the table, one for the caller. */
+	kref_get(&fid->ref);
+
+	spin_lock(&s->fid_lock);
+	hlist_for_each_entry(cur, p9_fid_bucket(s, fid_val), node) {
+		if (cur->fid == fid_val) {
+			spin_unlock(&s->fid_lock);
+			free_fid(&fid->ref);
+			return ERR_PTR(-EEXIST);
+		}
+	}
+	hlist_add_head(&fid->node, p9_fid_bucket(s, fid_val));
+	/* Keep the chains short: a bucket per fid. */
+	bits = ++s->nr_fids > 1U << s->fid_bits &&
+		s->fid_bits < P9_FID_HASH_MAX_BITS ? s->fid_bits + 1 : 0;
+	spin_unlock(&s->fid_lock);
+
+	if (bits)
+		p9_fid_table_grow(s, bits);
 
-	rb_link_node(&fid->node, parent, node);
-	rb_insert_color(&fid->node, &s->fids);
 	p9s_debug("fid : %d created\n", fid_val);
 
 	return fid;
 }
 
+/* Unlink the fid from the table and drop the table's reference. */
+static void destroy_fid(struct p9_server *s, struct p9_server_fid *fid)
+{
+	bool linked;
+
+	spin_lock(&s->fid_lock);
+	linked = !hlist_unhashed(&fid->node);
+	if (linked) {
+		hlist_del_init(&fid->node);
+		s->nr_fids--;
+	}
+	spin_unlock(&s->fid_lock);
+
+	if (linked)
+		p9_fid_put(fid);
+}
+
+/*
+ * Moves fid over to file: a new fid takes its place in the table, so
+ * that requests still holding the old one keep its file. Fails with
+ * ENOENT if fid was clunked meanwhile; file is released on failure.
+ */
+static int p9_fid_replace(struct p9_server *s, struct p9_server_fid *fid,
+			  struct p9_vfs_file *file)
+{
+	struct p9_server_fid *newfid;
+
+	newfid = p9_fid_alloc(s, fid->fid, fid->uid, file);
+	if (!newfid)
+		return -ENOMEM;
+
+	spin_lock(&s->fid_lock);
+	if (hlist_unhashed(&fid->node)) {
+		spin_unlock(&s->fid_lock);
+		free_fid(&newfid->ref);
+		return -ENOENT;
+	}
+	hlist_del_init(&fid->node);
+	hlist_add_head(&newfid->node, p9_fid_bucket(s, fid->fid));
+	spin_unlock(&s->fid_lock);
+
+	/* The table's reference. */
+	p9_fid_put(fid);
+	return 0;
+}
+
 static inline void iov_iter_clone(struct iov_iter *dst, struct iov_iter *src)
 {
 	memcpy(dst, src, sizeof(struct iov_iter));
 }
 
-
-static int gen_qid(struct path *path, struct p9_qid *qid, struct kstat *st)
+static int gen_qid(struct p9_server *s, struct p9_vfs_file *file,
+		   struct p9_qid *qid, struct p9_vfs_attr *attr)
 {
 	int err;
-	struct kstat _st;
+	struct p9_vfs_attr _attr;
 
-	if (!st)
-		st = &_st;
+	if (!attr)
+		attr = &_attr;
 
-	err = vfs_getattr(path, st);
+	err = s->ops->getattr(file, attr);
 	if (err)
 		return err;
 
-	/* TODO: incomplete types */
-	qid->version = st->mtime.tv_sec;
-	qid->path = st->ino;
-	qid->type = P9_QTFILE;
-
-	if (S_ISDIR(st->mode))
-		qid->type |= P9_QTDIR;
-
-	if (S_ISLNK(st->mode))
-		qid->type |= P9_QTSYMLINK;
+	p9_vfs_qid(attr, qid);
+	return 0;
+}
 
+/* A name of a new entry must stay within its directory. */
+static int check_name(struct p9_str *name)
+{
+	if (!name->len || memchr(name->name, '/', name->len) ||
+	    (name->len == 1 && name->name[0] == '.') ||
+	    (name->len == 2 && name->name[0] == '.' && name->name[1] == '.'))
+		return -EINVAL;
 	return 0;
 }
 
-static int set_owner(struct dentry *d, int uid, int gid)
+/* 9p helper routines */
+/* clear SUID/SGID when writing to the file by non-owner */
+static void p9_clear_sugid(struct p9_server *s, struct p9_server_fid *fid)
 {
-	int err = 0;
-	struct iattr iattr;
+	struct p9_vfs_attr attr;
+	struct p9_vfs_iattr ia;
 
-	p9s_debug("set_owner : uid %d, gid %d\n", uid, gid);
+	if (s->ops->getattr(fid->file, &attr))
+		return;
+	p9s_debug("p9_clear_sugid: user  %d, file user %d\n",
+			fid->uid, attr.uid);
+	if (attr.uid == fid->uid)
+		return;
+	if (attr.mode & (S_ISUID | S_ISGID)) {
+		memset(&ia, 0, sizeof(ia));
+		ia.valid = P9_ATTR_MODE;
+		ia.mode = attr.mode & ~(S_ISUID | S_ISGID);
+		s->ops->setattr(fid->file, &ia);
+	}
+}
 
-	memset(&iattr, 0, sizeof(struct iattr));
+/*
+ * The largest Tread/Twrite payload that fits the session's messages, a
+ * power of two so that it is a whole number of blksize units, or 0 if
+ * there is none. It is also the block size reported by Rstatfs and
+ * Rgetattr, so that the guest's I/O sizes line up with the host's.
+ */
+static u32 p9_io_size(struct p9_session *session, u32 blksize)
+{
+	u32 msize = READ_ONCE(session->msize);
 
-	if (uid >= 0) {
-		iattr.ia_valid |= ATTR_UID;
-		iattr.ia_uid.val = uid;
-	}
-	if (gid >= 0) {
-		iattr.ia_valid |= ATTR_GID;
-		iattr.ia_gid.val = gid;
-	}
-	if (iattr.ia_valid) {
-		inode_lock(d->d_inode);
-		err = notify_change(d, &iattr, NULL);
-		inode_unlock(d->d_inode);
-		if (err < 0)
-			return err;
-	}
-	return 0;
+	if (!is_power_of_2(blksize) || msize < P9_IOHDRSZ + blksize)
+		return 0;
+	return rounddown_pow_of_two(msize - P9_IOHDRSZ);
 }
+
 /* 9p operation functions */
 
 static int p9_op_version(struct p9_server *s, struct p9_fcall *in,
@@ -217,11 +301,20 @@ static int p9_op_version(struct p9_server *s, struct p9_fcall *in,
 	u32 msize;
 	char *version;
 
-	p9pdu_readf(in, "ds", &msize, &version);
+	if (p9pdu_readf(in, "ds", &msize, &version))
+		return -EINVAL;
+	if (msize < P9_MIN_MSIZE) {
+		kfree(version);
+		return -EINVAL;
+	}
+	/* The transports are sized for s->msize, not the client's wish. */
+	msize = min(msize, s->msize);
+	p9s_debug("version : msize %u\n", msize);
 
-	if (!strcmp(version, "9P2000.L"))
+	if (!strcmp(version, "9P2000.L")) {
+		WRITE_ONCE(p9_session_of(in)->msize, msize);
 		p9pdu_writef(out, "ds", msize, version);
-	else
+	} else
 		p9pdu_writef(out, "ds", msize, "unknown");
 
 	kfree(version);
@@ -235,26 +328,31 @@ static int p9_op_attach(struct p9_server *s, struct p9_fcall *in,
 	char *uname, *aname;
 	struct p9_qid qid;
 	struct p9_server_fid *fid;
+	struct p9_vfs_file *root;
 	u32 fid_val, afid, uid;
 
-	p9pdu_readf(in, "ddssd", &fid_val, &afid,
-				&uname, &aname, &uid);
+	if (p9pdu_readf(in, "ddssd", &fid_val, &afid,
+				&uname, &aname, &uid))
+		return -EINVAL;
 	p9s_debug("attach : afid %d uname %s aname %s uid %d\n",
 				afid ? afid : -1, uname, aname, uid);
 	kfree(uname);
 	kfree(aname);
 
-	s->uid = uid;
-	fid = lookup_fid(s, fid_val);
-	if (IS_ERR(fid)) {
-		fid = new_fid(s, fid_val, &s->root);
-		if (IS_ERR(fid))
-			return PTR_ERR(fid);
-	}
-
-	err = gen_qid(&fid->path, &qid, NULL);
+	err = s->ops->root(s->fs, &root);
 	if (err)
 		return err;
+	err = gen_qid(s, root, &qid, NULL);
+	if (err) {
+		s->ops->release(root);
+		return err;
+	}
+
+	s->uid = uid;
+	fid = p9_fid_new(s, fid_val, root);
+	if (IS_ERR(fid))
+		return PTR_ERR(fid);
+	p9_fid_put(fid);
 
 	p9s_debug("attached : qid = %x.%llx.%x\n",
 			qid.type, (unsigned long long)qid.path, qid.version);
@@ -270,30 +368,44 @@ static int p9_op_getattr(struct p9_server *s, struct p9_fcall *in,
 	u32 fid_val;
 	u64 request_mask;
 	struct p9_server_fid *fid;
-	struct kstat st;
-	struct p9_qid qid;
-	u64 dev;
+	struct p9_vfs_attr st;
+	struct p9_getattr attr;
 
-	p9pdu_readf(in, "dq", &fid_val, &request_mask);
+	if (p9pdu_read_getattr(in, &fid_val, &request_mask))
+		return -EINVAL;
 	p9s_debug("getattr : fid %d, request_mask %lld\n",
-			fid_val, request_mask);
+			fid_val, (unsigned long long)request_mask);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	err = gen_qid(&fid->path, &qid, &st);
+	err = gen_qid(s, fid->file, &attr.qid, &st);
+	p9_fid_put(fid);
 	if (err)
 		return err;
 
-	dev = new_encode_dev(st.rdev);
-	p9pdu_writef(out, "qQdugqqqqqqqqqqqqqqq",
-		P9_STATS_BASIC, &qid, st.mode, st.uid, st.gid,
-		st.nlink, dev, st.size, st.blksize, st.blocks,
-		st.atime.tv_sec, st.atime.tv_nsec,
-		st.mtime.tv_sec, st.mtime.tv_nsec,
-		st.ctime.tv_sec, st.ctime.tv_nsec,
-		0, 0, 0, 0);
+	attr.valid = P9_STATS_BASIC;
+	attr.mode = st.mode;
+	attr.uid = st.uid;
+	attr.gid = st.gid;
+	attr.nlink = st.nlink;
+	attr.rdev = st.rdev;
+	attr.size = st.size;
+	attr.blksize = p9_io_size(p9_session_of(in), st.blksize) ?:
+		st.blksize;
+	attr.blocks = st.blocks;
+	attr.atime_sec = st.atime_sec;
+	attr.atime_nsec = st.atime_nsec;
+	attr.mtime_sec = st.mtime_sec;
+	attr.mtime_nsec = st.mtime_nsec;
+	attr.ctime_sec = st.ctime_sec;
+	attr.ctime_nsec = st.ctime_nsec;
+	attr.btime_sec = 0;
+	attr.btime_nsec = 0;
+	attr.gen = 0;
+	attr.data_version = 0;
+	p9pdu_write_getattr(out, &attr);
 
 	return 0;
 }
@@ -304,35 +416,41 @@ static int p9_op_clunk(struct p9_server *s, struct p9_fcall *in,
 	u32 fid_val;
 	struct p9_server_fid *fid;
 
-	p9pdu_readf(in, "d", &fid_val);
+	if (p9pdu_read_fid(in, &fid_val))
+		return -EINVAL;
 	p9s_debug("destroy fid : %d\n", fid_val);
-	fid = lookup_fid(s, fid_val);
+	fid = lookup_fid_any(s, fid_val);
 	if (IS_ERR(fid))
 		return 0;
 
-	if (!IS_ERR_OR_NULL(fid->filp))
-		filp_close(fid->filp, NULL);
-
-	rb_erase(&fid->node, &s->fids);
-	kfree(fid);
+	destroy_fid(s, fid);
+	p9_fid_put(fid);
 	p9s_debug("fid : %d destroyed\n", fid_val);
 	return 0;
 }
 
+/*
+ * Walks a private clone of fid's file a name at a time. A walk that
+ * fails on its first name fails; one that fails later returns the qids
+ * it got, and only a complete walk sets newfid.
+ */
 static int p9_op_walk(struct p9_server *s, struct p9_fcall *in,
 					  struct p9_fcall *out)
 {
-	int err;
+	int err = 0;
 	size_t t;
 	u16 nwqid, nwname;
 	u32 fid_val, newfid_val;
-	char *name;
+	struct p9_str name;
 	struct p9_qid qid;
 	struct p9_server_fid *fid, *newfid;
-	struct path new_path;
-	struct dentry *dentry;
+	struct p9_vfs_file *file;
 
-	p9pdu_readf(in, "ddw", &fid_val, &newfid_val, &nwname);
+	if (p9pdu_read_walk(in, &fid_val, &newfid_val, &nwname))
+		return -EINVAL;
+	/* Rwalk is sized for the protocol limit. */
+	if (nwname > P9_MAXWELEM)
+		return -EINVAL;
 
 	/* Get the indicated fid. */
 	fid = lookup_fid(s, fid_val);
@@ -340,108 +458,119 @@ static int p9_op_walk(struct p9_server *s, struct p9_fcall *in,
 		return PTR_ERR(fid);
 
 	/* Check if the newfid already exists. */
-	newfid = lookup_fid(s, newfid_val);
-	if (!IS_ERR(newfid) && newfid_val != fid_val)
-		return -EEXIST;
+	if (newfid_val != fid_val) {
+		newfid = lookup_fid_any(s, newfid_val);
+		if (!IS_ERR(newfid)) {
+			p9_fid_put(newfid);
+			err = -EEXIST;
+			goto out;
+		}
+	}
 
 	p9s_debug("walk : fids %d,%d nwname %ud\n", fid_val,
 			newfid_val, nwname);
 
-	new_path = fid->path;
-	nwqid = 0;
+	err = s->ops->clone(fid->file, &file);
+	if (err)
+		goto out;
 	out->size += sizeof(u16);
 
-	if (nwname) {
-		dentry = fid->path.dentry;
-		for (; nwqid < nwname; nwqid++) {
-			p9pdu_readf(in, "s", &name);
-			p9s_debug("walk : name %s\n", name);
-
-			/* ".." is not allowed. */
-			if (name[0] == '.' && name[1] == '.' && name[2] == '\0')
-				break;
-
-			new_path.dentry =
-				p9_lookup_one_len(name, dentry, strlen(name));
-			kfree(name);
-			if (IS_ERR(new_path.dentry)) {
-				return PTR_ERR(new_path.dentry);
-			} else if (d_really_is_negative(new_path.dentry)) {
-				return -ENOENT;
-			}
-			err = gen_qid(&new_path, &qid, NULL);
-			if (err)
-				return err;
-
-			// TODO: verify if it's valid
-			p9pdu_writef(out, "Q", &qid);
-			p9s_debug("walk : qid = [%d] %x.%llx.%x\n",
-					nwqid, qid.type, qid.path, qid.version);
-
-			if (nwqid)
-				dput(dentry);
-			dentry = new_path.dentry;
+	for (nwqid = 0; nwqid < nwname; nwqid++) {
+		if (p9pdu_read_str(in, &name)) {
+			err = -EINVAL;
+			break;
 		}
+		p9s_debug("walk : name %.*s\n", name.len, name.name);
 
-		if (!nwqid)
-			return err;
+		/* ".." is not allowed, the walk stops there. */
+		if (name.len == 2 && name.name[0] == '.' &&
+		    name.name[1] == '.') {
+			err = -ENOENT;
+			break;
+		}
 
-	} else {
-		/* If nwname is 0, it's equivalent to walking
-		 * to the current directory. */
-		err = gen_qid(&new_path, &qid, NULL);
+		err = check_name(&name);
+		if (!err)
+			err = s->ops->walk(file, name.name, name.len);
+		if (!err)
+			err = gen_qid(s, file, &qid, NULL);
 		if (err)
-			return err;
+			break;
 
-		p9pdu_writef(out, "Q", &qid);
-		p9s_debug("walk : qid = %x.%llx.%x\n",
-				qid.type, qid.path, qid.version);
+		p9pdu_write_qid(out, &qid);
+		p9s_debug("walk : qid = [%d] %x.%llx.%x\n", nwqid, qid.type,
+				(unsigned long long)qid.path, qid.version);
 	}
 
-	if (fid_val == newfid_val) {
-		fid->path = new_path;
+	if (nwqid < nwname) {
+		s->ops->release(file);
+		if (!nwqid)
+			goto out;
+		err = 0;
+	} else if (fid_val == newfid_val) {
+		err = p9_fid_replace(s, fid, file);
+		if (err)
+			goto out;
 	} else {
-		newfid = new_fid(s, newfid_val, &new_path);
-		if (IS_ERR(newfid))
-			return PTR_ERR(newfid);
+		newfid = p9_fid_new(s, newfid_val, file);
+		if (IS_ERR(newfid)) {
+			err = PTR_ERR(newfid);
+			goto out;
+		}
 		newfid->uid = fid->uid;
+		p9_fid_put(newfid);
 	}
 
 	t = out->size;
 	out->size = P9_PDU_HDR_LEN;
-	p9pdu_writef(out, "w", nwqid);
+	p9pdu_write_u16(out, nwqid);
 	out->size = t;
 	p9s_debug("walked : nwqid %d\n", nwqid);
-	return 0;
+out:
+	p9_fid_put(fid);
+	return err;
 }
 
 static int p9_op_statfs(struct p9_server *s, struct p9_fcall *in,
 						struct p9_fcall *out)
 {
 	int err;
-	u64 fsid;
-	u32 fid_val;
+	u32 fid_val, bsize;
 	struct p9_server_fid *fid;
-	struct kstatfs st;
+	struct p9_vfs_statfs st;
 
-	p9pdu_readf(in, "d", &fid_val);
+	if (p9pdu_read_fid(in, &fid_val))
+		return -EINVAL;
 	p9s_debug("Stat : fid %d\n", fid_val);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	err = vfs_statfs(&fid->path, &st);
+	err = s->ops->statfs(fid->file, &st);
+	p9_fid_put(fid);
 	if (err)
 		return err;
 
-	/* FIXME!! f_blocks needs update based on client msize */
-	fsid = (unsigned int) st.f_fsid.val[0] |
-		(unsigned long long)st.f_fsid.val[1] << 32;
+	/*
+	 * Report blocks of the size the guest will read and write in, a
+	 * power of two multiple of the host's. The size is rounded to the
+	 * nearest block, the free space down.
+	 */
+	bsize = p9_io_size(p9_session_of(in), st.bsize);
+	if (bsize > st.bsize) {
+		unsigned int shift = ilog2(bsize / st.bsize);
+
+		st.bsize = bsize;
+		st.blocks = (st.blocks >> shift) +
+			((st.blocks >> (shift - 1)) & 1);
+		st.bfree >>= shift;
+		st.bavail >>= shift;
+	}
 
-	p9pdu_writef(out, "ddqqqqqqd", st.f_type,
-			 st.f_bsize, st.f_blocks, st.f_bfree, st.f_bavail,
-			 st.f_files, st.f_ffree, fsid, st.f_namelen);
+	p9pdu_writef(out, "ddqqqqqqd", st.type,
+			 st.bsize, st.blocks, st.bfree, st.bavail,
+			 st.files, st.ffree, st.fsid, st.namelen);
 
 	return 0;
 }
@@ -463,146 +592,102 @@ static int p9_op_open(struct p9_server *s, struct p9_fcall *in,
 	int err;
 	u32 fid_val, flags;
 	struct p9_qid qid;
+	struct p9_vfs_attr attr;
 	struct p9_server_fid *fid;
 
-	p9pdu_readf(in, "dd", &fid_val, &flags);
-	p9s_debug("open : qid = %x.%llx.%x\n",
-			qid.type, (unsigned long long)qid.path, qid.version);
+	if (p9pdu_read_fid2(in, &fid_val, &flags))
+		return -EINVAL;
+	p9s_debug("open : fid %d flags %x\n", fid_val, flags);
 
 	fid = lookup_fid(s, fid_val);
-
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
-	else if (fid->filp)
-		// TODO: verify if being error is also considered busy
-		return -EBUSY;
-
-	err = gen_qid(&fid->path, &qid, NULL);
 
+	err = gen_qid(s, fid->file, &qid, &attr);
 	if (err)
-		return err;
+		goto out;
 
-	fid->filp =
-		dentry_open(&fid->path, build_openflags(flags), current_cred());
-	if (IS_ERR(fid->filp)) {
-		fid->filp = NULL;
-		return PTR_ERR(fid->filp);
-	}
+	err = s->ops->open(fid->file, build_openflags(flags));
+	if (err)
+		goto out;
 
-	/* FIXME!! need ot send proper iounit  */
-	p9pdu_writef(out, "Qd", &qid, 0L);
+	/* iounit: whole preferred I/O blocks of the file. */
+	p9pdu_write_open(out, &qid, p9_io_size(p9_session_of(in),
+					       attr.blksize));
 	p9s_debug("opened : qid = %x.%llx.%x\n",
 			qid.type, (unsigned long long)qid.path, qid.version);
 
-	return 0;
+out:
+	p9_fid_put(fid);
+	return err;
 }
 
 static int p9_op_create(struct p9_server *s, struct p9_fcall *in,
 						struct p9_fcall *out)
 {
 	int err;
-	char *name;
+	struct p9_str name;
 	u32 dfid_val, flags, mode, gid;
 	struct p9_qid qid;
+	struct p9_vfs_attr attr;
 	struct p9_server_fid *dfid;
-	struct path new_path;
-	struct file *new_filp;
-	struct dentry *dentry;
+	struct p9_vfs_file *file;
 
-	p9pdu_readf(in, "d", &dfid_val);
+	if (p9pdu_readf(in, "dSddd", &dfid_val, &name, &flags, &mode, &gid))
+		return -EINVAL;
+	p9s_debug("create : fid %d name %.*s flags %d mode %d gid %d\n",
+			dfid_val, name.len, name.name, flags, mode, gid);
+	err = check_name(&name);
+	if (err)
+		return err;
 
 	dfid = lookup_fid(s, dfid_val);
-
 	if (IS_ERR(dfid))
 		return PTR_ERR(dfid);
-	else if (dfid->filp)
-		return -EBUSY;
-
-	p9pdu_readf(in, "sddd", &name, &flags, &mode, &gid);
-	p9s_debug("create : fid %d name %s flags %d mode %d gid %d\n",
-			dfid_val, name, flags, mode, gid);
-	dentry = dfid->path.dentry;
-	new_path.mnt = dfid->path.mnt;
-	new_path.dentry = p9_lookup_one_len(name, dentry, strlen(name));
-
-	kfree(name);
-
-	if (IS_ERR(new_path.dentry))
-		return PTR_ERR(new_path.dentry);
-	else if (d_really_is_positive(new_path.dentry)) {
-		pr_notice("create: postive dentry!\n");
-		return -EEXIST;
-	}
 
-	err = vfs_create(dentry->d_inode, new_path.dentry,
-					 mode, build_openflags(flags) & O_EXCL);
+	err = s->ops->create(dfid->file, name.name, name.len,
+			     build_openflags(flags), mode, dfid->uid, gid,
+			     &file, &attr);
 	if (err)
-		return err;
-
-	set_owner(new_path.dentry, dfid->uid, gid);
-	new_filp = dentry_open(&new_path,
-		build_openflags(flags) | O_CREAT, current_cred());
-	if (IS_ERR(new_filp))
-		return PTR_ERR(new_filp);
-
-	err = gen_qid(&new_path, &qid, NULL);
+		goto out;
+	/* dfid now refers to the new file. */
+	err = p9_fid_replace(s, dfid, file);
 	if (err)
-		goto err;
-
-	dfid->path = new_path;
-	dfid->filp = new_filp;
+		goto out;
 
-	p9pdu_writef(out, "Qd", &qid, 0L);
+	p9_vfs_qid(&attr, &qid);
+	p9pdu_write_open(out, &qid, p9_io_size(p9_session_of(in),
+					       attr.blksize));
 	p9s_debug("created : qid = %x.%llx.%x\n",
 			qid.type, (unsigned long long)qid.path, qid.version);
-
-	return 0;
-err:
-	filp_close(new_filp, NULL);
+out:
+	p9_fid_put(dfid);
 	return err;
 }
 
 struct p9_readdir_ctx {
 	size_t i, count;
 	int err;
-	bool is_root;
-
-	struct dir_context ctx;
-	struct path *parent;
-	struct p9_fcall *out;
+	struct p9_fcall *in;
+	struct iov_iter *data;
 
-	struct {
-		struct p9_qid qid;
-		char name[MAX_FILE_NAME];
-		unsigned int d_type;
-	} prev;
+	/* The encoded dirent on its way to the guest buffers. */
+	struct p9_fcall ent;
+	u8 ent_buf[P9_DIRENT_LEN(MAX_FILE_NAME)];
 };
 
-/*
- *	The callback function from iterate_dir.
- *
- *	Note: returning non-zero terminates the executing of iterate_dir.
- *		  However, iterate_dir will still return zero.
- *
- *	Note: weird logic: the offset is of the previous element. So we
- *		  deal with the previous element in each iteration.
- */
-
-static int p9_readdir_cb(struct dir_context *ctx, const char *name, int namlen,
-		loff_t offset, u64 ino, unsigned int d_type)
+/* Writes an entry into the reply, or stops the listing. */
+static int p9_readdir_fill(void *ctx, const char *name, int namlen,
+			   const struct p9_qid *qid, u8 type, u64 next)
 {
-	size_t write_len;
-	struct path path;
-	struct p9_readdir_ctx *_ctx =
-		container_of(ctx, struct p9_readdir_ctx, ctx);
-
-	write_len = sizeof(u8) +	// qid.type
-				sizeof(u32) +	// qid.version
-				sizeof(u64) +	// qid.path
-				sizeof(u64) +	// offset
-				sizeof(u8) +	// d_type
-				sizeof(u16) +	// name.len
-				namlen;					// name
+	struct p9_readdir_ctx *_ctx = ctx;
+	struct p9_fcall *ent = &_ctx->ent;
+	size_t write_len = P9_DIRENT_LEN(namlen);
+
+	if (p9_cancelled(_ctx->in)) {
+		_ctx->err = -EINTR;
+		return 1;
+	}
 
 	if (namlen >= MAX_FILE_NAME) {
 		pr_err("max file name is %d, this file name is %d\n",
@@ -610,67 +695,34 @@ static int p9_readdir_cb(struct dir_context *ctx, const char *name, int namlen,
 		return 1;
 	}
 	// If writing this dirent would cause an overflow,
-	// terminate iterate_dir.
+	// terminate the listing.
 	if (_ctx->i + write_len > _ctx->count)
 		return 1;
 
-	// Writing the previous element with current offset
-	if (_ctx->i) {
-		p9s_debug("readdir_cb: offset %lld	d_type %d  name %s\n",
-			offset, _ctx->prev.d_type, _ctx->prev.name);
-		p9pdu_writef(_ctx->out, "Qqbs", &_ctx->prev.qid, (u64) offset,
-			_ctx->prev.d_type, _ctx->prev.name);
-	}
-
-	/* Prepare the dirent for the next iteration. */
-
-	path.mnt = _ctx->parent->mnt;
-
-	// lookup_one_len doesn't allow the lookup of "." and "..".i
-	// We have to do it ourselves.
-	if (namlen == 1 && name[0] == '.')
-		path.dentry = _ctx->parent->dentry;
-	else if (namlen == 2 && name[0] == '.' && name[1] == '.')
-		// No ".." allowed on the mount root
-		path.dentry = _ctx->is_root ?
-			_ctx->parent->dentry : _ctx->parent->dentry->d_parent;
-	else
-		path.dentry =
-			p9_lookup_one_len(name, _ctx->parent->dentry, namlen);
-
-	if (IS_ERR(path.dentry)) {
-		_ctx->err = PTR_ERR(path.dentry);
-		goto out;
-	} else if (d_really_is_negative(path.dentry)) {
-		_ctx->err = -ENOENT;
-		goto out;
+	p9s_debug("readdir_fill: offset %llu	type %d  name %.*s\n",
+			(unsigned long long)next, type, namlen, name);
+	ent->size = 0;
+	p9pdu_write_dirent(ent, qid, next, type, name, namlen);
+	if (copy_to_iter(ent->sdata, ent->size, _ctx->data) != ent->size) {
+		_ctx->err = -EFAULT;
+		return 1;
 	}
 
-	_ctx->err = gen_qid(&path, &_ctx->prev.qid, NULL);
-	if (_ctx->err)
-		goto out;
-
-	strncpy(_ctx->prev.name, name, namlen);
-	_ctx->prev.name[namlen] = 0;
-	_ctx->prev.d_type = d_type;
-
 	_ctx->i += write_len;
-out:
-	return _ctx->err;
+	return 0;
 }
 
-static int p9_op_readdir(struct p9_server *s, struct p9_fcall *in,
-						 struct p9_fcall *out)
+static int p9_op_readdirv(struct p9_server *s, struct p9_fcall *in,
+			  struct p9_fcall *out, struct iov_iter *data)
 {
 	int err;
 	u32 dfid_val, count;
 	u64 offset;
 	struct p9_server_fid *dfid;
-	struct p9_readdir_ctx _ctx = {
-		.ctx.actor = p9_readdir_cb
-	};
+	struct p9_readdir_ctx _ctx;
 
-	p9pdu_readf(in, "dqd", &dfid_val, &offset, &count);
+	if (p9pdu_read_io(in, &dfid_val, &offset, &count))
+		return -EINVAL;
 	p9s_debug("readdir : fid %d offset %llu count %d\n",
 			dfid_val, (unsigned long long) offset, count);
 
@@ -678,78 +730,28 @@ static int p9_op_readdir(struct p9_server *s, struct p9_fcall *in,
 	if (IS_ERR(dfid))
 		return PTR_ERR(dfid);
 
-	if (IS_ERR_OR_NULL(dfid->filp))
-		return -EBADF;
-
-	err = vfs_llseek(dfid->filp, offset, SEEK_SET);
-	if (err < 0)
-		return err;
-
-	_ctx.parent = &dfid->path;
-	_ctx.out = out;
+	_ctx.in = in;
+	_ctx.data = data;
 	_ctx.i = 0;
-	_ctx.count = count;
+	_ctx.count = min_t(size_t, count, iov_iter_count(data));
 	_ctx.err = 0;
-	_ctx.is_root = (dfid->path.dentry == s->root.dentry);
-
-	out->size += sizeof(u32);	// Make room for count
+	_ctx.ent.capacity = sizeof(_ctx.ent_buf);
+	_ctx.ent.sdata = _ctx.ent_buf;
 
-	err = iterate_dir(dfid->filp, &_ctx.ctx);
+	err = s->ops->readdir(dfid->file, offset, p9_readdir_fill, &_ctx);
 	if (err)
-		return err;
-	if (_ctx.err)
-		return _ctx.err;
-
-	// Write the last element
-	if (_ctx.i)
-		p9pdu_writef(out, "Qqbs", &_ctx.prev.qid, (u64) _ctx.ctx.pos,
-				_ctx.prev.d_type, _ctx.prev.name);
+		goto out;
+	err = _ctx.err;
+	if (err)
+		goto out;
 
-	out->size = P9_PDU_HDR_LEN;
-	p9pdu_writef(out, "d", _ctx.i); // Total bytes written
+	/* The entries are already in place, out only holds the count. */
+	p9pdu_write_u32(out, _ctx.i); // Total bytes written
 	out->size += _ctx.i;
 
-	return 0;
-}
-
-static int p9_op_read(struct p9_server *s, struct p9_fcall *in,
-					  struct p9_fcall *out)
-{
-	u32 fid_val, count;
-	u64 offset;
-	ssize_t len;
-	struct p9_server_fid *fid;
-	mm_segment_t fs;
-
-	p9pdu_readf(in, "dqd", &fid_val, &offset, &count);
-	p9s_debug("read : fid %d offset %llu count %d\n",
-			fid_val, (unsigned long long) offset, count);
-
-	fid = lookup_fid(s, fid_val);
-	if (IS_ERR(fid))
-		return PTR_ERR(fid);
-
-	if (IS_ERR_OR_NULL(fid->filp))
-		return -EBADF;
-
-	out->size += sizeof(u32);
-
-	if (count + out->size > out->capacity)
-		count = out->capacity - out->size;
-
-	fs = get_fs();
-	set_fs(KERNEL_DS);
-	len = vfs_read(fid->filp, out->sdata + out->size, count, &offset);
-	set_fs(fs);
-
-	if (len < 0)
-		return len;
-
-	out->size = P9_PDU_HDR_LEN;
-	p9pdu_writef(out, "d", (u32) len);
-	out->size += len;
-
-	return 0;
+out:
+	p9_fid_put(dfid);
+	return err;
 }
 
 static int p9_op_readv(struct p9_server *s, struct p9_fcall *in,
@@ -759,154 +761,62 @@ static int p9_op_readv(struct p9_server *s, struct p9_fcall *in,
 	u64 offset;
 	ssize_t len;
 	struct p9_server_fid *fid;
-	mm_segment_t fs;
 
-	p9pdu_readf(in, "dqd", &fid_val, &offset, &count);
+	if (p9pdu_read_io(in, &fid_val, &offset, &count))
+		return -EINVAL;
+	p9s_debug("read : fid %d offset %llu count %d\n",
+			fid_val, (unsigned long long) offset, count);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	if (IS_ERR_OR_NULL(fid->filp))
-		return -EBADF;
-
-	if (data->count > count)
-		data->count = count;
-
-	fs = get_fs();
-	set_fs(KERNEL_DS);
-	len = vfs_iter_read(fid->filp, data, &offset);
-	set_fs(fs);
-
+	iov_iter_truncate(data, count);
+	len = s->ops->read(fid->file, data, offset, in);
 	if (len < 0)
-		return len;
+		goto out;
 
-	p9pdu_writef(out, "d", (u32) len);
+	p9pdu_write_u32(out, (u32) len);
 	out->size += len;
 
-	return 0;
+out:
+	p9_fid_put(fid);
+	return len < 0 ? len : 0;
 }
 
-#define ATTR_MASK	127
-
 static int p9_op_setattr(struct p9_server *s, struct p9_fcall *in,
 						 struct p9_fcall *out)
 {
-	int err = 0;
+	int err;
 	u32 fid_val;
+	kuid_t uid;
+	kgid_t gid;
 	struct p9_server_fid *fid;
-	struct p9_iattr_dotl p9attr;
-	struct iattr iattr;
-	struct dentry *dentry;
-
-	p9pdu_readf(in, "dddugqqqqq", &fid_val,
-				&p9attr.valid, &p9attr.mode,
-				&p9attr.uid, &p9attr.gid, &p9attr.size,
-				&p9attr.atime_sec, &p9attr.atime_nsec,
-				&p9attr.mtime_sec, &p9attr.mtime_nsec);
+	struct p9_vfs_iattr ia;
+
+	if (p9pdu_readf(in, "dddugqqqqq", &fid_val,
+				&ia.valid, &ia.mode, &uid, &gid, &ia.size,
+				&ia.atime_sec, &ia.atime_nsec,
+				&ia.mtime_sec, &ia.mtime_nsec))
+		return -EINVAL;
+	ia.uid = from_kuid(&init_user_ns, uid);
+	ia.gid = from_kgid(&init_user_ns, gid);
 	p9s_debug("setattr : fid %d, valid %x, mode %x, uid %d, gid %d\n"
 			"size %lld, at_sec %lld, at_nsec %lld\n"
 			"mt_sec %lld, mt_nsec %lld\n",
-			fid_val, p9attr.valid, p9attr.mode,
-				p9attr.uid.val, p9attr.gid.val, p9attr.size,
-				p9attr.atime_sec, p9attr.atime_nsec,
-				p9attr.mtime_sec, p9attr.mtime_nsec);
-
+			fid_val, ia.valid, ia.mode, ia.uid, ia.gid,
+			(long long)ia.size,
+			(long long)ia.atime_sec, (long long)ia.atime_nsec,
+			(long long)ia.mtime_sec, (long long)ia.mtime_nsec);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
-	dentry = fid->path.dentry;
-	memset(&iattr, 0, sizeof(struct iattr));
 
-	if (p9attr.valid & ATTR_MODE) {
-		iattr.ia_valid |= ATTR_MODE | ATTR_CTIME;
-		iattr.ia_mode = p9attr.mode;
-		iattr.ia_ctime = current_time(dentry->d_inode);
-	}
-
-	if (p9attr.valid & ATTR_ATIME) {
-		iattr.ia_valid |= ATTR_ATIME;
-		if (p9attr.valid & ATTR_ATIME_SET) {
-			iattr.ia_valid |= ATTR_ATIME_SET;
-			iattr.ia_atime.tv_sec = p9attr.atime_sec;
-			iattr.ia_atime.tv_nsec = p9attr.atime_nsec;
-		} else
-			iattr.ia_atime.tv_nsec = UTIME_NOW;
-	} else
-		iattr.ia_atime.tv_nsec = UTIME_OMIT;
-
-	if (p9attr.valid & ATTR_MTIME) {
-		iattr.ia_valid |= ATTR_MTIME;
-		if (p9attr.valid & ATTR_MTIME_SET) {
-			iattr.ia_valid |= ATTR_MTIME_SET;
-			iattr.ia_mtime.tv_sec = p9attr.mtime_sec;
-			iattr.ia_mtime.tv_nsec = p9attr.mtime_nsec;
-		} else
-			iattr.ia_mtime.tv_nsec = UTIME_NOW;
-	} else
-		iattr.ia_mtime.tv_nsec = UTIME_OMIT;
-
-	if (p9attr.valid & ATTR_UID) {
-		iattr.ia_valid |= ATTR_UID;
-		iattr.ia_uid.val = p9attr.uid.val;
-	}
-	if (p9attr.valid & ATTR_GID) {
-		iattr.ia_valid |= ATTR_GID;
-		iattr.ia_gid.val = p9attr.gid.val;
-	}
-	if (p9attr.valid & ATTR_CTIME) {
-		iattr.ia_valid |= ATTR_CTIME;
-		iattr.ia_ctime = current_time(dentry->d_inode);
-	}
-	if (iattr.ia_valid) {
-		inode_lock(dentry->d_inode);
-		err = notify_change(dentry, &iattr, NULL);
-		inode_unlock(dentry->d_inode);
-		if (err < 0)
-			return err;
-	}
-	if (p9attr.valid & ATTR_SIZE) {
-		err = vfs_truncate(&fid->path, p9attr.size);
-		if (err < 0)
-			return err;
-	}
+	err = s->ops->setattr(fid->file, &ia);
 	p9s_debug("setattr : fid %d\n", fid->fid);
-	return 0;
-}
-
-static int p9_op_write(struct p9_server *s, struct p9_fcall *in,
-		struct p9_fcall *out)
-{
-	u64 offset;
-	u32 fid_val, count;
-	ssize_t len;
-	struct p9_server_fid *fid;
-	mm_segment_t fs;
-
-	p9pdu_readf(in, "dqd", &fid_val, &offset, &count);
-	p9s_debug("write : fid %d offset %llu count %d\n",
-			fid_val, (unsigned long long) offset, count);
-
-	fid = lookup_fid(s, fid_val);
-	if (IS_ERR(fid))
-		return PTR_ERR(fid);
-
-	if (IS_ERR_OR_NULL(fid->filp))
-		return -EBADF;
-
-	fs = get_fs();
-	set_fs(KERNEL_DS);
-	len = vfs_write(fid->filp, in->sdata + in->offset, count, &offset);
-	set_fs(fs);
-
-	if (len < 0)
-		return len;
-
-	p9_clear_sugid(s, fid);
-	p9pdu_writef(out, "d", (u32) len);
-	p9s_debug("wrote : count %d\n", count);
-	return 0;
+	p9_fid_put(fid);
+	return err;
 }
 
 static int p9_op_writev(struct p9_server *s, struct p9_fcall *in,
@@ -917,54 +827,51 @@ static int p9_op_writev(struct p9_server *s, struct p9_fcall *in,
 	ssize_t len;
 	struct p9_server_fid *fid;
 
-	p9pdu_readf(in, "dqd", &fid_val, &offset, &count);
+	if (p9pdu_read_io(in, &fid_val, &offset, &count))
+		return -EINVAL;
+	p9s_debug("write : fid %d offset %llu count %d\n",
+			fid_val, (unsigned long long) offset, count);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	if (IS_ERR_OR_NULL(fid->filp))
-		return -EBADF;
-
-	if (data->count > count)
-		data->count = count;
-
-	len = vfs_iter_write(fid->filp, data, &offset);
+	iov_iter_truncate(data, count);
+	len = s->ops->write(fid->file, data, offset, in);
 	if (len < 0)
-		return len;
+		goto out;
 
 	p9_clear_sugid(s, fid);
-	p9pdu_writef(out, "d", (u32) len);
-	return 0;
+	p9pdu_write_u32(out, (u32) len);
+	p9s_debug("wrote : count %zd\n", len);
+out:
+	p9_fid_put(fid);
+	return len < 0 ? len : 0;
 }
 
 static int p9_op_unlinkat(struct p9_server *s, struct p9_fcall *in,
 						struct p9_fcall *out)
 {
-	u32 fid_val;
-	char *name;
+	u32 fid_val, flags;
+	struct p9_str name;
 	struct p9_server_fid *fid;
-	struct dentry *dentry;
 	int err;
 
-	p9pdu_readf(in, "ds", &fid_val, &name);
+	if (p9pdu_readf(in, "dSd", &fid_val, &name, &flags))
+		return -EINVAL;
+	p9s_debug("unlinkat : fid %d, name %.*s flags %x\n", fid_val,
+			name.len, name.name, flags);
+	err = check_name(&name);
+	if (err)
+		return err;
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	p9s_debug("unlinkat : fid %d, name %s\n", fid_val, name);
-	dentry = p9_lookup_one_len(name, fid->path.dentry, strlen(name));
-	kfree(name);
-	if (d_really_is_negative(dentry))
-		return -ENOENT;
-
-	if (S_ISDIR(dentry->d_inode->i_mode))
-		err = vfs_rmdir(dentry->d_parent->d_inode, dentry);
-	else
-		err = vfs_unlink(dentry->d_parent->d_inode, dentry, NULL);
-
-	p9s_debug("unlinkat : success\n");
+	err = s->ops->unlinkat(fid->file, name.name, name.len,
+			       flags & AT_REMOVEDIR);
+	p9_fid_put(fid);
 	return err;
 }
 
@@ -973,97 +880,82 @@ static int p9_op_remove(struct p9_server *s, struct p9_fcall *in,
 {
 	u32 fid_val;
 	struct p9_server_fid *fid;
-	struct dentry *dentry;
 	int err;
 
-	p9pdu_readf(in, "d", &fid_val);
+	if (p9pdu_readf(in, "d", &fid_val))
+		return -EINVAL;
 	p9s_debug("remove : fid %d\n", fid_val);
 
-	fid = lookup_fid(s, fid_val);
+	fid = lookup_fid_any(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	dentry = fid->path.dentry;
-
-	// TODO: null check
-	if (d_really_is_negative(dentry))
-		return -ENOENT;
-
-	if (S_ISDIR(dentry->d_inode->i_mode))
-		err = vfs_rmdir(dentry->d_parent->d_inode, dentry);
+	if (fid->stale)
+		err = -ESTALE;
 	else
-		err = vfs_unlink(dentry->d_parent->d_inode, dentry, NULL);
+		err = s->ops->remove(fid->file);
 
-	rb_erase(&fid->node, &s->fids);
+	/* Tremove clunks the fid even if the remove failed. */
+	destroy_fid(s, fid);
 	p9s_debug("fid : %d is removed\n", fid->fid);
+	p9_fid_put(fid);
 	return err;
 }
 
-// TODO: resolve this hack
-extern int vfs_path_lookup(struct dentry *dentry, struct vfsmount *mnt,
-			const char *name, unsigned int flags,
-			struct path *path);
-
 static int p9_op_rename(struct p9_server *s, struct p9_fcall *in,
 						struct p9_fcall *out)
 {
 	int err;
-	u32 fid_val, newfid_val;
-	char *path;
-	struct p9_server_fid *fid, *newfid;
-	struct dentry *old_dentry, *new_dentry;
-	struct path new_path;
-
-	p9pdu_readf(in, "d", &fid_val);
+	u32 fid_val, dfid_val;
+	struct p9_str name;
+	struct p9_server_fid *fid, *dfid;
+
+	if (p9pdu_readf(in, "ddS", &fid_val, &dfid_val, &name))
+		return -EINVAL;
+	p9s_debug("rename : fid %d dfid %d name %.*s\n", fid_val, dfid_val,
+			name.len, name.name);
+	err = check_name(&name);
+	if (err)
+		return err;
 
 	fid = lookup_fid(s, fid_val);
-
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	p9pdu_readf(in, "ds", &newfid_val, &path);
-	p9s_debug("rename : fid %d newfid %d\n", fid_val, newfid_val);
-
-	err = vfs_path_lookup(fid->path.dentry, fid->path.mnt, path,
-		LOOKUP_RENAME_TARGET, &new_path);
-	if (err < 0) {
-		kfree(path);
-		return err;
+	dfid = lookup_fid(s, dfid_val);
+	if (IS_ERR(dfid)) {
+		err = PTR_ERR(dfid);
+		goto out;
 	}
 
-	// TODO: security: new dir under the root
-
-	newfid = new_fid(s, newfid_val, &new_path);
-	p9s_debug("rename : newfid %d\n", newfid->fid);
-
-	kfree(path);
-
-	if (IS_ERR(newfid))
-		return PTR_ERR(newfid);
-
-	old_dentry = fid->path.dentry;
-	new_dentry = newfid->path.dentry;
-
-	return vfs_rename(old_dentry->d_parent->d_inode, old_dentry,
-		new_dentry->d_parent->d_inode, new_dentry, NULL, 0);
+	err = s->ops->rename(fid->file, dfid->file, name.name, name.len);
+	p9_fid_put(dfid);
+out:
+	p9_fid_put(fid);
+	return err;
 }
 
 static int p9_op_renameat(struct p9_server *s, struct p9_fcall *in,
 						struct p9_fcall *out)
 {
-	int err = 0;
+	int err;
 	u32 oldfid_val, newfid_val;
-	char *oldname = NULL, *newname = NULL;
+	struct p9_str oldname, newname;
 	struct p9_server_fid *oldfid, *newfid;
-	struct dentry *old_dentry, *new_dentry;
 
-	p9pdu_readf(in, "dsds", &oldfid_val,  &oldname, &newfid_val, &newname);
+	if (p9pdu_readf(in, "dSdS", &oldfid_val, &oldname, &newfid_val,
+			&newname))
+		return -EINVAL;
+	p9s_debug("renameat: oldfid %d, oldname %.*s, newfid %d, newname %.*s\n",
+			oldfid_val, oldname.len, oldname.name,
+			newfid_val, newname.len, newname.name);
+	err = check_name(&oldname) ?: check_name(&newname);
+	if (err)
+		return err;
 
 	oldfid = lookup_fid(s, oldfid_val);
-	if (IS_ERR(oldfid)) {
-		err = PTR_ERR(oldfid);
-		goto out;
-	}
+	if (IS_ERR(oldfid))
+		return PTR_ERR(oldfid);
 
 	newfid = lookup_fid(s, newfid_val);
 	if (IS_ERR(newfid)) {
@@ -1071,34 +963,11 @@ static int p9_op_renameat(struct p9_server *s, struct p9_fcall *in,
 		goto out;
 	}
 
-	p9s_debug("renameat: oldfid %d, oldname %s, newfid %d, newname %s\n",
-			oldfid_val, oldname, newfid_val, newname);
-
-	old_dentry = p9_lookup_one_len(oldname, oldfid->path.dentry,
-					 strlen(oldname));
-	if (IS_ERR(old_dentry)) {
-		err = PTR_ERR(old_dentry);
-		goto out;
-	} else if (!d_really_is_positive(old_dentry)) {
-		pr_err("renameat: source file %s doesn't exist!\n", oldname);
-		err = -ENOENT;
-		goto out;
-	}
-
-	new_dentry = p9_lookup_one_len(newname, newfid->path.dentry,
-					 strlen(newname));
-	if (IS_ERR(new_dentry)) {
-		err = PTR_ERR(new_dentry);
-		goto out;
-	}
-	p9s_debug("renameat: call vfs_rename\n");
-
-	err = vfs_rename(old_dentry->d_parent->d_inode, old_dentry,
-				new_dentry->d_parent->d_inode, new_dentry,
-				NULL, 0);
+	err = s->ops->renameat(oldfid->file, oldname.name, oldname.len,
+			       newfid->file, newname.name, newname.len);
+	p9_fid_put(newfid);
 out:
-	kfree(oldname);
-	kfree(newname);
+	p9_fid_put(oldfid);
 	return err;
 }
 
@@ -1107,51 +976,35 @@ static int p9_op_mkdir(struct p9_server *s, struct p9_fcall *in,
 {
 	int err;
 	u32 dfid_val, mode, gid;
-	char *name;
+	struct p9_str name;
 	struct p9_qid qid;
+	struct p9_vfs_attr attr;
 	struct p9_server_fid *dfid;
-	struct path new_path;
-	struct dentry *dentry;
 
-	p9pdu_readf(in, "d", &dfid_val);
+	if (p9pdu_readf(in, "dSdd", &dfid_val, &name, &mode, &gid))
+		return -EINVAL;
+	p9s_debug("mkdir : fid %d name %.*s mode %d gid %d\n",
+			dfid_val, name.len, name.name, mode, gid);
+	err = check_name(&name);
+	if (err)
+		return err;
 
 	dfid = lookup_fid(s, dfid_val);
-
 	if (IS_ERR(dfid))
 		return PTR_ERR(dfid);
 
-	p9pdu_readf(in, "sdd", &name, &mode, &gid);
-	p9s_debug("mkdir : fid %d name %s mode %d gid %d\n",
-			dfid->fid, name, mode, gid);
-
-	dentry = dfid->path.dentry;
-	new_path.mnt = dfid->path.mnt;
-	new_path.dentry = p9_lookup_one_len(name, dentry, strlen(name));
-
-	kfree(name);
-
-	if (IS_ERR(new_path.dentry)) {
-		return PTR_ERR(new_path.dentry);
-	} else if (d_really_is_positive(new_path.dentry)) {
-		p9s_debug("mkdir : postive dentry!\n");
-		return -EEXIST;
-	}
-
-	// TODO: verify dfid's inode is valid
-
-	err = vfs_mkdir(dentry->d_inode, new_path.dentry, mode);
-	if (err < 0)
-		return err;
-	set_owner(new_path.dentry, dfid->uid, gid);
-	err = gen_qid(&new_path, &qid, NULL);
+	err = s->ops->mkdir(dfid->file, name.name, name.len, mode,
+			    dfid->uid, gid, &attr);
 	if (err)
-		return err;
+		goto out;
 
-	p9pdu_writef(out, "Qd", &qid, 0L);
+	p9_vfs_qid(&attr, &qid);
+	p9pdu_writef(out, "Q", &qid);
 	p9s_debug("mkdir : qid = %x.%llx.%x\n",
 			qid.type, (unsigned long long)qid.path, qid.version);
-
-	return 0;
+out:
+	p9_fid_put(dfid);
+	return err;
 }
 
 static int p9_op_symlink(struct p9_server *s, struct p9_fcall *in,
@@ -1160,140 +1013,130 @@ static int p9_op_symlink(struct p9_server *s, struct p9_fcall *in,
 	int err;
 	u32 fid_val, gid;
 	struct p9_qid qid;
+	struct p9_vfs_attr attr;
 	struct p9_server_fid *fid;
-	char *name, *dst;
-	struct path symlink_path;
-
-	p9pdu_readf(in, "d", &fid_val);
-	p9s_debug("symlink : fid %d\n", fid_val);
+	struct p9_str name;
+	char *dst;
+
+	/* The backends want a C string, so only the target is copied. */
+	if (p9pdu_readf(in, "dSsd", &fid_val, &name, &dst, &gid))
+		return -EINVAL;
+	p9s_debug("symlink : fid %d name %.*s  dst %s\n", fid_val,
+			name.len, name.name, dst);
+	err = check_name(&name);
+	if (err)
+		goto out_dst;
 
 	fid = lookup_fid(s, fid_val);
-
-	if (IS_ERR(fid))
-		return PTR_ERR(fid);
-
-	p9pdu_readf(in, "ssd", &name, &dst, &gid);
-	p9s_debug("symlink : name %s  dst %s\n", name, dst);
-
-	symlink_path.mnt = fid->path.mnt;
-	symlink_path.dentry =
-		p9_lookup_one_len(name, fid->path.dentry, strlen(name));
-	kfree(name);
-
-	if (d_really_is_positive(symlink_path.dentry)) {
-		kfree(dst);
-		return -EEXIST;
+	if (IS_ERR(fid)) {
+		err = PTR_ERR(fid);
+		goto out_dst;
 	}
 
 	// TODO: security: symlink target must be strictly under the root
 
-	err = vfs_symlink(fid->path.dentry->d_inode, symlink_path.dentry, dst);
-
-	kfree(dst);
-
-	if (err < 0)
-		return err;
-
-	err = gen_qid(&symlink_path, &qid, NULL);
+	err = s->ops->symlink(fid->file, name.name, name.len, dst,
+			      fid->uid, gid, &attr);
+	p9_fid_put(fid);
 	if (err)
-		return err;
+		goto out_dst;
 
+	p9_vfs_qid(&attr, &qid);
 	p9pdu_writef(out, "Q", &qid);
 	p9s_debug("symlink : qid = %x.%llx.%x\n",
 			qid.type, (unsigned long long)qid.path, qid.version);
-
-	return 0;
+out_dst:
+	kfree(dst);
+	return err;
 }
 
 static int p9_op_link(struct p9_server *s, struct p9_fcall *in,
 					  struct p9_fcall *out)
 {
-	char *name;
+	int err;
+	struct p9_str name;
 	u32 dfid_val, fid_val;
 	struct p9_server_fid *dfid, *fid;
-	struct dentry *new_dentry;
 
-	p9pdu_readf(in, "dd", &dfid_val, &fid_val);
-	p9s_debug("link : dfid %d fid %d\n", dfid_val, fid_val);
+	if (p9pdu_readf(in, "ddS", &dfid_val, &fid_val, &name))
+		return -EINVAL;
+	p9s_debug("link : dfid %d fid %d name %.*s\n", dfid_val, fid_val,
+			name.len, name.name);
+	err = check_name(&name);
+	if (err)
+		return err;
 
 	fid = lookup_fid(s, fid_val);
-
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
 	dfid = lookup_fid(s, dfid_val);
-
-	if (IS_ERR(dfid))
-		return PTR_ERR(dfid);
-
-	p9pdu_readf(in, "s", &name);
-	p9s_debug("link : name %s\n", name);
-
-	new_dentry = p9_lookup_one_len(name, dfid->path.dentry, strlen(name));
-
-	kfree(name);
-
-	if (IS_ERR(new_dentry)) {
-		return PTR_ERR(new_dentry);
-	} else if (d_really_is_positive(new_dentry)) {
-		pr_notice("link: postive dentry!\n");
-		return -EEXIST;
+	if (IS_ERR(dfid)) {
+		err = PTR_ERR(dfid);
+		goto out;
 	}
 
-	// TODO: make sure dfid dentry is positive
-
-	return vfs_link(fid->path.dentry, dfid->path.dentry->d_inode,
-			new_dentry, NULL);
+	err = s->ops->link(dfid->file, name.name, name.len, fid->file);
+	p9_fid_put(dfid);
+out:
+	p9_fid_put(fid);
+	return err;
 }
-// TODO: put path
+
 static int p9_op_readlink(struct p9_server *s, struct p9_fcall *in,
 						  struct p9_fcall *out)
 {
 	u32 fid_val;
 	struct p9_server_fid *fid;
-	struct dentry *dentry;
-	const char *link = NULL;
-	DEFINE_DELAYED_CALL(done);
+	char *link;
+	ssize_t len;
 
-	p9pdu_readf(in, "d", &fid_val);
+	if (p9pdu_readf(in, "d", &fid_val))
+		return -EINVAL;
 	p9s_debug("readlink : fid %d\n", fid_val);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	dentry = fid->path.dentry;
+	link = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!link) {
+		p9_fid_put(fid);
+		return -ENOMEM;
+	}
 
 	// TODO: security check
-	link = vfs_get_link(dentry, &done);
-	if (IS_ERR(link))
-		return PTR_ERR(link);
-
-	p9pdu_writef(out, "s", link);
-	p9s_debug("readlink : path %s\n", link);
-	return 0;
+	len = s->ops->readlink(fid->file, link, PATH_MAX);
+	p9_fid_put(fid);
+	if (len >= PATH_MAX)
+		len = -ENAMETOOLONG;
+	if (len >= 0) {
+		link[len] = '\0';
+		p9pdu_writef(out, "s", link);
+		p9s_debug("readlink : path %s\n", link);
+	}
+	kfree(link);
+	return len < 0 ? len : 0;
 }
 
 static int p9_op_fsync(struct p9_server *s, struct p9_fcall *in,
 					   struct p9_fcall *out)
 {
-	int err = -EBADFD;
+	int err;
 	u32 fid_val, datasync;
 	struct p9_server_fid *fid;
 
-	p9pdu_readf(in, "dd", &fid_val, &datasync);
+	if (p9pdu_readf(in, "dd", &fid_val, &datasync))
+		return -EINVAL;
 	p9s_debug("fsync : fid %d datasync:%d\n", fid_val, datasync);
 
 	fid = lookup_fid(s, fid_val);
 	if (IS_ERR(fid))
 		return PTR_ERR(fid);
 
-	// TODO: verify that filp can't be error
-
-	if (!IS_ERR_OR_NULL(fid->filp))
-		err = vfs_fsync(fid->filp, datasync);
-
+	err = s->ops->fsync(fid->file, datasync);
 	p9s_debug("fsync : fid %d\n", fid->fid);
+	p9_fid_put(fid);
 
 	return err;
 }
@@ -1303,115 +1146,120 @@ static int p9_op_mknod(struct p9_server *s, struct p9_fcall *in,
 					   struct p9_fcall *out)
 {
 	int err;
-	char *name;
+	struct p9_str name;
 	u32 dfid_val, mode, major, minor, gid;
 	struct p9_qid qid;
+	struct p9_vfs_attr attr;
 	struct p9_server_fid *dfid;
-	struct path new_path;
-	struct dentry *dentry;
 
-	p9pdu_readf(in, "d", &dfid_val);
+	if (p9pdu_readf(in, "dSdddd", &dfid_val, &name, &mode, &major,
+			&minor, &gid))
+		return -EINVAL;
+	p9s_debug("mknod : name %.*s mode %d major %d minor %d\n",
+		name.len, name.name, mode, major, minor);
+	err = check_name(&name);
+	if (err)
+		return err;
 
 	dfid = lookup_fid(s, dfid_val);
-
 	if (IS_ERR(dfid))
 		return PTR_ERR(dfid);
 
-	p9pdu_readf(in, "sdddd", &name, &mode, &major, &minor, &gid);
-	p9s_debug("mknod : name %s mode %d major %d minor %d\n",
-		name, mode, major, minor);
-
-	dentry = dfid->path.dentry;
-	new_path.mnt = dfid->path.mnt;
-	new_path.dentry = p9_lookup_one_len(name, dentry, strlen(name));
-
-	kfree(name);
-
-	if (IS_ERR(new_path.dentry)) {
-		return PTR_ERR(new_path.dentry);
-	} else if (d_really_is_positive(new_path.dentry)) {
-		pr_notice("mknod: postive dentry!\n");
-		return -EEXIST;
-	}
-
-	err = vfs_mknod(dentry->d_inode, new_path.dentry,
-			mode, MKDEV(major, minor));
-
-	if (err < 0)
-		return err;
-
-	set_owner(new_path.dentry, dfid->uid, gid);
-
-	err = gen_qid(&new_path, &qid, NULL);
+	err = s->ops->mknod(dfid->file, name.name, name.len, mode, major,
+			    minor, dfid->uid, gid, &attr);
 	if (err)
-		return err;
+		goto out;
 
+	p9_vfs_qid(&attr, &qid);
 	p9pdu_writef(out, "Q", &qid);
 	p9s_debug("mknod : qid = %x.%llx.%x\n",
 			qid.type, (unsigned long long)qid.path, qid.version);
-
-	return 0;
+out:
+	p9_fid_put(dfid);
+	return err;
 }
 
 static int p9_op_lock(struct p9_server *s, struct p9_fcall *in,
 					  struct p9_fcall *out)
 {
-	u32 fid_val;
-	struct p9_flock flock;
-
-	p9pdu_readf(in, "dbdqqds", &fid_val, &flock.type,
-				&flock.flags, &flock.start, &flock.length,
-				&flock.proc_id, &flock.client_id);
-	p9s_debug("lock : fid %d type %i flags %d,\
-			start %lld length %lld proc_id %d client_id %s\n",
-			fid_val, flock.type, flock.flags, flock.start,
-			flock.length, flock.proc_id, flock.client_id);
-
-	kfree(flock.client_id);
+	u8 type;
+	u32 fid_val, flags, proc_id;
+	u64 start, length;
+	struct p9_str client_id;
+
+	if (p9pdu_readf(in, "dbdqqdS", &fid_val, &type, &flags, &start,
+			&length, &proc_id, &client_id))
+		return -EINVAL;
+	p9s_debug("lock : fid %d type %i flags %d start %lld length %lld proc_id %d client_id %.*s\n",
+			fid_val, type, flags, (long long)start,
+			(long long)length, proc_id,
+			client_id.len, client_id.name);
 
 	/* Just return success */
-	p9pdu_writef(out, "d", (u8) P9_LOCK_SUCCESS);
+	p9pdu_writef(out, "b", (u8) P9_LOCK_SUCCESS);
 	return 0;
 }
 
 static int p9_op_getlock(struct p9_server *s, struct p9_fcall *in,
 						 struct p9_fcall *out)
 {
-	u32 fid_val;
-	struct p9_getlock glock;
-
-	p9pdu_readf(in, "dbqqds", &fid_val, &glock.type,
-				&glock.start, &glock.length, &glock.proc_id,
-				&glock.client_id);
-	p9s_debug("getlock : fid %d, type %i start %lld,\
-		length %lld proc_id %d client_id %s\n", fid_val, glock.type,
-		glock.start, glock.length, glock.proc_id, glock.client_id);
+	u8 type;
+	u32 fid_val, proc_id;
+	u64 start, length;
+	struct p9_str client_id;
+
+	if (p9pdu_readf(in, "dbqqdS", &fid_val, &type, &start, &length,
+			&proc_id, &client_id))
+		return -EINVAL;
+	p9s_debug("getlock : fid %d, type %i start %lld length %lld proc_id %d client_id %.*s\n",
+		fid_val, type, (long long)start, (long long)length, proc_id,
+		client_id.len, client_id.name);
 
 	/* Just return success */
-	glock.type = F_UNLCK;
-	p9pdu_writef(out, "bqqds", glock.type,
-				 glock.start, glock.length, glock.proc_id,
-				 glock.client_id);
-	p9s_debug("getlock : type %i start %lld,\
-		length %lld proc_id %d client_id %s\n", glock.type,
-		glock.start, glock.length, glock.proc_id, glock.client_id);
-
-	kfree(glock.client_id);
+	type = F_UNLCK;
+	p9pdu_writef(out, "bqqdS", type, start, length, proc_id, &client_id);
 	return 0;
 }
 
 static int p9_op_flush(struct p9_server *s, struct p9_fcall *in,
 					   struct p9_fcall *out)
 {
-	u16 tag, oldtag;
+	u16 oldtag;
 
-	p9pdu_readf(in, "ww", &tag, &oldtag);
+	/* The tag is in the header, only oldtag follows. */
+	if (p9pdu_readf(in, "w", &oldtag))
+		return -EINVAL;
 	p9s_debug("flush : tag %d\n", oldtag);
-	p9pdu_writef(out, "w", tag);
 
+	/* The transport holds a Tflush back until oldtag has replied, so
+	 * there is nothing left to do; Rflush has no body.
+	 */
 	return 0;
 }
 
+static int p9_op_ioprio(struct p9_server *s, struct p9_fcall *in,
+			struct p9_fcall *out)
+{
+	int err;
+	u32 fid_val;
+	u16 prio;
+	struct p9_server_fid *fid;
+
+	if (p9pdu_readf(in, "dw", &fid_val, &prio))
+		return -EINVAL;
+	p9s_debug("ioprio : fid %d ioprio %x\n", fid_val, prio);
+
+	if (!s->ops->ioprio)
+		return -EOPNOTSUPP;
+
+	fid = lookup_fid(s, fid_val);
+	if (IS_ERR(fid))
+		return PTR_ERR(fid);
+	err = s->ops->ioprio(fid->file, prio);
+	p9_fid_put(fid);
+	return err;
+}
+
 typedef int p9_server_op(struct p9_server *s, struct p9_fcall *in,
 			struct p9_fcall *out);
 
@@ -1428,7 +1276,7 @@ static p9_server_op *p9_ops[] = {
 	[P9_TSETATTR]	  = p9_op_setattr,
 //	[P9_TXATTRWALK]   = p9_op_xattrwalk,	// Not implemented
 //	[P9_TXATTRCREATE] = p9_op_xattrcreate,	// Not implemented
-	[P9_TREADDIR]	  = p9_op_readdir,
+//	[P9_TREADDIR]	  = p9_op_readdirv,	// See do_9p_request
 	[P9_TFSYNC]		  = p9_op_fsync,
 	[P9_TLOCK]		  = p9_op_lock,
 	[P9_TGETLOCK]	  = p9_op_getlock,
@@ -1436,6 +1284,7 @@ static p9_server_op *p9_ops[] = {
 	[P9_TMKDIR]		  = p9_op_mkdir,
 	[P9_TRENAMEAT]	  = p9_op_renameat,
 	[P9_TUNLINKAT]	  = p9_op_unlinkat,
+	[P9_TIOPRIO]	  = p9_op_ioprio,
 //Not supported. No easy way to implement besides syscalls
 	[P9_TVERSION]	  = p9_op_version,
 //	[P9_TAUTH]		  = p9_op_auth, // Not implemented
@@ -1445,8 +1294,8 @@ static p9_server_op *p9_ops[] = {
 	[P9_TWALK]		  = p9_op_walk,
 //	[P9_TOPEN]		  = p9_op_open, // Not supported in 9P2000.L
 //	[P9_TCREATE]	  = p9_op_create,	// Not supported in 9P2000.L
-	[P9_TREAD]		  = p9_op_read,
-	[P9_TWRITE]		  = p9_op_write,
+//	[P9_TREAD]		  = p9_op_readv,	// See do_9p_request
+//	[P9_TWRITE]		  = p9_op_writev,	// See do_9p_request
 	[P9_TCLUNK]		  = p9_op_clunk,
 	[P9_TREMOVE]	  = p9_op_remove,
 //	[P9_TSTAT]		  = p9_op_stat, // Not implemented
@@ -1474,6 +1323,7 @@ static const char * const translate[] = {
 	[P9_TMKDIR]		  = "mkdir",
 	[P9_TRENAMEAT]	  = "renameat",
 	[P9_TUNLINKAT]	  = "unlinkat",
+	[P9_TIOPRIO]	  = "ioprio",
 	[P9_TVERSION]	  = "version",
 	[P9_TAUTH]		  = "auth",
 	[P9_TATTACH]	  = "attach",
@@ -1490,62 +1340,46 @@ static const char * const translate[] = {
 	[P9_TWSTAT]		  = "wstat",
 };
 
-struct p9_header {
-	uint32_t size;
-	uint8_t id;
-	uint16_t tag;
-} __packed;
-
-struct p9_io_header {
-	uint32_t size;
-	uint8_t id;
-	uint16_t tag;
-	uint32_t fid;
-	uint64_t offset;
-	uint32_t count;
-} __packed;
-
-static struct p9_fcall *new_pdu(size_t size)
-{
-	struct p9_fcall *pdu;
-
-	pdu = kmalloc(sizeof(struct p9_fcall) + size, GFP_KERNEL);
-	pdu->size = 0;	// write offset
-	pdu->offset = 0;	// read offset
-	pdu->capacity = size;
-	pdu->sdata = (void *)pdu + sizeof(struct p9_fcall);
-	// Make the data area right after the pdu structure
-
-	return pdu;
-}
-
-static size_t pdu_fill(struct p9_fcall *pdu, struct iov_iter *from, size_t size)
+static size_t p9_reply_nomem(u16 tag, struct iov_iter *resp)
 {
-	size_t ret, len;
-
-	len = min(pdu->capacity - pdu->size, size);
-	ret = copy_from_iter(&pdu->sdata[pdu->size], len, from);
+	u8 buf[sizeof(struct p9_header) + sizeof(u32)];
+	struct p9_fcall out = {
+		.capacity = sizeof(buf),
+		.sdata = buf,
+	};
 
-	pdu->size += ret;
-	return size - ret;
+	p9pdu_write_hdr(&out, sizeof(buf), P9_RLERROR, tag);
+	p9pdu_write_u32(&out, ENOMEM);
+	return copy_to_iter(buf, out.size, resp);
 }
 
-void do_9p_request(struct p9_server *s, struct iov_iter *req,
-		struct iov_iter *resp)
+size_t do_9p_request(struct p9_server *s, struct p9_session *session,
+		struct iov_iter *req, struct iov_iter *resp,
+		struct p9_cancel *cancel, struct p9_pdu_pool *pool)
 {
 	int err = -EOPNOTSUPP;
 	u8 cmd;
+	size_t size, len;
 	struct iov_iter data;
 	struct p9_fcall *in, *out;
-	struct p9_io_header *hdr;
+	struct p9_io_header head, *hdr = &head;
 	// Assume the operation is an IO operation to save additional
 	// copy_from_iter.
 
-	in = new_pdu(req->count);
-	out = new_pdu(resp->count);
+	memset(hdr, 0, sizeof(*hdr));
+	len = copy_from_iter(hdr, sizeof(*hdr), req);
 
-	pdu_fill(in, req, sizeof(struct p9_io_header));
-	hdr = (struct p9_io_header *)in->sdata;
+	in = p9_pdu_new(p9_pdu_in_size(hdr, len + req->count),
+			READ_ONCE(s->node), session, cancel, pool);
+	out = p9_pdu_new(p9_pdu_out_size(hdr, resp->count),
+			 READ_ONCE(s->node), NULL, NULL, pool);
+	if (unlikely(!in || !out)) {
+		size = p9_reply_nomem(hdr->tag, resp);
+		goto out_free;
+	}
+
+	memcpy(in->sdata, hdr, len);
+	in->size = len;
 
 	in->offset = out->size = sizeof(struct p9_header);
 	in->tag = out->tag = hdr->tag;
@@ -1554,38 +1388,33 @@ void do_9p_request(struct p9_server *s, struct iov_iter *req,
 
 	p9s_debug("do_9p_request: %s! %d\n", translate[cmd], in->tag);
 
-	if (cmd < ARRAY_SIZE(p9_ops) && p9_ops[cmd]) {
-		if (cmd == P9_TREAD || cmd == P9_TWRITE) {
-			/* Do zero-copy for large IO */
-			if (hdr->count > 1024) {
-				if (cmd == P9_TREAD) {
-					iov_iter_clone(&data, resp);
-					iov_iter_advance(&data,
-						sizeof(struct p9_header) +
-						sizeof(u32));
-					resp->count = sizeof(struct p9_header) +
-						sizeof(u32);
-
-					err = p9_op_readv(s, in, out, &data);
-				} else
-					err = p9_op_writev(s, in, out, req);
-			} else {
-				if (cmd == P9_TWRITE) {
-					pdu_fill(in, req, hdr->count);
-					err = p9_op_write(s, in, out);
-				} else
-					err = p9_op_read(s, in, out);
-			}
-		} else {
-			/* Copy the rest data */
-			if (hdr->size > sizeof(struct p9_io_header))
-				pdu_fill(in, req, hdr->size -
-						sizeof(struct p9_io_header));
-
-			err = p9_ops[cmd](s, in, out);
-		}
-
-		kfree(in);
+	if (p9_cancelled(in)) {
+		/* Flushed before it started. */
+		err = -EINTR;
+	} else if (cmd == P9_TREAD || cmd == P9_TREADDIR) {
+		/*
+		 * The data or dirents go straight into the guest buffers
+		 * behind the header and count, which are staged in out and
+		 * written last, once their values are known.
+		 */
+		iov_iter_clone(&data, resp);
+		iov_iter_advance(&data, sizeof(struct p9_header) + sizeof(u32));
+		resp->count = sizeof(struct p9_header) + sizeof(u32);
+
+		if (cmd == P9_TREAD)
+			err = p9_op_readv(s, in, out, &data);
+		else
+			err = p9_op_readdirv(s, in, out, &data);
+	} else if (cmd == P9_TWRITE) {
+		/* The data is left in the guest buffers, behind the header. */
+		err = p9_op_writev(s, in, out, req);
+	} else if (cmd < ARRAY_SIZE(p9_ops) && p9_ops[cmd]) {
+		/* Copy the rest data */
+		if (hdr->size > sizeof(struct p9_io_header))
+			p9_pdu_fill(in, req, hdr->size -
+					sizeof(struct p9_io_header));
+
+		err = p9_ops[cmd](s, in, out);
 	} else {
 		if (cmd < ARRAY_SIZE(p9_ops))
 			pr_warn("!!!not implemented: %s\n", translate[cmd]);
@@ -1597,39 +1426,70 @@ void do_9p_request(struct p9_server *s, struct iov_iter *req,
 		pr_err("9p request error: %d\n", err);
 		/* Compose an error reply */
 		out->size = 0;
-		p9pdu_writef(out, "dbwd",
-			sizeof(struct p9_header) + sizeof(u32),
-			P9_RLERROR, out->tag, (u32) -err);
+		p9pdu_write_hdr(out, sizeof(struct p9_header) + sizeof(u32),
+				P9_RLERROR, out->tag);
+		p9pdu_write_u32(out, (u32) -err);
 	} else {
 		size_t t = out->size;
 
 		out->size = 0;
-		p9pdu_writef(out, "dbw", t, out->id, out->tag);
+		p9pdu_write_hdr(out, t, out->id, out->tag);
 		out->size = t;
 	}
 
+	size = out->size;
 	copy_to_iter(out->sdata, out->size, resp);
-	kfree(out);
+out_free:
+	if (in)
+		p9_pdu_free(in);
+	if (out)
+		p9_pdu_free(out);
+
+	/* Number of bytes of the reply, including zero-copy data. */
+	return size;
 }
 
-struct p9_server *p9_server_create(struct path *root)
+struct p9_server *p9_server_new(const struct p9_vfs_ops *ops, void *fs)
 {
 	struct p9_server *s;
 
-	pr_info("9p server create!\n");
-
 	s = kmalloc(sizeof(struct p9_server), GFP_KERNEL);
 	if (!s)
-		return ERR_PTR(-ENOMEM);
+		return NULL;
+	s->fids = p9_fid_buckets_alloc(P9_FID_HASH_MIN_BITS);
+	if (!s->fids) {
+		kfree(s);
+		return NULL;
+	}
+	s->fid_bits = P9_FID_HASH_MIN_BITS;
+	s->nr_fids = 0;
 
-	s->root = *root;
-	s->fids = RB_ROOT;
+	s->ops = ops;
+	s->fs = fs;
+	s->uid = 0;
+	s->node = NUMA_NO_NODE;
+	s->msize = 0;
+	spin_lock_init(&s->fid_lock);
 
 	return s;
 }
 
-void p9_server_close(struct p9_server *s)
+void p9_server_clear(struct p9_server *s)
 {
-	if (!IS_ERR_OR_NULL(s))
-		kfree(s);
+	struct p9_server_fid *fid;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	p9_for_each_fid_safe(s, bkt, tmp, fid) {
+		hlist_del_init(&fid->node);
+		s->nr_fids--;
+		p9_fid_put(fid);
+	}
+}
+
+void p9_server_free(struct p9_server *s)
+{
+	p9_server_clear(s);
+	kvfree(s->fids);
+	kfree(s);
 }
@@ -0,0 +1,209 @@
+/*
+ *	PDU buffers of the 9p server: sized by opcode and recycled through
+ *	the pool of the queue or socket serving them.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#include "p9-compat.h"
+#include "9p-server.h"
+
+/* A PDU and, for requests, the Tflush state of the request. */
+struct p9_server_pdu {
+	struct p9_fcall fcall;
+	struct p9_session *session;
+	struct p9_cancel *cancel;
+	struct p9_pdu_pool *pool;
+	int class;
+};
+
+#define P9_PDU_SMALL_SIZE 512
+#define P9_PDU_LARGE_SIZE 8192
+
+/* Allocation size of each PDU class, the header included. */
+static const size_t p9_pdu_class_size[P9_PDU_CLASSES] = {
+	[P9_PDU_SMALL] = P9_PDU_SMALL_SIZE,
+	[P9_PDU_LARGE] = P9_PDU_LARGE_SIZE,
+};
+
+/* Largest PDU: no message left in a PDU carries more than a path and a
+ * name (Tsymlink) or a path (Rreadlink).
+ */
+const size_t P9_PDU_MAX = P9_PDU_LARGE_SIZE - sizeof(struct p9_server_pdu);
+
+bool p9_cancelled(struct p9_fcall *in)
+{
+	struct p9_cancel *c = container_of(in, struct p9_server_pdu,
+					   fcall)->cancel;
+
+	return c && READ_ONCE(c->cancelled);
+}
+
+struct p9_pdu_pool *p9_pdu_pool_of(struct p9_fcall *pdu)
+{
+	return container_of(pdu, struct p9_server_pdu, fcall)->pool;
+}
+
+struct p9_session *p9_session_of(struct p9_fcall *in)
+{
+	return container_of(in, struct p9_server_pdu, fcall)->session;
+}
+
+void p9_pdu_pool_init(struct p9_pdu_pool *pool)
+{
+	spin_lock_init(&pool->lock);
+	memset(pool->nr, 0, sizeof(pool->nr));
+}
+
+/* Frees the cached buffers, the pool stays usable. */
+void p9_pdu_pool_drain(struct p9_pdu_pool *pool)
+{
+	void *bufs[P9_PDU_CLASSES][P9_PDU_POOL_DEPTH];
+	unsigned int nr[P9_PDU_CLASSES];
+	int c, i;
+
+	spin_lock(&pool->lock);
+	memcpy(bufs, pool->free, sizeof(bufs));
+	memcpy(nr, pool->nr, sizeof(nr));
+	memset(pool->nr, 0, sizeof(pool->nr));
+	spin_unlock(&pool->lock);
+
+	for (c = 0; c < P9_PDU_CLASSES; c++)
+		for (i = 0; i < nr[c]; i++)
+			kfree(bufs[c][i]);
+}
+
+/* Bytes of the buffers cached by pool. */
+size_t p9_pdu_pool_mem(struct p9_pdu_pool *pool)
+{
+	size_t bytes = 0;
+	int c;
+
+	spin_lock(&pool->lock);
+	for (c = 0; c < P9_PDU_CLASSES; c++)
+		bytes += pool->nr[c] * p9_pdu_class_size[c];
+	spin_unlock(&pool->lock);
+	return bytes;
+}
+
+/*
+ * PDUs are sized by what the message can hold, so all of them fit one
+ * of two small classes whose buffers the pool recycles. size is capped
+ * at P9_PDU_MAX.
+ */
+struct p9_fcall *p9_pdu_new(size_t size, int node,
+			    struct p9_session *session,
+			    struct p9_cancel *cancel,
+			    struct p9_pdu_pool *pool)
+{
+	struct p9_server_pdu *spdu = NULL;
+	struct p9_fcall *pdu;
+	int c;
+
+	size = min_t(size_t, size, P9_PDU_MAX);
+	c = sizeof(*spdu) + size <= p9_pdu_class_size[P9_PDU_SMALL] ?
+		P9_PDU_SMALL : P9_PDU_LARGE;
+
+	if (pool) {
+		spin_lock(&pool->lock);
+		if (pool->nr[c])
+			spdu = pool->free[c][--pool->nr[c]];
+		spin_unlock(&pool->lock);
+	}
+	if (!spdu) {
+		spdu = kmalloc_node(p9_pdu_class_size[c], GFP_KERNEL, node);
+		if (!spdu)
+			return NULL;
+	}
+	spdu->session = session;
+	spdu->cancel = cancel;
+	spdu->pool = pool;
+	spdu->class = c;
+	pdu = &spdu->fcall;
+	pdu->size = 0;	// write offset
+	pdu->offset = 0;	// read offset
+	pdu->capacity = size;
+	pdu->sdata = (void *)spdu + sizeof(*spdu);
+	// Make the data area right after the pdu structure
+
+	return pdu;
+}
+
+void p9_pdu_free(struct p9_fcall *pdu)
+{
+	struct p9_server_pdu *spdu =
+		container_of(pdu, struct p9_server_pdu, fcall);
+	struct p9_pdu_pool *pool = spdu->pool;
+	int c = spdu->class;
+
+	if (pool) {
+		spin_lock(&pool->lock);
+		if (pool->nr[c] < P9_PDU_POOL_DEPTH) {
+			pool->free[c][pool->nr[c]++] = spdu;
+			spdu = NULL;
+		}
+		spin_unlock(&pool->lock);
+	}
+	kfree(spdu);
+}
+
+size_t p9_pdu_fill(struct p9_fcall *pdu, struct iov_iter *from, size_t size)
+{
+	size_t ret, len;
+
+	len = min(pdu->capacity - pdu->size, size);
+	ret = copy_from_iter(&pdu->sdata[pdu->size], len, from);
+
+	pdu->size += ret;
+	return size - ret;
+}
+
+/*
+ * The descriptors are sized for msize, but reads, readdirs and writes
+ * go straight between the file and the guest buffers and most
+ * other messages are short. Size the PDUs from the header instead.
+ */
+size_t p9_pdu_in_size(struct p9_io_header *hdr, size_t avail)
+{
+	if (hdr->id == P9_TWRITE)
+		return sizeof(*hdr);
+	return max(min_t(size_t, hdr->size, avail), sizeof(*hdr));
+}
+
+/* The largest reply body to the request, or to Rlerror. */
+static size_t p9_pdu_reply_max(struct p9_io_header *hdr)
+{
+	switch (hdr->id) {
+	case P9_TREAD:
+	case P9_TREADDIR:
+		return sizeof(u32);	/* count, the payload bypasses out */
+	case P9_TGETATTR:
+		return 153;
+	case P9_TSTATFS:
+		return 60;
+	case P9_TWALK:
+		return sizeof(u16) + P9_MAXWELEM * 13;
+	case P9_TREADLINK:
+		return sizeof(u16) + PATH_MAX;
+	case P9_TVERSION:
+	case P9_TGETLOCK:
+		/* They echo a string of the request. */
+		return hdr->size;
+	default:
+		/* A qid and an iounit. */
+		return 13 + sizeof(u32);
+	}
+}
+
+size_t p9_pdu_out_size(struct p9_io_header *hdr, size_t avail)
+{
+	return min(sizeof(struct p9_header) + p9_pdu_reply_max(hdr), avail);
+}
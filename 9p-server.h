@@ -0,0 +1,174 @@
+/*
+ *	The 9p server core shared by the module and the vhost-user daemon:
+ *	the fid table, the PDUs and the request entry point. Files come from
+ *	a backend, see 9p-vfs.h.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#ifndef _9P_SERVER_H
+#define _9P_SERVER_H
+
+#include "p9-compat.h"
+
+//#define DEBUG 1
+#ifdef DEBUG
+#define p9s_debug(fmt, ...)           \
+    pr_info(fmt, ##__VA_ARGS__)
+#else
+#define p9s_debug(fmt, ...)           \
+    no_printk(fmt, ##__VA_ARGS__)
+#endif
+
+struct p9_vfs_ops;
+struct p9_vfs_file;
+
+struct p9_header {
+	uint32_t size;
+	uint8_t id;
+	uint16_t tag;
+} __packed;
+
+struct p9_io_header {
+	uint32_t size;
+	uint8_t id;
+	uint16_t tag;
+	uint32_t fid;
+	uint64_t offset;
+	uint32_t count;
+} __packed;
+
+/*
+ * 9P extension: size[4] Tioprio tag[2] fid[4] ioprio[2], answered with
+ * an empty Rioprio. Sets the I/O priority, an ioprio_set(2) value, that
+ * reads, writes and fsyncs on the fid are issued with. 0 goes back to
+ * the device default; the realtime class is refused. Buffered writes
+ * only dirty the page cache; their writeback is issued by the flusher
+ * threads at their own priority, unless an fsync gets to it first.
+ */
+#define P9_TIOPRIO 84
+#define P9_RIOPRIO 85
+
+/*
+ * The 9P session of one client connection: a vhost device or a socket.
+ * Each negotiates its own msize, though they share a server.
+ */
+struct p9_session {
+	/* msize agreed by the last Tversion, 0 before one. */
+	u32 msize;
+};
+
+/* Buckets of the fid table, which doubles as fids are added. */
+#define P9_FID_HASH_MIN_BITS 6
+#define P9_FID_HASH_MAX_BITS 20
+
+struct p9_server {
+	const struct p9_vfs_ops *ops;
+	void *fs;
+	u32 uid;
+	/* Protects the fid table. Request queues run concurrently. */
+	spinlock_t fid_lock;
+	/* The fid table: nr_fids fids hashed into 1 << fid_bits buckets. */
+	struct hlist_head *fids;
+	unsigned int fid_bits;
+	unsigned int nr_fids;
+	/* Largest msize Tversion agrees to. */
+	u32 msize;
+	/* Node fids and PDUs are allocated on. */
+	int node;
+};
+
+/*
+ * A fid holds a file of the backend. Lookups return it with an extra
+ * reference, which the caller drops with p9_fid_put(). The file of a fid
+ * never changes: Twalk and Tlcreate that move a fid to another file put
+ * a new fid in its place, and requests holding the old one finish on
+ * the old file.
+ */
+struct p9_server_fid {
+	u32 fid;
+	u32 uid;
+	struct p9_vfs_file *file;
+	/* Of the server, to release file with. */
+	const struct p9_vfs_ops *ops;
+	/* Restored without a file, see struct vhost_9p_fid_rec. */
+	bool stale;
+	struct hlist_node node;
+	struct kref ref;
+};
+
+/* Every fid of s, under fid_lock unless no request may be running. */
+#define p9_for_each_fid(s, bkt, fid) \
+	for ((bkt) = 0; (bkt) < 1U << (s)->fid_bits; (bkt)++) \
+		hlist_for_each_entry(fid, &(s)->fids[bkt], node)
+#define p9_for_each_fid_safe(s, bkt, tmp, fid) \
+	for ((bkt) = 0; (bkt) < 1U << (s)->fid_bits; (bkt)++) \
+		hlist_for_each_entry_safe(fid, tmp, &(s)->fids[bkt], node)
+
+/* A server over the files of fs, without fids. */
+struct p9_server *p9_server_new(const struct p9_vfs_ops *ops, void *fs);
+/* Drop every fid; no request may be running. */
+void p9_server_clear(struct p9_server *s);
+void p9_server_free(struct p9_server *s);
+/* Add fid_val for file, which the fid takes over even on failure. */
+struct p9_server_fid *p9_fid_new(struct p9_server *s, u32 fid_val,
+				 struct p9_vfs_file *file);
+void p9_fid_put(struct p9_server_fid *fid);
+
+/* PDU buffers by allocation size, see p9_pdu_new(). */
+enum {
+	P9_PDU_SMALL,	/* 512 bytes, nearly every message */
+	P9_PDU_LARGE,	/* 8K, a path and a name */
+	P9_PDU_CLASSES,
+};
+
+#define P9_PDU_POOL_DEPTH 16
+
+/* Freed PDU buffers kept for reuse by a queue or a socket. */
+struct p9_pdu_pool {
+	spinlock_t lock;
+	unsigned int nr[P9_PDU_CLASSES];
+	void *free[P9_PDU_CLASSES][P9_PDU_POOL_DEPTH];
+};
+
+/* Lets a Tflush stop the request it flushes, see do_9p_request(). */
+struct p9_cancel {
+	bool cancelled;
+};
+
+/* PDUs, see 9p-pdu.c. */
+extern const size_t P9_PDU_MAX;
+void p9_pdu_pool_init(struct p9_pdu_pool *pool);
+void p9_pdu_pool_drain(struct p9_pdu_pool *pool);
+size_t p9_pdu_pool_mem(struct p9_pdu_pool *pool);
+struct p9_fcall *p9_pdu_new(size_t size, int node,
+			    struct p9_session *session,
+			    struct p9_cancel *cancel,
+			    struct p9_pdu_pool *pool);
+void p9_pdu_free(struct p9_fcall *pdu);
+struct p9_pdu_pool *p9_pdu_pool_of(struct p9_fcall *pdu);
+/* The session the request in came on. */
+struct p9_session *p9_session_of(struct p9_fcall *in);
+/* Whether the request in was flushed by a Tflush. */
+bool p9_cancelled(struct p9_fcall *in);
+size_t p9_pdu_fill(struct p9_fcall *pdu, struct iov_iter *from, size_t size);
+size_t p9_pdu_in_size(struct p9_io_header *hdr, size_t avail);
+size_t p9_pdu_out_size(struct p9_io_header *hdr, size_t avail);
+
+/* Serve one request of session. cancel, if not NULL, is polled at safe
+ * points; a request cancelled before it got far replies with EINTR. The
+ * PDUs come from pool, or straight from kmalloc if it is NULL.
+ */
+size_t do_9p_request(struct p9_server *s, struct p9_session *session,
+		struct iov_iter *req, struct iov_iter *resp,
+		struct p9_cancel *cancel, struct p9_pdu_pool *pool);
+
+#endif /* _9P_SERVER_H */
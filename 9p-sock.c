@@ -0,0 +1,290 @@
+/*
+ *	AF_UNIX socket transport for the in-kernel 9p server
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/cgroup.h>
+#include <linux/net.h>
+#include <linux/socket.h>
+#include <linux/slab.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/uio.h>
+#include <net/sock.h>
+
+#include "vhost-9p.h"
+
+/* Connections a device serves at most. */
+#define P9_SOCK_MAX_CONNS 64
+
+/*
+ * A connected stream socket served by one kthread. Messages are handled
+ * one at a time, in order, with the same do_9p_request as the virtqueues.
+ */
+struct p9_sock_conn {
+	/* On the socks list until the peer hangs up or the device goes. */
+	struct list_head node;
+	struct p9_socks *socks;
+	struct socket *sock;
+	struct p9_server *server;
+	struct task_struct *task;
+	/* One message each way, msize bytes: the server's at attach time. */
+	u32 msize;
+	/* Each connection is a client of its own. */
+	struct p9_session session;
+	char *req;
+	char *resp;
+	struct p9_pdu_pool pdus;
+};
+
+/*
+ * Message buffers are physically contiguous when the allocator can
+ * manage it, so they are reached through the huge pages of the direct
+ * map rather than a 4K vmalloc mapping per page.
+ */
+static void *p9_sock_buf_alloc(size_t size)
+{
+	void *buf;
+
+	buf = alloc_pages_exact(size, GFP_KERNEL | __GFP_NOWARN |
+				__GFP_NORETRY);
+	return buf ?: vmalloc(size);
+}
+
+static void p9_sock_buf_free(void *buf, size_t size)
+{
+	if (!buf)
+		return;
+	if (is_vmalloc_addr(buf))
+		vfree(buf);
+	else
+		free_pages_exact(buf, size);
+}
+
+static int p9_sock_recv(struct socket *sock, void *buf, size_t len)
+{
+	struct kvec iov = { .iov_base = buf, .iov_len = len };
+	struct msghdr msg = { .msg_flags = MSG_WAITALL };
+	int ret;
+
+	ret = kernel_recvmsg(sock, &msg, &iov, 1, len, MSG_WAITALL);
+	if (ret == len)
+		return 0;
+	return ret < 0 ? ret : -ECONNRESET;
+}
+
+static int p9_sock_send(struct socket *sock, void *buf, size_t len)
+{
+	struct kvec iov;
+	struct msghdr msg = { .msg_flags = MSG_NOSIGNAL };
+	int ret;
+
+	while (len) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		ret = kernel_sendmsg(sock, &msg, &iov, 1, len);
+		if (ret <= 0)
+			return ret ? ret : -ECONNRESET;
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void p9_sock_free(struct p9_sock_conn *conn)
+{
+	sockfd_put(conn->sock);
+	p9_pdu_pool_drain(&conn->pdus);
+	p9_sock_buf_free(conn->resp, conn->msize);
+	p9_sock_buf_free(conn->req, conn->msize);
+	kfree(conn);
+}
+
+static int p9_sock_thread(void *data)
+{
+	struct p9_sock_conn *conn = data;
+	struct iov_iter req, resp;
+	struct kvec req_vec, resp_vec;
+	u32 size;
+	size_t len;
+	int err;
+
+	while (!kthread_should_stop()) {
+		err = p9_sock_recv(conn->sock, conn->req, sizeof(u32));
+		if (err)
+			break;
+
+		size = le32_to_cpu(*(__le32 *)conn->req);
+		if (size < sizeof(struct p9_header) || size > conn->msize) {
+			pr_warn("9p sock: bad message size %u\n", size);
+			break;
+		}
+		err = p9_sock_recv(conn->sock, conn->req + sizeof(u32),
+				   size - sizeof(u32));
+		if (err)
+			break;
+
+		req_vec.iov_base = conn->req;
+		req_vec.iov_len = size;
+		iov_iter_kvec(&req, ITER_KVEC | WRITE, &req_vec, 1, size);
+		resp_vec.iov_base = conn->resp;
+		resp_vec.iov_len = conn->msize;
+		iov_iter_kvec(&resp, ITER_KVEC | READ, &resp_vec, 1,
+			      conn->msize);
+
+		/* Requests are served in order, a Tflush has nothing to stop. */
+		len = do_9p_request(conn->server, &conn->session, &req, &resp,
+				    NULL, &conn->pdus);
+		err = p9_sock_send(conn->sock, conn->resp, len);
+		if (err)
+			break;
+	}
+
+	/* The peer went away. Unless the device is already detaching the
+	 * connection, it is ours to free.
+	 */
+	spin_lock(&conn->socks->lock);
+	if (!list_empty(&conn->node)) {
+		list_del_init(&conn->node);
+		conn->socks->count--;
+		spin_unlock(&conn->socks->lock);
+		put_task_struct(conn->task);
+		p9_sock_free(conn);
+		return 0;
+	}
+	spin_unlock(&conn->socks->lock);
+
+	/* Stay around for p9_sock_detach. */
+	while (!kthread_should_stop()) {
+		set_current_state(TASK_INTERRUPTIBLE);
+		if (kthread_should_stop())
+			break;
+		schedule();
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return 0;
+}
+
+/* Serve s on the connected AF_UNIX stream socket fd, tracked on socks. */
+int p9_sock_attach(struct p9_server *s, int fd, struct p9_socks *socks)
+{
+	struct p9_sock_conn *conn;
+	struct socket *sock;
+	int err;
+
+	sock = sockfd_lookup(fd, &err);
+	if (!sock)
+		return err;
+
+	err = -EINVAL;
+	if (sock->sk->sk_family != AF_UNIX || sock->type != SOCK_STREAM)
+		goto err_sock;
+	err = -ENOTCONN;
+	if (sock->state != SS_CONNECTED)
+		goto err_sock;
+
+	err = -ENOMEM;
+	conn = kzalloc(sizeof(*conn), GFP_KERNEL);
+	if (!conn)
+		goto err_sock;
+	conn->sock = sock;
+	conn->socks = socks;
+	conn->server = s;
+	p9_pdu_pool_init(&conn->pdus);
+	conn->msize = s->msize;
+	conn->req = p9_sock_buf_alloc(conn->msize);
+	conn->resp = p9_sock_buf_alloc(conn->msize);
+	if (!conn->req || !conn->resp)
+		goto err_conn;
+
+	conn->task = kthread_create(p9_sock_thread, conn, "9p-sock-%d.%d",
+				    current->pid, fd);
+	if (IS_ERR(conn->task)) {
+		err = PTR_ERR(conn->task);
+		goto err_conn;
+	}
+	/* Like the exec threads, charged to the owner's cgroups. */
+	err = cgroup_attach_task_all(current, conn->task);
+	if (err)
+		goto err_task;
+
+	spin_lock(&socks->lock);
+	if (socks->count >= P9_SOCK_MAX_CONNS) {
+		spin_unlock(&socks->lock);
+		err = -EMFILE;
+		goto err_task;
+	}
+	socks->count++;
+	get_task_struct(conn->task);
+	list_add(&conn->node, &socks->conns);
+	spin_unlock(&socks->lock);
+	wake_up_process(conn->task);
+
+	return 0;
+
+err_task:
+	kthread_stop(conn->task);
+err_conn:
+	p9_sock_buf_free(conn->resp, conn->msize);
+	p9_sock_buf_free(conn->req, conn->msize);
+	kfree(conn);
+err_sock:
+	sockfd_put(sock);
+	return err;
+}
+
+/* Memory held by the connections of socks, see struct vhost_9p_stats. */
+size_t p9_sock_mem(struct p9_socks *socks)
+{
+	struct p9_sock_conn *conn;
+	size_t bytes = 0;
+
+	spin_lock(&socks->lock);
+	list_for_each_entry(conn, &socks->conns, node)
+		bytes += sizeof(*conn) + 2 * PAGE_ALIGN(conn->msize) +
+			THREAD_SIZE + p9_pdu_pool_mem(&conn->pdus);
+	spin_unlock(&socks->lock);
+	return bytes;
+}
+
+static void p9_sock_detach(struct p9_sock_conn *conn)
+{
+	/* Wakes the thread out of recvmsg/sendmsg. */
+	kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+	kthread_stop(conn->task);
+	put_task_struct(conn->task);
+	p9_sock_free(conn);
+}
+
+/* Stop serving the sockets of socks. The server stays with the caller. */
+void p9_sock_detach_all(struct p9_socks *socks)
+{
+	struct p9_sock_conn *conn;
+
+	for (;;) {
+		spin_lock(&socks->lock);
+		conn = list_first_entry_or_null(&socks->conns,
+						struct p9_sock_conn, node);
+		if (conn) {
+			list_del_init(&conn->node);
+			socks->count--;
+		}
+		spin_unlock(&socks->lock);
+		if (!conn)
+			break;
+		p9_sock_detach(conn);
+	}
+}
@@ -0,0 +1,162 @@
+/*
+ *	The filesystem interface the 9p op handlers of 9p-ops.c are written
+ *	against. A backend supplies the files: vfs-kernel.c in the module,
+ *	user/vfs-posix.c in the vhost-user daemon. The handlers never touch
+ *	the host filesystem directly.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#ifndef _P9_VFS_H
+#define _P9_VFS_H
+
+#include "p9-compat.h"
+
+/* A file of the backend, what a fid refers to. */
+struct p9_vfs_file;
+
+struct p9_vfs_attr {
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u64 ino;
+	u64 nlink;
+	u64 rdev;
+	u64 size;
+	u64 blksize;
+	u64 blocks;
+	u64 atime_sec;
+	u64 atime_nsec;
+	u64 mtime_sec;
+	u64 mtime_nsec;
+	u64 ctime_sec;
+	u64 ctime_nsec;
+};
+
+struct p9_vfs_statfs {
+	u32 type;
+	u32 bsize;
+	u64 blocks;
+	u64 bfree;
+	u64 bavail;
+	u64 files;
+	u64 ffree;
+	u64 fsid;
+	u32 namelen;
+};
+
+struct p9_vfs_iattr {
+	u32 valid;		/* P9_ATTR_* of 9P2000.L Tsetattr */
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u64 size;
+	u64 atime_sec;
+	u64 atime_nsec;
+	u64 mtime_sec;
+	u64 mtime_nsec;
+};
+
+#define P9_ATTR_MODE		(1 << 0)
+#define P9_ATTR_UID		(1 << 1)
+#define P9_ATTR_GID		(1 << 2)
+#define P9_ATTR_SIZE		(1 << 3)
+#define P9_ATTR_ATIME		(1 << 4)
+#define P9_ATTR_MTIME		(1 << 5)
+#define P9_ATTR_CTIME		(1 << 6)
+#define P9_ATTR_ATIME_SET	(1 << 7)
+#define P9_ATTR_MTIME_SET	(1 << 8)
+
+/*
+ * One directory entry, next being the offset to resume after it at.
+ * name is NUL-terminated. Returns nonzero to stop the listing, the
+ * entry not taken.
+ */
+typedef int (*p9_vfs_filldir_t)(void *ctx, const char *name, int namlen,
+				const struct p9_qid *qid, u8 type, u64 next);
+
+/*
+ * All operations return 0 or a negative errno. Names are not
+ * NUL-terminated; the handlers have checked they are a single component,
+ * not "." or "..". Operations that make a file return its attributes in
+ * attr. uid and gid are the owner a made file is given.
+ */
+struct p9_vfs_ops {
+	int (*root)(void *fs, struct p9_vfs_file **f);
+	/* Step f to name in it. f is private to the walk, see clone. */
+	int (*walk)(struct p9_vfs_file *f, const char *name, u16 len);
+	/* A file referring to the same as f, not open. */
+	int (*clone)(struct p9_vfs_file *f, struct p9_vfs_file **nf);
+	void (*release)(struct p9_vfs_file *f);
+
+	int (*getattr)(struct p9_vfs_file *f, struct p9_vfs_attr *attr);
+	int (*setattr)(struct p9_vfs_file *f, struct p9_vfs_iattr *ia);
+	int (*statfs)(struct p9_vfs_file *f, struct p9_vfs_statfs *st);
+
+	/* EBUSY if f is already open. */
+	int (*open)(struct p9_vfs_file *f, int flags);
+	/* Create and open name in dir, returned as the file nf. */
+	int (*create)(struct p9_vfs_file *dir, const char *name, u16 len,
+		      int flags, u32 mode, u32 uid, u32 gid,
+		      struct p9_vfs_file **nf, struct p9_vfs_attr *attr);
+	/* Data operations fail with EBADF unless f is open. in is the
+	 * request, for Tflush.
+	 */
+	ssize_t (*read)(struct p9_vfs_file *f, struct iov_iter *data,
+			u64 off, struct p9_fcall *in);
+	ssize_t (*write)(struct p9_vfs_file *f, struct iov_iter *data,
+			 u64 off, struct p9_fcall *in);
+	int (*readdir)(struct p9_vfs_file *f, u64 off,
+		       p9_vfs_filldir_t fill, void *ctx);
+	int (*fsync)(struct p9_vfs_file *f, int datasync);
+
+	int (*mkdir)(struct p9_vfs_file *dir, const char *name, u16 len,
+		     u32 mode, u32 uid, u32 gid, struct p9_vfs_attr *attr);
+	int (*symlink)(struct p9_vfs_file *dir, const char *name, u16 len,
+		       const char *target, u32 uid, u32 gid,
+		       struct p9_vfs_attr *attr);
+	int (*mknod)(struct p9_vfs_file *dir, const char *name, u16 len,
+		     u32 mode, u32 major, u32 minor, u32 uid, u32 gid,
+		     struct p9_vfs_attr *attr);
+	/* Link target as name in dir. */
+	int (*link)(struct p9_vfs_file *dir, const char *name, u16 len,
+		    struct p9_vfs_file *target);
+	/* The target of a symlink, not NUL-terminated. */
+	ssize_t (*readlink)(struct p9_vfs_file *f, char *buf, size_t len);
+	/* flags are those of unlinkat(2): AT_REMOVEDIR or 0. */
+	int (*unlinkat)(struct p9_vfs_file *dir, const char *name, u16 len,
+			int flags);
+	int (*remove)(struct p9_vfs_file *f);
+	int (*rename)(struct p9_vfs_file *f, struct p9_vfs_file *ndir,
+		      const char *name, u16 len);
+	int (*renameat)(struct p9_vfs_file *odir, const char *oname, u16 olen,
+			struct p9_vfs_file *ndir, const char *nname, u16 nlen);
+	/* Optional: the I/O priority data operations on f are issued at. */
+	int (*ioprio)(struct p9_vfs_file *f, u16 prio);
+};
+
+/* The qid of a file, from its attributes. */
+static inline void p9_vfs_qid(const struct p9_vfs_attr *attr,
+			      struct p9_qid *qid)
+{
+	/* TODO: incomplete types */
+	qid->version = attr->mtime_sec;
+	qid->path = attr->ino;
+	qid->type = P9_QTFILE;
+
+	if (S_ISDIR(attr->mode))
+		qid->type |= P9_QTDIR;
+
+	if (S_ISLNK(attr->mode))
+		qid->type |= P9_QTSYMLINK;
+}
+
+#endif /* _P9_VFS_H */
@@ -0,0 +1,455 @@
+/*
+ *	What the shared 9P server code needs from its environment, so that
+ *	protocol.c, 9p-pdu.c and 9p-ops.c build both into the module and
+ *	into the vhost-user daemon.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#ifndef _P9_COMPAT_H
+#define _P9_COMPAT_H
+
+#ifdef __KERNEL__
+
+#include <linux/module.h>
+#include <linux/errno.h>
+#include <linux/err.h>
+#include <linux/fcntl.h>
+#include <linux/hash.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/limits.h>
+#include <linux/list.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/stat.h>
+#include <linux/stddef.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <net/9p/9p.h>
+
+#else /* !__KERNEL__ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <endian.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+#define le16_to_cpu(x) le16toh(x)
+#define le32_to_cpu(x) le32toh(x)
+#define le64_to_cpu(x) le64toh(x)
+#define cpu_to_le16(x) htole16(x)
+#define cpu_to_le32(x) htole32(x)
+#define cpu_to_le64(x) htole64(x)
+
+#define GFP_KERNEL 0
+#define GFP_NOFS 0
+#define __GFP_NOWARN 0
+#define NUMA_NO_NODE (-1)
+#define kmalloc(size, gfp) malloc(size)
+#define kmalloc_node(size, gfp, node) malloc(size)
+#define kzalloc(size, gfp) calloc(1, size)
+#define kcalloc(n, size, gfp) calloc(n, size)
+#define kfree(p) free(p)
+#define vzalloc(size) calloc(1, size)
+#define kvfree(p) free(p)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define swap(a, b) \
+	do { __typeof__(a) __tmp = (a); (a) = (b); (b) = __tmp; } while (0)
+#define ilog2(n) (31 - __builtin_clz((u32)(n)))
+#define is_power_of_2(n) ((n) != 0 && ((n) & ((n) - 1)) == 0)
+#define rounddown_pow_of_two(n) (1U << ilog2(n))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define __packed __attribute__((packed))
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+#define BUG() abort()
+
+#define pr_err(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_notice(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define no_printk(fmt, ...) ((void)0)
+
+#define MAX_ERRNO 4095
+
+static inline void *ERR_PTR(long error)
+{
+	return (void *)error;
+}
+
+static inline long PTR_ERR(const void *ptr)
+{
+	return (long)ptr;
+}
+
+static inline bool IS_ERR(const void *ptr)
+{
+	return (unsigned long)ptr >= (unsigned long)-MAX_ERRNO;
+}
+
+static inline bool IS_ERR_OR_NULL(const void *ptr)
+{
+	return !ptr || IS_ERR(ptr);
+}
+
+/* The daemon serves one request at a time, nothing to lock against. */
+typedef struct { int unused; } spinlock_t;
+#define spin_lock_init(lock) ((void)(lock))
+#define spin_lock(lock) ((void)(lock))
+#define spin_unlock(lock) ((void)(lock))
+
+struct kref {
+	int refcount;
+};
+
+static inline void kref_init(struct kref *kref)
+{
+	kref->refcount = 1;
+}
+
+static inline void kref_get(struct kref *kref)
+{
+	__atomic_add_fetch(&kref->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static inline int kref_put(struct kref *kref,
+			   void (*release)(struct kref *kref))
+{
+	if (__atomic_sub_fetch(&kref->refcount, 1, __ATOMIC_ACQ_REL))
+		return 0;
+	release(kref);
+	return 1;
+}
+
+/* include/linux/list.h and hash.h, as far as the fid table goes. */
+struct hlist_node {
+	struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+	struct hlist_node *first;
+};
+
+static inline void INIT_HLIST_NODE(struct hlist_node *h)
+{
+	h->next = NULL;
+	h->pprev = NULL;
+}
+
+static inline int hlist_unhashed(const struct hlist_node *h)
+{
+	return !h->pprev;
+}
+
+static inline void hlist_add_head(struct hlist_node *n, struct hlist_head *h)
+{
+	n->next = h->first;
+	if (h->first)
+		h->first->pprev = &n->next;
+	h->first = n;
+	n->pprev = &h->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *n)
+{
+	if (hlist_unhashed(n))
+		return;
+	*n->pprev = n->next;
+	if (n->next)
+		n->next->pprev = n->pprev;
+	INIT_HLIST_NODE(n);
+}
+
+#define hlist_entry_safe(ptr, type, member) \
+	({ __typeof__(ptr) ____ptr = (ptr); \
+	   ____ptr ? container_of(____ptr, type, member) : NULL; })
+
+#define hlist_for_each_entry(pos, head, member) \
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*(pos)), member); \
+	     pos; \
+	     pos = hlist_entry_safe((pos)->member.next, __typeof__(*(pos)), \
+				    member))
+
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+	for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+	     pos && ({ n = pos->member.next; 1; }); \
+	     pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+static inline u32 hash_32(u32 val, unsigned int bits)
+{
+	return (val * 0x61C88647u) >> (32 - bits);
+}
+
+/*
+ * include/linux/uio.h, for iovec iterators only. An iterator never sits
+ * at the end of a segment while it has bytes left.
+ */
+#define READ 0
+#define WRITE 1
+
+struct iov_iter {
+	int type;
+	size_t iov_offset;
+	size_t count;
+	const struct iovec *iov;
+	unsigned long nr_segs;
+};
+
+static inline void iov_iter_skip_empty(struct iov_iter *i)
+{
+	while (i->count && i->iov_offset == i->iov->iov_len) {
+		i->iov++;
+		i->nr_segs--;
+		i->iov_offset = 0;
+	}
+}
+
+static inline void iov_iter_init(struct iov_iter *i, int direction,
+				 const struct iovec *iov,
+				 unsigned long nr_segs, size_t count)
+{
+	i->type = direction;
+	i->iov = iov;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+	iov_iter_skip_empty(i);
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+	return i->count;
+}
+
+static inline void iov_iter_truncate(struct iov_iter *i, u64 count)
+{
+	if (i->count > count)
+		i->count = count;
+}
+
+static inline void iov_iter_advance(struct iov_iter *i, size_t bytes)
+{
+	size_t n;
+
+	bytes = min(bytes, i->count);
+	while (bytes) {
+		n = min(bytes, i->iov->iov_len - i->iov_offset);
+		i->iov_offset += n;
+		i->count -= n;
+		bytes -= n;
+		iov_iter_skip_empty(i);
+	}
+}
+
+/* The current segment of a nonempty iterator. */
+static inline void *iov_iter_seg(const struct iov_iter *i, size_t *len)
+{
+	*len = min(i->iov->iov_len - i->iov_offset, i->count);
+	return (char *)i->iov->iov_base + i->iov_offset;
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes,
+				  struct iov_iter *i)
+{
+	size_t done = 0, n;
+	void *p;
+
+	bytes = min(bytes, i->count);
+	while (done < bytes) {
+		p = iov_iter_seg(i, &n);
+		n = min(n, bytes - done);
+		memcpy(p, (const char *)addr + done, n);
+		iov_iter_advance(i, n);
+		done += n;
+	}
+	return done;
+}
+
+static inline size_t copy_from_iter(void *addr, size_t bytes,
+				    struct iov_iter *i)
+{
+	size_t done = 0, n;
+	void *p;
+
+	bytes = min(bytes, i->count);
+	while (done < bytes) {
+		p = iov_iter_seg(i, &n);
+		n = min(n, bytes - done);
+		memcpy((char *)addr + done, p, n);
+		iov_iter_advance(i, n);
+		done += n;
+	}
+	return done;
+}
+
+/* Ids are passed through as they are, there is no user namespace. */
+typedef struct { uint32_t val; } kuid_t;
+typedef struct { uint32_t val; } kgid_t;
+#define init_user_ns 0
+#define make_kuid(ns, v) ((kuid_t){ .val = (v) })
+#define make_kgid(ns, v) ((kgid_t){ .val = (v) })
+#define from_kuid(ns, u) ((u).val)
+#define from_kgid(ns, g) ((g).val)
+
+/* The parts of include/net/9p/9p.h the server uses. */
+enum p9_msg_t {
+	P9_TLERROR = 6,
+	P9_RLERROR,
+	P9_TSTATFS = 8,
+	P9_RSTATFS,
+	P9_TLOPEN = 12,
+	P9_RLOPEN,
+	P9_TLCREATE = 14,
+	P9_RLCREATE,
+	P9_TSYMLINK = 16,
+	P9_RSYMLINK,
+	P9_TMKNOD = 18,
+	P9_RMKNOD,
+	P9_TRENAME = 20,
+	P9_RRENAME,
+	P9_TREADLINK = 22,
+	P9_RREADLINK,
+	P9_TGETATTR = 24,
+	P9_RGETATTR,
+	P9_TSETATTR = 26,
+	P9_RSETATTR,
+	P9_TXATTRWALK = 30,
+	P9_RXATTRWALK,
+	P9_TXATTRCREATE = 32,
+	P9_RXATTRCREATE,
+	P9_TREADDIR = 40,
+	P9_RREADDIR,
+	P9_TFSYNC = 50,
+	P9_RFSYNC,
+	P9_TLOCK = 52,
+	P9_RLOCK,
+	P9_TGETLOCK = 54,
+	P9_RGETLOCK,
+	P9_TLINK = 70,
+	P9_RLINK,
+	P9_TMKDIR = 72,
+	P9_RMKDIR,
+	P9_TRENAMEAT = 74,
+	P9_RRENAMEAT,
+	P9_TUNLINKAT = 76,
+	P9_RUNLINKAT,
+	P9_TVERSION = 100,
+	P9_RVERSION,
+	P9_TAUTH = 102,
+	P9_RAUTH,
+	P9_TATTACH = 104,
+	P9_RATTACH,
+	P9_TERROR = 106,
+	P9_RERROR,
+	P9_TFLUSH = 108,
+	P9_RFLUSH,
+	P9_TWALK = 110,
+	P9_RWALK,
+	P9_TOPEN = 112,
+	P9_ROPEN,
+	P9_TCREATE = 114,
+	P9_RCREATE,
+	P9_TREAD = 116,
+	P9_RREAD,
+	P9_TWRITE = 118,
+	P9_RWRITE,
+	P9_TCLUNK = 120,
+	P9_RCLUNK,
+	P9_TREMOVE = 122,
+	P9_RREMOVE,
+	P9_TSTAT = 124,
+	P9_RSTAT,
+	P9_TWSTAT = 126,
+	P9_RWSTAT,
+};
+
+enum p9_qid_t {
+	P9_QTDIR = 0x80,
+	P9_QTAPPEND = 0x40,
+	P9_QTEXCL = 0x20,
+	P9_QTMOUNT = 0x10,
+	P9_QTAUTH = 0x08,
+	P9_QTTMP = 0x04,
+	P9_QTSYMLINK = 0x02,
+	P9_QTLINK = 0x01,
+	P9_QTFILE = 0x00,
+};
+
+/* Header of Tread/Twrite up to the payload. */
+#define P9_IOHDRSZ 24
+#define P9_MAXWELEM 16
+#define P9_STATS_BASIC 0x000007ffULL
+
+enum p9_lock_status {
+	P9_LOCK_SUCCESS = 0,
+	P9_LOCK_BLOCKED = 1,
+	P9_LOCK_ERROR = 2,
+	P9_LOCK_GRACE = 3,
+};
+
+struct p9_qid {
+	u8 type;
+	u32 version;
+	u64 path;
+};
+
+struct p9_fcall {
+	u32 size;
+	u8 id;
+	u16 tag;
+
+	size_t offset;
+	size_t capacity;
+
+	u8 *sdata;
+};
+
+#endif /* __KERNEL__ */
+
+/* Smallest msize a server accepts in Tversion, the same for the module
+ * and the daemon.
+ */
+#define P9_MIN_MSIZE 4096
+
+#endif /* _P9_COMPAT_H */
@@ -25,14 +25,7 @@
  *
  */
 
-#include <linux/module.h>
-#include <linux/errno.h>
-#include <linux/kernel.h>
-#include <linux/slab.h>
-#include <linux/stddef.h>
-#include <linux/types.h>
-#include <net/9p/9p.h>
-
+#include "p9-compat.h"
 #include "protocol.h"
 
 static size_t pdu_read(struct p9_fcall *pdu, void *data, size_t size)
@@ -55,7 +48,9 @@ static int p9pdu_vreadf(struct p9_fcall *pdu, const char *fmt, va_list ap)
 {
 	const char *ptr;
 	int errcode = 0;
+	va_list args;
 
+	va_copy(args, ap);
 	for (ptr = fmt; *ptr; ptr++) {
 		switch (*ptr) {
 		case 'b':{
@@ -117,6 +112,12 @@ static int p9pdu_vreadf(struct p9_fcall *pdu, const char *fmt, va_list ap)
 					(*sptr)[len] = 0;
 			}
 			break;
+		case 'S':{
+				struct p9_str *str = va_arg(ap, struct p9_str *);
+
+				errcode = p9pdu_read_str(pdu, str);
+			}
+			break;
 		case 'u': {
 				kuid_t *uid = va_arg(ap, kuid_t *);
 				__le32 le_val;
@@ -146,6 +147,23 @@ static int p9pdu_vreadf(struct p9_fcall *pdu, const char *fmt, va_list ap)
 			break;
 	}
 
+	/* Free the strings read before the failure, every argument is a
+	 * pointer.
+	 */
+	if (errcode) {
+		const char *p;
+
+		for (p = fmt; p < ptr; p++) {
+			void *arg = va_arg(args, void *);
+
+			if (*p == 's') {
+				kfree(*(char **)arg);
+				*(char **)arg = NULL;
+			}
+		}
+	}
+	va_end(args);
+
 	return errcode;
 }
 
@@ -192,6 +210,15 @@ static int p9pdu_vwritef(struct p9_fcall *pdu, const char *fmt, va_list ap)
 					errcode = -EFAULT;
 			}
 			break;
+		case 'S':{
+				const struct p9_str *str =
+					va_arg(ap, const struct p9_str *);
+
+				errcode = p9pdu_writef(pdu, "w", str->len);
+				if (!errcode && pdu_write(pdu, str->name, str->len))
+					errcode = -EFAULT;
+			}
+			break;
 		case 'u': {
 				kuid_t uid = va_arg(ap, kuid_t);
 				__le32 val = cpu_to_le32(
@@ -274,3 +301,255 @@ void p9pdu_reset(struct p9_fcall *pdu)
 	pdu->offset = 0;
 	pdu->size = 0;
 }
+
+/* Fixed-layout marshalers, see protocol.h. */
+
+#define P9_QID_SIZE 13
+
+static inline u8 *pdu_put(struct p9_fcall *pdu, size_t len)
+{
+	u8 *p;
+
+	if (pdu->capacity - pdu->size < len)
+		return NULL;
+	p = &pdu->sdata[pdu->size];
+	pdu->size += len;
+	return p;
+}
+
+static inline const u8 *pdu_get(struct p9_fcall *pdu, size_t len)
+{
+	const u8 *p;
+
+	if (pdu->size - pdu->offset < len)
+		return NULL;
+	p = &pdu->sdata[pdu->offset];
+	pdu->offset += len;
+	return p;
+}
+
+static inline u8 *put_le16(u8 *p, u16 v)
+{
+	__le16 x = cpu_to_le16(v);
+
+	memcpy(p, &x, sizeof(x));
+	return p + sizeof(x);
+}
+
+static inline u8 *put_le32(u8 *p, u32 v)
+{
+	__le32 x = cpu_to_le32(v);
+
+	memcpy(p, &x, sizeof(x));
+	return p + sizeof(x);
+}
+
+static inline u8 *put_le64(u8 *p, u64 v)
+{
+	__le64 x = cpu_to_le64(v);
+
+	memcpy(p, &x, sizeof(x));
+	return p + sizeof(x);
+}
+
+static inline u8 *put_qid(u8 *p, const struct p9_qid *qid)
+{
+	*p++ = qid->type;
+	p = put_le32(p, qid->version);
+	return put_le64(p, qid->path);
+}
+
+static inline u16 get_le16(const u8 *p)
+{
+	__le16 x;
+
+	memcpy(&x, p, sizeof(x));
+	return le16_to_cpu(x);
+}
+
+static inline u32 get_le32(const u8 *p)
+{
+	__le32 x;
+
+	memcpy(&x, p, sizeof(x));
+	return le32_to_cpu(x);
+}
+
+static inline u64 get_le64(const u8 *p)
+{
+	__le64 x;
+
+	memcpy(&x, p, sizeof(x));
+	return le64_to_cpu(x);
+}
+
+int p9pdu_read_fid(struct p9_fcall *pdu, u32 *fid)
+{
+	const u8 *p = pdu_get(pdu, 4);
+
+	if (!p)
+		return -EFAULT;
+	*fid = get_le32(p);
+	return 0;
+}
+
+int p9pdu_read_fid2(struct p9_fcall *pdu, u32 *fid, u32 *arg)
+{
+	const u8 *p = pdu_get(pdu, 8);
+
+	if (!p)
+		return -EFAULT;
+	*fid = get_le32(p);
+	*arg = get_le32(p + 4);
+	return 0;
+}
+
+int p9pdu_read_getattr(struct p9_fcall *pdu, u32 *fid, u64 *mask)
+{
+	const u8 *p = pdu_get(pdu, 12);
+
+	if (!p)
+		return -EFAULT;
+	*fid = get_le32(p);
+	*mask = get_le64(p + 4);
+	return 0;
+}
+
+int p9pdu_read_walk(struct p9_fcall *pdu, u32 *fid, u32 *newfid,
+		    u16 *nwname)
+{
+	const u8 *p = pdu_get(pdu, 10);
+
+	if (!p)
+		return -EFAULT;
+	*fid = get_le32(p);
+	*newfid = get_le32(p + 4);
+	*nwname = get_le16(p + 8);
+	return 0;
+}
+
+int p9pdu_read_io(struct p9_fcall *pdu, u32 *fid, u64 *offset, u32 *count)
+{
+	const u8 *p = pdu_get(pdu, 16);
+
+	if (!p)
+		return -EFAULT;
+	*fid = get_le32(p);
+	*offset = get_le64(p + 4);
+	*count = get_le32(p + 12);
+	return 0;
+}
+
+int p9pdu_read_str(struct p9_fcall *pdu, struct p9_str *str)
+{
+	const u8 *p;
+	u16 len;
+
+	if (pdu->size - pdu->offset < 2)
+		return -EFAULT;
+	len = get_le16(&pdu->sdata[pdu->offset]);
+	if (pdu->size - pdu->offset - 2 < len)
+		return -EFAULT;
+	p = pdu_get(pdu, 2 + len);
+	str->name = (const char *)p + 2;
+	str->len = len;
+	return 0;
+}
+
+int p9pdu_write_hdr(struct p9_fcall *pdu, u32 size, u8 id, u16 tag)
+{
+	u8 *p = pdu_put(pdu, 7);
+
+	if (!p)
+		return -EFAULT;
+	p = put_le32(p, size);
+	*p++ = id;
+	put_le16(p, tag);
+	return 0;
+}
+
+int p9pdu_write_u16(struct p9_fcall *pdu, u16 val)
+{
+	u8 *p = pdu_put(pdu, 2);
+
+	if (!p)
+		return -EFAULT;
+	put_le16(p, val);
+	return 0;
+}
+
+int p9pdu_write_u32(struct p9_fcall *pdu, u32 val)
+{
+	u8 *p = pdu_put(pdu, 4);
+
+	if (!p)
+		return -EFAULT;
+	put_le32(p, val);
+	return 0;
+}
+
+int p9pdu_write_qid(struct p9_fcall *pdu, const struct p9_qid *qid)
+{
+	u8 *p = pdu_put(pdu, P9_QID_SIZE);
+
+	if (!p)
+		return -EFAULT;
+	put_qid(p, qid);
+	return 0;
+}
+
+int p9pdu_write_open(struct p9_fcall *pdu, const struct p9_qid *qid,
+		     u32 iounit)
+{
+	u8 *p = pdu_put(pdu, P9_QID_SIZE + 4);
+
+	if (!p)
+		return -EFAULT;
+	p = put_qid(p, qid);
+	put_le32(p, iounit);
+	return 0;
+}
+
+int p9pdu_write_getattr(struct p9_fcall *pdu, const struct p9_getattr *attr)
+{
+	u8 *p = pdu_put(pdu, 8 + P9_QID_SIZE + 3 * 4 + 15 * 8);
+
+	if (!p)
+		return -EFAULT;
+	p = put_le64(p, attr->valid);
+	p = put_qid(p, &attr->qid);
+	p = put_le32(p, attr->mode);
+	p = put_le32(p, attr->uid);
+	p = put_le32(p, attr->gid);
+	p = put_le64(p, attr->nlink);
+	p = put_le64(p, attr->rdev);
+	p = put_le64(p, attr->size);
+	p = put_le64(p, attr->blksize);
+	p = put_le64(p, attr->blocks);
+	p = put_le64(p, attr->atime_sec);
+	p = put_le64(p, attr->atime_nsec);
+	p = put_le64(p, attr->mtime_sec);
+	p = put_le64(p, attr->mtime_nsec);
+	p = put_le64(p, attr->ctime_sec);
+	p = put_le64(p, attr->ctime_nsec);
+	p = put_le64(p, attr->btime_sec);
+	p = put_le64(p, attr->btime_nsec);
+	p = put_le64(p, attr->gen);
+	put_le64(p, attr->data_version);
+	return 0;
+}
+
+int p9pdu_write_dirent(struct p9_fcall *pdu, const struct p9_qid *qid,
+		       u64 offset, u8 type, const char *name, u16 len)
+{
+	u8 *p = pdu_put(pdu, P9_QID_SIZE + 8 + 1 + 2 + len);
+
+	if (!p)
+		return -EFAULT;
+	p = put_qid(p, qid);
+	p = put_le64(p, offset);
+	*p++ = type;
+	p = put_le16(p, len);
+	memcpy(p, name, len);
+	return 0;
+}
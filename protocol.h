@@ -25,8 +25,68 @@
  *
  */
 
+/*
+ * A string left in place in the PDU, as read and written by the 'S'
+ * format. It is not NUL-terminated and is only valid while the PDU is.
+ */
+struct p9_str {
+	const char *name;
+	u16 len;
+};
+
 int p9pdu_readf(struct p9_fcall *pdu, const char *fmt, ...);
 int p9pdu_writef(struct p9_fcall *pdu, const char *fmt, ...);
 int p9pdu_prepare(struct p9_fcall *pdu, int16_t tag, int8_t type);
 int p9pdu_finalize(struct p9_fcall *pdu);
 void p9pdu_reset(struct p9_fcall *pdu);
+
+/*
+ * Fixed-layout marshalers for the hot messages. Each does one bounds
+ * check and then direct little-endian loads or stores, where the format
+ * interpreter checks and copies field by field. The layout is given by
+ * the equivalent format string. On a short buffer nothing is read or
+ * written and -EFAULT is returned.
+ */
+
+/* Rgetattr: "qQdugqqqqqqqqqqqqqqq" */
+struct p9_getattr {
+	u64 valid;
+	struct p9_qid qid;
+	u32 mode;
+	u32 uid;
+	u32 gid;
+	u64 nlink;
+	u64 rdev;
+	u64 size;
+	u64 blksize;
+	u64 blocks;
+	u64 atime_sec;
+	u64 atime_nsec;
+	u64 mtime_sec;
+	u64 mtime_nsec;
+	u64 ctime_sec;
+	u64 ctime_nsec;
+	u64 btime_sec;
+	u64 btime_nsec;
+	u64 gen;
+	u64 data_version;
+};
+
+int p9pdu_read_fid(struct p9_fcall *pdu, u32 *fid);			/* d */
+int p9pdu_read_fid2(struct p9_fcall *pdu, u32 *fid, u32 *arg);		/* dd */
+int p9pdu_read_getattr(struct p9_fcall *pdu, u32 *fid, u64 *mask);	/* dq */
+int p9pdu_read_walk(struct p9_fcall *pdu, u32 *fid, u32 *newfid,
+		    u16 *nwname);					/* ddw */
+int p9pdu_read_io(struct p9_fcall *pdu, u32 *fid, u64 *offset,
+		  u32 *count);						/* dqd */
+int p9pdu_read_str(struct p9_fcall *pdu, struct p9_str *str);		/* S */
+
+int p9pdu_write_hdr(struct p9_fcall *pdu, u32 size, u8 id, u16 tag);	/* dbw */
+int p9pdu_write_u16(struct p9_fcall *pdu, u16 val);			/* w */
+int p9pdu_write_u32(struct p9_fcall *pdu, u32 val);			/* d */
+int p9pdu_write_qid(struct p9_fcall *pdu, const struct p9_qid *qid);	/* Q */
+int p9pdu_write_open(struct p9_fcall *pdu, const struct p9_qid *qid,
+		     u32 iounit);					/* Qd */
+int p9pdu_write_getattr(struct p9_fcall *pdu, const struct p9_getattr *attr);
+int p9pdu_write_dirent(struct p9_fcall *pdu, const struct p9_qid *qid,
+		       u64 offset, u8 type, const char *name, u16 len); /* Qqbs */
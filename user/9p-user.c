@@ -0,0 +1,70 @@
+/*
+ *	The userspace 9p server: requests go to do_9p_request() of the
+ *	shared 9p-ops.c, over the files of a p9_vfs backend.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include "p9-compat.h"
+#include "9p-server.h"
+#include "9p-user.h"
+
+struct p9_user_server {
+	struct p9_server *server;
+	/* Requests are served in order, one session over the whole device. */
+	struct p9_session session;
+	struct p9_pdu_pool pdus;
+};
+
+size_t p9_user_request(struct p9_user_server *s, const void *req,
+		       size_t req_len, void *resp, size_t resp_cap)
+{
+	struct iovec req_vec = {
+		.iov_base = (void *)req,
+		.iov_len = req_len,
+	};
+	struct iovec resp_vec = {
+		.iov_base = resp,
+		.iov_len = resp_cap,
+	};
+	struct iov_iter req_iter, resp_iter;
+
+	iov_iter_init(&req_iter, WRITE, &req_vec, 1, req_len);
+	iov_iter_init(&resp_iter, READ, &resp_vec, 1, resp_cap);
+	return do_9p_request(s->server, &s->session, &req_iter, &resp_iter,
+			     NULL, &s->pdus);
+}
+
+struct p9_user_server *p9_user_server_create(const struct p9_vfs_ops *ops,
+					     void *fs)
+{
+	struct p9_user_server *s = calloc(1, sizeof(*s));
+
+	if (!s)
+		return NULL;
+	s->server = p9_server_new(ops, fs);
+	if (!s->server) {
+		free(s);
+		return NULL;
+	}
+	s->server->msize = P9_USER_MSIZE;
+	p9_pdu_pool_init(&s->pdus);
+	return s;
+}
+
+void p9_user_server_destroy(struct p9_user_server *s)
+{
+	p9_server_free(s->server);
+	p9_pdu_pool_drain(&s->pdus);
+	free(s);
+}
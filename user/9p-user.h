@@ -0,0 +1,47 @@
+/*
+ *	The userspace 9p server: the shared op handlers of 9p-ops.c over
+ *	the host filesystem backend of vfs-posix.c.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#ifndef _P9_USER_H
+#define _P9_USER_H
+
+#include <stddef.h>
+
+struct p9_vfs_ops;
+
+/* Descriptors a queue element may have, as for the kernel's UIO_MAXIOV. */
+#define P9_USER_MAX_IOV 1024
+
+/*
+ * Largest message we accept and negotiate: a message of page-sized
+ * descriptors still fits P9_USER_MAX_IOV, with room for the header
+ * buffers and an unaligned first and last page.
+ */
+#define P9_USER_MSIZE ((P9_USER_MAX_IOV - 4) * 4096)
+
+/* The backend over the host filesystem, rooted at a directory. */
+extern const struct p9_vfs_ops p9_vfs_posix_ops;
+void *p9_vfs_posix_create(const char *root);
+
+struct p9_user_server;
+
+struct p9_user_server *p9_user_server_create(const struct p9_vfs_ops *ops,
+					     void *fs);
+void p9_user_server_destroy(struct p9_user_server *s);
+
+/* Serve one request of req_len bytes, returns the length of the reply. */
+size_t p9_user_request(struct p9_user_server *s, const void *req,
+		       size_t req_len, void *resp, size_t resp_cap);
+
+#endif /* _P9_USER_H */
@@ -0,0 +1,152 @@
+/*
+ *	Microbenchmark of the 9p marshalers: the fixed-layout helpers of
+ *	protocol.h against the p9pdu_readf/p9pdu_writef formats they
+ *	replace. Each pair is checked to give the same result first.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "p9-compat.h"
+#include "protocol.h"
+
+#define BENCH_LOOPS 10000000
+
+static u8 buf_a[256], buf_b[256];
+static struct p9_fcall pdu_a = { .capacity = sizeof(buf_a), .sdata = buf_a };
+static struct p9_fcall pdu_b = { .capacity = sizeof(buf_b), .sdata = buf_b };
+
+/* Keeps the compiler from dropping the decoded values. */
+static volatile u64 sink;
+
+static const struct p9_getattr attr = {
+	.valid = 0x3fff,
+	.qid = { .type = 0x80, .version = 7, .path = 0x123456789aULL },
+	.mode = 040755, .uid = 1000, .gid = 1000,
+	.nlink = 2, .rdev = 0, .size = 4096, .blksize = 4096, .blocks = 8,
+	.atime_sec = 1700000000, .atime_nsec = 1,
+	.mtime_sec = 1700000001, .mtime_nsec = 2,
+	.ctime_sec = 1700000002, .ctime_nsec = 3,
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void rgetattr_format(struct p9_fcall *pdu)
+{
+	p9pdu_writef(pdu, "qQdugqqqqqqqqqqqqqqq", attr.valid, &attr.qid,
+		     attr.mode, make_kuid(&init_user_ns, attr.uid),
+		     make_kgid(&init_user_ns, attr.gid), attr.nlink,
+		     attr.rdev, attr.size, attr.blksize, attr.blocks,
+		     attr.atime_sec, attr.atime_nsec, attr.mtime_sec,
+		     attr.mtime_nsec, attr.ctime_sec, attr.ctime_nsec,
+		     attr.btime_sec, attr.btime_nsec, attr.gen,
+		     attr.data_version);
+}
+
+static void rgetattr_fixed(struct p9_fcall *pdu)
+{
+	p9pdu_write_getattr(pdu, &attr);
+}
+
+static void tread_format(struct p9_fcall *pdu)
+{
+	u32 fid, count;
+	u64 offset;
+
+	p9pdu_readf(pdu, "dqd", &fid, &offset, &count);
+	sink = fid + offset + count;
+}
+
+static void tread_fixed(struct p9_fcall *pdu)
+{
+	u32 fid, count;
+	u64 offset;
+
+	p9pdu_read_io(pdu, &fid, &offset, &count);
+	sink = fid + offset + count;
+}
+
+/* A message to decode, in_size bytes already in the buffers, or to
+ * encode if in_size is 0.
+ */
+struct bench_case {
+	const char *name;
+	void (*format)(struct p9_fcall *pdu);
+	void (*fixed)(struct p9_fcall *pdu);
+	u32 in_size;
+};
+
+static void run(const struct bench_case *c,
+		void (*fn)(struct p9_fcall *), struct p9_fcall *pdu)
+{
+	pdu->size = c->in_size;
+	pdu->offset = 0;
+	fn(pdu);
+}
+
+static double bench(const struct bench_case *c,
+		    void (*fn)(struct p9_fcall *), struct p9_fcall *pdu)
+{
+	double start;
+	int i;
+
+	start = now_ns();
+	for (i = 0; i < BENCH_LOOPS; i++)
+		run(c, fn, pdu);
+	return (now_ns() - start) / BENCH_LOOPS;
+}
+
+static int compare(const struct bench_case *c)
+{
+	u64 a, b;
+
+	run(c, c->format, &pdu_a);
+	a = sink;
+	run(c, c->fixed, &pdu_b);
+	b = sink;
+	if (pdu_a.size != pdu_b.size || pdu_a.offset != pdu_b.offset ||
+	    memcmp(buf_a, buf_b, pdu_a.size) || a != b) {
+		fprintf(stderr, "%s: marshalers disagree\n", c->name);
+		return -1;
+	}
+
+	printf("%-10s format %6.1f ns  fixed %6.1f ns\n", c->name,
+	       bench(c, c->format, &pdu_a), bench(c, c->fixed, &pdu_b));
+	return 0;
+}
+
+static const struct bench_case cases[] = {
+	{ "Tread", tread_format, tread_fixed, 16 },
+	{ "Rgetattr", rgetattr_format, rgetattr_fixed, 0 },
+};
+
+int main(void)
+{
+	int i;
+
+	/* A Tread body: fid, offset, count. */
+	for (i = 0; i < 16; i++)
+		buf_a[i] = buf_b[i] = i + 1;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+		if (compare(&cases[i]))
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
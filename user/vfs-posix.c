@@ -0,0 +1,520 @@
+/*
+ *	The host filesystem backend of the userspace 9p server. Files are
+ *	O_PATH descriptors, reopened for I/O, and names are always resolved
+ *	relative to a parent descriptor.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+
+#include "p9-compat.h"
+#include "9p-vfs.h"
+#include "9p-user.h"
+
+struct p9_vfs_posix {
+	int root;
+};
+
+struct p9_vfs_file {
+	struct p9_vfs_posix *fs;
+	int fd;		/* O_PATH */
+	int io;		/* opened for I/O, or -1 */
+	DIR *dir;
+};
+
+static struct p9_vfs_file *file_new(struct p9_vfs_posix *fs, int fd)
+{
+	struct p9_vfs_file *f = malloc(sizeof(*f));
+
+	if (!f) {
+		close(fd);
+		return NULL;
+	}
+	f->fs = fs;
+	f->fd = fd;
+	f->io = -1;
+	f->dir = NULL;
+	return f;
+}
+
+/* A C string of a name from the handlers, which checked its length. */
+static const char *cname(char *buf, const char *name, u16 len)
+{
+	if (len > NAME_MAX)
+		len = NAME_MAX;
+	memcpy(buf, name, len);
+	buf[len] = '\0';
+	return buf;
+}
+
+static char *proc_path(struct p9_vfs_file *f, char *buf, size_t len)
+{
+	snprintf(buf, len, "/proc/self/fd/%d", f->fd);
+	return buf;
+}
+
+/* Where f is now, for the calls that take no descriptor for it. */
+static int real_path(struct p9_vfs_file *f, char *buf, size_t len)
+{
+	char path[64];
+	ssize_t n;
+
+	n = readlink(proc_path(f, path, sizeof(path)), buf, len - 1);
+	if (n < 0)
+		return -errno;
+	if (n == len - 1)
+		return -ENAMETOOLONG;
+	buf[n] = '\0';
+	return buf[0] == '/' ? 0 : -ESTALE;
+}
+
+static void stat_attr(struct stat *st, struct p9_vfs_attr *attr)
+{
+	attr->mode = st->st_mode;
+	attr->uid = st->st_uid;
+	attr->gid = st->st_gid;
+	attr->ino = st->st_ino;
+	attr->nlink = st->st_nlink;
+	attr->rdev = st->st_rdev;
+	attr->size = st->st_size;
+	attr->blksize = st->st_blksize;
+	attr->blocks = st->st_blocks;
+	attr->atime_sec = st->st_atim.tv_sec;
+	attr->atime_nsec = st->st_atim.tv_nsec;
+	attr->mtime_sec = st->st_mtim.tv_sec;
+	attr->mtime_nsec = st->st_mtim.tv_nsec;
+	attr->ctime_sec = st->st_ctim.tv_sec;
+	attr->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static int posix_root(void *fs, struct p9_vfs_file **f)
+{
+	struct p9_vfs_posix *p = fs;
+	int fd = fcntl(p->root, F_DUPFD_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -errno;
+	*f = file_new(p, fd);
+	return *f ? 0 : -ENOMEM;
+}
+
+static int posix_clone(struct p9_vfs_file *f, struct p9_vfs_file **nf)
+{
+	int fd = fcntl(f->fd, F_DUPFD_CLOEXEC, 0);
+
+	if (fd < 0)
+		return -errno;
+	*nf = file_new(f->fs, fd);
+	return *nf ? 0 : -ENOMEM;
+}
+
+static int posix_walk(struct p9_vfs_file *f, const char *name, u16 len)
+{
+	char buf[NAME_MAX + 1];
+	int fd;
+
+	fd = openat(f->fd, cname(buf, name, len),
+		    O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	close(f->fd);
+	f->fd = fd;
+	return 0;
+}
+
+static void posix_release(struct p9_vfs_file *f)
+{
+	if (f->dir)
+		closedir(f->dir);
+	else if (f->io >= 0)
+		close(f->io);
+	close(f->fd);
+	free(f);
+}
+
+static int posix_getattr(struct p9_vfs_file *f, struct p9_vfs_attr *attr)
+{
+	struct stat st;
+
+	if (fstatat(f->fd, "", &st, AT_EMPTY_PATH))
+		return -errno;
+	stat_attr(&st, attr);
+	return 0;
+}
+
+static int posix_setattr(struct p9_vfs_file *f, struct p9_vfs_iattr *ia)
+{
+	struct timespec ts[2] = {
+		{ .tv_nsec = UTIME_OMIT }, { .tv_nsec = UTIME_OMIT }
+	};
+	char path[64];
+
+	proc_path(f, path, sizeof(path));
+	if ((ia->valid & P9_ATTR_MODE) && chmod(path, ia->mode))
+		return -errno;
+	if ((ia->valid & (P9_ATTR_UID | P9_ATTR_GID)) &&
+	    fchownat(f->fd, "", ia->valid & P9_ATTR_UID ? ia->uid : (uid_t)-1,
+		     ia->valid & P9_ATTR_GID ? ia->gid : (gid_t)-1, AT_EMPTY_PATH))
+		return -errno;
+	if ((ia->valid & P9_ATTR_SIZE) && truncate(path, ia->size))
+		return -errno;
+	if (ia->valid & P9_ATTR_ATIME)
+		ts[0] = ia->valid & P9_ATTR_ATIME_SET ?
+			(struct timespec){ ia->atime_sec, ia->atime_nsec } :
+			(struct timespec){ .tv_nsec = UTIME_NOW };
+	if (ia->valid & P9_ATTR_MTIME)
+		ts[1] = ia->valid & P9_ATTR_MTIME_SET ?
+			(struct timespec){ ia->mtime_sec, ia->mtime_nsec } :
+			(struct timespec){ .tv_nsec = UTIME_NOW };
+	if ((ia->valid & (P9_ATTR_ATIME | P9_ATTR_MTIME)) &&
+	    utimensat(AT_FDCWD, path, ts, 0))
+		return -errno;
+	return 0;
+}
+
+static int posix_statfs(struct p9_vfs_file *f, struct p9_vfs_statfs *st)
+{
+	struct statfs sfs;
+	int io;
+
+	/* fstatfs() takes no O_PATH descriptor on older kernels. */
+	io = f->io >= 0 ? f->io : f->fd;
+	if (fstatfs(io, &sfs))
+		return -errno;
+
+	st->type = sfs.f_type;
+	st->bsize = sfs.f_bsize;
+	st->blocks = sfs.f_blocks;
+	st->bfree = sfs.f_bfree;
+	st->bavail = sfs.f_bavail;
+	st->files = sfs.f_files;
+	st->ffree = sfs.f_ffree;
+	st->fsid = (u32)sfs.f_fsid.__val[0] |
+		(u64)(u32)sfs.f_fsid.__val[1] << 32;
+	st->namelen = sfs.f_namelen;
+	return 0;
+}
+
+static int posix_open(struct p9_vfs_file *f, int flags)
+{
+	char path[64];
+	int fd;
+
+	if (f->io >= 0)
+		return -EBUSY;
+	/* The O_PATH fd was looked up without following, the proc link
+	 * has to be followed to reach it. */
+	flags &= ~(O_CREAT | O_EXCL | O_NOCTTY | O_NOFOLLOW);
+	fd = open(proc_path(f, path, sizeof(path)), flags | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	f->io = fd;
+	return 0;
+}
+
+/* Gives a made entry of dir its owner and returns its attributes. */
+static int made(struct p9_vfs_file *dir, const char *name, u32 uid, u32 gid,
+		struct p9_vfs_attr *attr)
+{
+	struct stat st;
+
+	if (fchownat(dir->fd, name, uid, gid, AT_SYMLINK_NOFOLLOW) &&
+	    errno != EPERM)
+		return -errno;
+	if (fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW))
+		return -errno;
+	stat_attr(&st, attr);
+	return 0;
+}
+
+static int posix_create(struct p9_vfs_file *dir, const char *name, u16 len,
+			int flags, u32 mode, u32 uid, u32 gid,
+			struct p9_vfs_file **nf, struct p9_vfs_attr *attr)
+{
+	char buf[NAME_MAX + 1];
+	int fd, pfd, err;
+
+	if (dir->io >= 0)
+		return -EBUSY;
+	name = cname(buf, name, len);
+	fd = openat(dir->fd, name, flags | O_CREAT | O_NOFOLLOW | O_CLOEXEC,
+		    mode);
+	if (fd < 0)
+		return -errno;
+	err = made(dir, name, uid, gid, attr);
+	if (err) {
+		close(fd);
+		return err;
+	}
+	pfd = openat(dir->fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+	if (pfd < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+	*nf = file_new(dir->fs, pfd);
+	if (!*nf) {
+		close(fd);
+		return -ENOMEM;
+	}
+	(*nf)->io = fd;
+	return 0;
+}
+
+static ssize_t posix_read(struct p9_vfs_file *f, struct iov_iter *data,
+			  u64 off, struct p9_fcall *in)
+{
+	ssize_t ret, done = 0;
+	size_t len;
+	void *buf;
+
+	if (f->io < 0)
+		return -EBADF;
+	while (iov_iter_count(data)) {
+		buf = iov_iter_seg(data, &len);
+		ret = pread(f->io, buf, len, off + done);
+		if (ret <= 0) {
+			if (!done)
+				done = ret < 0 ? -errno : 0;
+			break;
+		}
+		iov_iter_advance(data, ret);
+		done += ret;
+		if (ret < len)
+			break;
+	}
+	return done;
+}
+
+static ssize_t posix_write(struct p9_vfs_file *f, struct iov_iter *data,
+			   u64 off, struct p9_fcall *in)
+{
+	ssize_t ret, done = 0;
+	size_t len;
+	void *buf;
+
+	if (f->io < 0)
+		return -EBADF;
+	while (iov_iter_count(data)) {
+		buf = iov_iter_seg(data, &len);
+		ret = pwrite(f->io, buf, len, off + done);
+		if (ret <= 0) {
+			if (!done)
+				done = ret < 0 ? -errno : 0;
+			break;
+		}
+		iov_iter_advance(data, ret);
+		done += ret;
+		if (ret < len)
+			break;
+	}
+	return done;
+}
+
+static int posix_readdir(struct p9_vfs_file *f, u64 off,
+			 p9_vfs_filldir_t fill, void *ctx)
+{
+	struct dirent *de;
+	struct p9_qid qid;
+
+	if (f->io < 0)
+		return -EBADF;
+	if (!f->dir) {
+		f->dir = fdopendir(f->io);
+		if (!f->dir)
+			return -errno;
+	}
+
+	seekdir(f->dir, off);
+	for (;;) {
+		long pos;
+
+		errno = 0;
+		de = readdir(f->dir);
+		if (!de)
+			return -errno;
+		pos = telldir(f->dir);
+
+		/* No stat per entry: the type is all the guest gets. */
+		qid.path = de->d_ino;
+		qid.version = 0;
+		qid.type = de->d_type == DT_DIR ? P9_QTDIR :
+			   de->d_type == DT_LNK ? P9_QTSYMLINK : P9_QTFILE;
+		if (fill(ctx, de->d_name, strlen(de->d_name), &qid,
+			 de->d_type, pos)) {
+			seekdir(f->dir, off);
+			return 0;
+		}
+		off = pos;
+	}
+}
+
+static int posix_fsync(struct p9_vfs_file *f, int datasync)
+{
+	if (f->io < 0)
+		return -EBADF;
+	if (datasync ? fdatasync(f->io) : fsync(f->io))
+		return -errno;
+	return 0;
+}
+
+static int posix_mkdir(struct p9_vfs_file *dir, const char *name, u16 len,
+		       u32 mode, u32 uid, u32 gid, struct p9_vfs_attr *attr)
+{
+	char buf[NAME_MAX + 1];
+
+	name = cname(buf, name, len);
+	if (mkdirat(dir->fd, name, mode))
+		return -errno;
+	return made(dir, name, uid, gid, attr);
+}
+
+static int posix_symlink(struct p9_vfs_file *dir, const char *name, u16 len,
+			 const char *target, u32 uid, u32 gid,
+			 struct p9_vfs_attr *attr)
+{
+	char buf[NAME_MAX + 1];
+
+	name = cname(buf, name, len);
+	if (symlinkat(target, dir->fd, name))
+		return -errno;
+	return made(dir, name, uid, gid, attr);
+}
+
+static int posix_mknod(struct p9_vfs_file *dir, const char *name, u16 len,
+		       u32 mode, u32 major, u32 minor, u32 uid, u32 gid,
+		       struct p9_vfs_attr *attr)
+{
+	char buf[NAME_MAX + 1];
+
+	name = cname(buf, name, len);
+	if (mknodat(dir->fd, name, mode, makedev(major, minor)))
+		return -errno;
+	return made(dir, name, uid, gid, attr);
+}
+
+static int posix_link(struct p9_vfs_file *dir, const char *name, u16 len,
+		      struct p9_vfs_file *target)
+{
+	char buf[NAME_MAX + 1], path[64];
+
+	/* Following the proc link reaches the O_PATH file itself. */
+	if (linkat(AT_FDCWD, proc_path(target, path, sizeof(path)), dir->fd,
+		   cname(buf, name, len), AT_SYMLINK_FOLLOW))
+		return -errno;
+	return 0;
+}
+
+static ssize_t posix_readlink(struct p9_vfs_file *f, char *buf, size_t len)
+{
+	ssize_t ret = readlinkat(f->fd, "", buf, len);
+
+	return ret < 0 ? -errno : ret;
+}
+
+static int posix_unlinkat(struct p9_vfs_file *dir, const char *name, u16 len,
+			  int flags)
+{
+	char buf[NAME_MAX + 1];
+
+	return unlinkat(dir->fd, cname(buf, name, len), flags & AT_REMOVEDIR) ?
+		-errno : 0;
+}
+
+static int posix_remove(struct p9_vfs_file *f)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int err;
+
+	if (fstatat(f->fd, "", &st, AT_EMPTY_PATH))
+		return -errno;
+	err = real_path(f, path, sizeof(path));
+	if (err)
+		return err;
+	if (unlinkat(AT_FDCWD, path, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0))
+		return -errno;
+	return 0;
+}
+
+static int posix_rename(struct p9_vfs_file *f, struct p9_vfs_file *ndir,
+			const char *name, u16 len)
+{
+	char buf[NAME_MAX + 1], path[PATH_MAX];
+	int err;
+
+	err = real_path(f, path, sizeof(path));
+	if (err)
+		return err;
+	if (renameat(AT_FDCWD, path, ndir->fd, cname(buf, name, len)))
+		return -errno;
+	return 0;
+}
+
+static int posix_renameat(struct p9_vfs_file *odir, const char *oname,
+			  u16 olen, struct p9_vfs_file *ndir,
+			  const char *nname, u16 nlen)
+{
+	char obuf[NAME_MAX + 1], nbuf[NAME_MAX + 1];
+
+	return renameat(odir->fd, cname(obuf, oname, olen),
+			ndir->fd, cname(nbuf, nname, nlen)) ? -errno : 0;
+}
+
+const struct p9_vfs_ops p9_vfs_posix_ops = {
+	.root		= posix_root,
+	.walk		= posix_walk,
+	.clone		= posix_clone,
+	.release	= posix_release,
+	.getattr	= posix_getattr,
+	.setattr	= posix_setattr,
+	.statfs		= posix_statfs,
+	.open		= posix_open,
+	.create		= posix_create,
+	.read		= posix_read,
+	.write		= posix_write,
+	.readdir	= posix_readdir,
+	.fsync		= posix_fsync,
+	.mkdir		= posix_mkdir,
+	.symlink	= posix_symlink,
+	.mknod		= posix_mknod,
+	.link		= posix_link,
+	.readlink	= posix_readlink,
+	.unlinkat	= posix_unlinkat,
+	.remove		= posix_remove,
+	.rename		= posix_rename,
+	.renameat	= posix_renameat,
+};
+
+void *p9_vfs_posix_create(const char *root)
+{
+	struct p9_vfs_posix *p = malloc(sizeof(*p));
+
+	if (!p)
+		return NULL;
+	p->root = open(root, O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (p->root < 0) {
+		free(p);
+		return NULL;
+	}
+	return p;
+}
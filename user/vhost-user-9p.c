@@ -0,0 +1,739 @@
+/*
+ *	vhost-user-9p: the 9p server as a vhost-user backend process.
+ *
+ *	QEMU connects to the vhost-user socket, hands over guest memory and
+ *	the ring eventfds, and requests are served from the split virtqueue
+ *	in this process. With -p the same server is offered as plain 9P on a
+ *	unix socket instead, which needs no VM.
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "9p-user.h"
+
+#define VHOST_USER_GET_FEATURES		1
+#define VHOST_USER_SET_FEATURES		2
+#define VHOST_USER_SET_OWNER		3
+#define VHOST_USER_RESET_OWNER		4
+#define VHOST_USER_SET_MEM_TABLE	5
+#define VHOST_USER_SET_VRING_NUM	8
+#define VHOST_USER_SET_VRING_ADDR	9
+#define VHOST_USER_SET_VRING_BASE	10
+#define VHOST_USER_GET_VRING_BASE	11
+#define VHOST_USER_SET_VRING_KICK	12
+#define VHOST_USER_SET_VRING_CALL	13
+#define VHOST_USER_SET_VRING_ERR	14
+#define VHOST_USER_GET_PROTOCOL_FEATURES 15
+#define VHOST_USER_SET_PROTOCOL_FEATURES 16
+#define VHOST_USER_GET_QUEUE_NUM	17
+#define VHOST_USER_SET_VRING_ENABLE	18
+#define VHOST_USER_GET_CONFIG		24
+
+#define VHOST_USER_VERSION		0x1
+#define VHOST_USER_REPLY		0x4
+#define VHOST_USER_NEED_REPLY		0x8
+
+#define VHOST_USER_VRING_NOFD		(1 << 8)
+#define VHOST_USER_MAX_REGIONS		8
+#define VHOST_USER_MAX_CONFIG		256
+
+#define VIRTIO_9P_MOUNT_TAG		0
+#define VIRTIO_RING_F_INDIRECT_DESC	28
+#define VHOST_USER_F_PROTOCOL_FEATURES	30
+#define VIRTIO_F_VERSION_1		32
+#define VHOST_USER_PROTOCOL_F_MQ	0
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK	3
+#define VHOST_USER_PROTOCOL_F_CONFIG	9
+
+#define VRING_DESC_F_NEXT		1
+#define VRING_DESC_F_WRITE		2
+#define VRING_DESC_F_INDIRECT		4
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+
+#define BACKEND_FEATURES ((1ULL << VIRTIO_9P_MOUNT_TAG) |		\
+			  (1ULL << VIRTIO_RING_F_INDIRECT_DESC) |	\
+			  (1ULL << VHOST_USER_F_PROTOCOL_FEATURES) |	\
+			  (1ULL << VIRTIO_F_VERSION_1))
+#define BACKEND_PROTOCOL_FEATURES ((1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) | \
+				   (1ULL << VHOST_USER_PROTOCOL_F_CONFIG))
+
+struct vhost_user_region {
+	uint64_t guest_addr;
+	uint64_t size;
+	uint64_t user_addr;
+	uint64_t mmap_offset;
+};
+
+struct vhost_user_msg {
+	uint32_t request;
+	uint32_t flags;
+	uint32_t size;
+	union {
+		uint64_t u64;
+		struct {
+			uint32_t index;
+			uint32_t num;
+		} state;
+		struct {
+			uint32_t index;
+			uint32_t flags;
+			uint64_t desc;
+			uint64_t used;
+			uint64_t avail;
+			uint64_t log;
+		} addr;
+		struct {
+			uint32_t nregions;
+			uint32_t padding;
+			struct vhost_user_region regions[VHOST_USER_MAX_REGIONS];
+		} mem;
+		struct {
+			uint32_t offset;
+			uint32_t size;
+			uint32_t flags;
+			uint8_t data[VHOST_USER_MAX_CONFIG];
+		} config;
+	} payload;
+} __attribute__((packed));
+
+#define VHOST_USER_HDR_SIZE offsetof(struct vhost_user_msg, payload)
+
+struct vring_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct vring_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct vring_used_elem ring[];
+};
+
+struct mem_region {
+	uint64_t guest_addr;
+	uint64_t size;
+	uint64_t user_addr;
+	void *map;
+	size_t map_len;
+	uint64_t map_offset;
+};
+
+struct vring {
+	unsigned int num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint16_t last_avail;
+	int kick;
+	int call;
+	int enabled;
+};
+
+struct dev {
+	int sock;
+	const char *tag;
+	uint64_t features;
+	uint64_t protocol_features;
+	struct mem_region regions[VHOST_USER_MAX_REGIONS];
+	unsigned int nregions;
+	struct vring vq;
+	struct p9_user_server *server;
+	uint8_t *req;
+	uint8_t *resp;
+};
+
+static void *gpa_to_va(struct dev *d, uint64_t addr, uint64_t len)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nregions; i++) {
+		struct mem_region *r = &d->regions[i];
+
+		if (addr >= r->guest_addr && len <= r->size &&
+		    addr - r->guest_addr <= r->size - len)
+			return (uint8_t *)r->map + r->map_offset +
+			       (addr - r->guest_addr);
+	}
+	return NULL;
+}
+
+/* Ring addresses are given in the address space of the front end. */
+static void *uva_to_va(struct dev *d, uint64_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nregions; i++) {
+		struct mem_region *r = &d->regions[i];
+
+		if (addr >= r->user_addr && addr - r->user_addr < r->size)
+			return (uint8_t *)r->map + r->map_offset +
+			       (addr - r->user_addr);
+	}
+	return NULL;
+}
+
+static void unmap_regions(struct dev *d)
+{
+	unsigned int i;
+
+	for (i = 0; i < d->nregions; i++)
+		munmap(d->regions[i].map, d->regions[i].map_len);
+	d->nregions = 0;
+}
+
+static void reset_vring(struct vring *vq)
+{
+	if (vq->kick >= 0)
+		close(vq->kick);
+	if (vq->call >= 0)
+		close(vq->call);
+	memset(vq, 0, sizeof(*vq));
+	vq->kick = -1;
+	vq->call = -1;
+}
+
+/*
+ * Copy the driver-readable part of a descriptor chain into buf and note
+ * the device-writable part in iov. Returns the request length or -1.
+ */
+static ssize_t read_chain(struct dev *d, uint16_t head, uint8_t *buf,
+			  size_t cap, struct iovec *iov, int *niov, int max)
+{
+	struct vring *vq = &d->vq;
+	struct vring_desc *table = vq->desc;
+	unsigned int num = vq->num, i = head, n = 0;
+	size_t len = 0;
+
+	*niov = 0;
+	for (;;) {
+		struct vring_desc *desc;
+		void *p;
+
+		if (i >= num || ++n > num)
+			return -1;
+		desc = &table[i];
+		if (desc->flags & VRING_DESC_F_INDIRECT) {
+			if (table != vq->desc || desc->len % sizeof(*desc))
+				return -1;
+			table = gpa_to_va(d, desc->addr, desc->len);
+			if (!table)
+				return -1;
+			num = desc->len / sizeof(*desc);
+			i = 0;
+			n = 0;
+			continue;
+		}
+
+		p = gpa_to_va(d, desc->addr, desc->len);
+		if (!p)
+			return -1;
+		if (desc->flags & VRING_DESC_F_WRITE) {
+			if (*niov == max)
+				return -1;
+			iov[*niov].iov_base = p;
+			iov[(*niov)++].iov_len = desc->len;
+		} else {
+			if (*niov || desc->len > cap - len)
+				return -1;
+			memcpy(buf + len, p, desc->len);
+			len += desc->len;
+		}
+
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			break;
+		i = desc->next;
+	}
+	return len;
+}
+
+static size_t write_iov(struct iovec *iov, int niov, const uint8_t *buf,
+			size_t len)
+{
+	size_t done = 0;
+	int i;
+
+	for (i = 0; i < niov && done < len; i++) {
+		size_t n = iov[i].iov_len < len - done ?
+			   iov[i].iov_len : len - done;
+
+		memcpy(iov[i].iov_base, buf + done, n);
+		done += n;
+	}
+	return done;
+}
+
+static void handle_vq(struct dev *d)
+{
+	struct vring *vq = &d->vq;
+	struct iovec iov[P9_USER_MAX_IOV];
+	int notify = 0;
+
+	for (;;) {
+		uint16_t avail_idx = __atomic_load_n(&vq->avail->idx,
+						     __ATOMIC_ACQUIRE);
+		uint16_t head, used_idx;
+		size_t resp_len = 0;
+		ssize_t req_len;
+		int niov;
+
+		if (vq->last_avail == avail_idx)
+			break;
+
+		head = vq->avail->ring[vq->last_avail % vq->num];
+		vq->last_avail++;
+
+		req_len = read_chain(d, head, d->req, P9_USER_MSIZE, iov, &niov,
+				     sizeof(iov) / sizeof(iov[0]));
+		if (req_len < 0)
+			fprintf(stderr, "vhost-user-9p: bad descriptor chain %u\n",
+				head);
+		else
+			resp_len = p9_user_request(d->server, d->req, req_len,
+						   d->resp, P9_USER_MSIZE);
+		resp_len = write_iov(iov, req_len < 0 ? 0 : niov, d->resp,
+				     resp_len);
+
+		used_idx = vq->used->idx;
+		vq->used->ring[used_idx % vq->num].id = head;
+		vq->used->ring[used_idx % vq->num].len = resp_len;
+		__atomic_store_n(&vq->used->idx, used_idx + 1, __ATOMIC_RELEASE);
+		notify = 1;
+	}
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (notify && vq->call >= 0 &&
+	    !(vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT)) {
+		uint64_t one = 1;
+
+		if (write(vq->call, &one, sizeof(one)) < 0)
+			perror("vhost-user-9p: call");
+	}
+}
+
+static int recv_msg(int sock, struct vhost_user_msg *msg, int *fds, int *nfds)
+{
+	char control[CMSG_SPACE(sizeof(int) * VHOST_USER_MAX_REGIONS)];
+	struct iovec iov = { msg, VHOST_USER_HDR_SIZE };
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	ssize_t ret;
+
+	*nfds = 0;
+	ret = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	if (ret != VHOST_USER_HDR_SIZE)
+		return -1;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), *nfds * sizeof(int));
+		}
+	}
+
+	if (msg->size > sizeof(msg->payload))
+		return -1;
+	if (msg->size && recv(sock, &msg->payload, msg->size, MSG_WAITALL) !=
+	    msg->size)
+		return -1;
+	return 0;
+}
+
+static int send_reply(int sock, struct vhost_user_msg *msg)
+{
+	size_t len = VHOST_USER_HDR_SIZE + msg->size;
+
+	msg->flags = VHOST_USER_VERSION | VHOST_USER_REPLY;
+	return send(sock, msg, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+static int set_mem_table(struct dev *d, struct vhost_user_msg *msg,
+			 int *fds, int nfds)
+{
+	unsigned int i;
+
+	if (msg->payload.mem.nregions > VHOST_USER_MAX_REGIONS ||
+	    msg->payload.mem.nregions != (unsigned int)nfds)
+		return -1;
+
+	unmap_regions(d);
+	for (i = 0; i < msg->payload.mem.nregions; i++) {
+		struct vhost_user_region reg = msg->payload.mem.regions[i];
+		struct mem_region *r = &d->regions[i];
+		long page = sysconf(_SC_PAGESIZE);
+
+		r->guest_addr = reg.guest_addr;
+		r->size = reg.size;
+		r->user_addr = reg.user_addr;
+		/* mmap wants an aligned offset. */
+		r->map_offset = reg.mmap_offset % page;
+		r->map_len = reg.size + r->map_offset;
+		r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+			      MAP_SHARED, fds[i], reg.mmap_offset - r->map_offset);
+		close(fds[i]);
+		if (r->map == MAP_FAILED) {
+			perror("vhost-user-9p: mmap");
+			for (i++; i < (unsigned int)nfds; i++)
+				close(fds[i]);
+			return -1;
+		}
+		d->nregions = i + 1;
+	}
+	return 0;
+}
+
+/* Returns 1 when a reply is to be sent, 0 when not and -1 on error. */
+static int handle_msg(struct dev *d, struct vhost_user_msg *msg,
+		      int *fds, int nfds)
+{
+	struct vring *vq = &d->vq;
+	int fd = nfds ? fds[0] : -1;
+
+	switch (msg->request) {
+	case VHOST_USER_GET_FEATURES:
+		msg->payload.u64 = BACKEND_FEATURES;
+		msg->size = sizeof(msg->payload.u64);
+		return 1;
+	case VHOST_USER_SET_FEATURES:
+		d->features = msg->payload.u64;
+		/* Without protocol features rings are enabled right away. */
+		if (!(d->features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+			vq->enabled = 1;
+		return 0;
+	case VHOST_USER_GET_PROTOCOL_FEATURES:
+		msg->payload.u64 = BACKEND_PROTOCOL_FEATURES;
+		msg->size = sizeof(msg->payload.u64);
+		return 1;
+	case VHOST_USER_SET_PROTOCOL_FEATURES:
+		d->protocol_features = msg->payload.u64;
+		return 0;
+	case VHOST_USER_GET_QUEUE_NUM:
+		msg->payload.u64 = 1;
+		msg->size = sizeof(msg->payload.u64);
+		return 1;
+	case VHOST_USER_SET_OWNER:
+		return 0;
+	case VHOST_USER_RESET_OWNER:
+		reset_vring(vq);
+		return 0;
+	case VHOST_USER_SET_MEM_TABLE:
+		return set_mem_table(d, msg, fds, nfds);
+	case VHOST_USER_GET_CONFIG: {
+		/* struct virtio_9p_config: le16 tag_len, then the tag. */
+		uint8_t cfg[VHOST_USER_MAX_CONFIG] = { 0 };
+		size_t len = strlen(d->tag);
+
+		if (msg->payload.config.offset > VHOST_USER_MAX_CONFIG ||
+		    msg->payload.config.size > VHOST_USER_MAX_CONFIG -
+					       msg->payload.config.offset)
+			return -1;
+		cfg[0] = len;
+		cfg[1] = len >> 8;
+		memcpy(cfg + 2, d->tag, len);
+		memcpy(msg->payload.config.data,
+		       cfg + msg->payload.config.offset,
+		       msg->payload.config.size);
+		msg->size = offsetof(typeof(msg->payload.config), data) +
+			    msg->payload.config.size;
+		return 1;
+	}
+	}
+
+	if (msg->payload.state.index != 0 &&
+	    !(msg->request == VHOST_USER_SET_VRING_KICK ||
+	      msg->request == VHOST_USER_SET_VRING_CALL ||
+	      msg->request == VHOST_USER_SET_VRING_ERR)) {
+		fprintf(stderr, "vhost-user-9p: no vring %u\n",
+			msg->payload.state.index);
+		return -1;
+	}
+
+	switch (msg->request) {
+	case VHOST_USER_SET_VRING_NUM:
+		if (!msg->payload.state.num ||
+		    msg->payload.state.num & (msg->payload.state.num - 1) ||
+		    msg->payload.state.num > 32768)
+			return -1;
+		vq->num = msg->payload.state.num;
+		return 0;
+	case VHOST_USER_SET_VRING_ADDR:
+		vq->desc = uva_to_va(d, msg->payload.addr.desc);
+		vq->avail = uva_to_va(d, msg->payload.addr.avail);
+		vq->used = uva_to_va(d, msg->payload.addr.used);
+		if (!vq->desc || !vq->avail || !vq->used)
+			return -1;
+		return 0;
+	case VHOST_USER_SET_VRING_BASE:
+		vq->last_avail = msg->payload.state.num;
+		return 0;
+	case VHOST_USER_GET_VRING_BASE:
+		/* Stops the ring. */
+		msg->payload.state.num = vq->last_avail;
+		msg->size = sizeof(msg->payload.state);
+		if (vq->kick >= 0)
+			close(vq->kick);
+		vq->kick = -1;
+		vq->enabled = 0;
+		return 1;
+	case VHOST_USER_SET_VRING_ENABLE:
+		vq->enabled = msg->payload.state.num;
+		return 0;
+	case VHOST_USER_SET_VRING_KICK:
+	case VHOST_USER_SET_VRING_CALL:
+	case VHOST_USER_SET_VRING_ERR:
+		if ((msg->payload.u64 & 0xff) != 0) {
+			if (fd >= 0)
+				close(fd);
+			return -1;
+		}
+		if (msg->payload.u64 & VHOST_USER_VRING_NOFD)
+			fd = -1;
+		if (msg->request == VHOST_USER_SET_VRING_KICK) {
+			if (vq->kick >= 0)
+				close(vq->kick);
+			vq->kick = fd;
+			if (!(d->features &
+			      (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)))
+				vq->enabled = 1;
+		} else if (msg->request == VHOST_USER_SET_VRING_CALL) {
+			if (vq->call >= 0)
+				close(vq->call);
+			vq->call = fd;
+		} else if (fd >= 0) {
+			close(fd);
+		}
+		return 0;
+	}
+
+	fprintf(stderr, "vhost-user-9p: unhandled request %u\n", msg->request);
+	return -1;
+}
+
+static int serve_vhost_user(struct dev *d)
+{
+	for (;;) {
+		struct pollfd pfd[2] = {
+			{ .fd = d->sock, .events = POLLIN },
+			{ .fd = d->vq.kick, .events = POLLIN },
+		};
+		int nfd = d->vq.kick >= 0 ? 2 : 1;
+
+		if (poll(pfd, nfd, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		if (nfd == 2 && (pfd[1].revents & POLLIN)) {
+			uint64_t cnt;
+
+			if (read(d->vq.kick, &cnt, sizeof(cnt)) < 0 &&
+			    errno != EAGAIN)
+				return -1;
+			if (d->vq.enabled && d->vq.desc)
+				handle_vq(d);
+		}
+
+		if (pfd[0].revents & (POLLIN | POLLHUP)) {
+			struct vhost_user_msg msg;
+			int fds[VHOST_USER_MAX_REGIONS], nfds, ret;
+
+			if (recv_msg(d->sock, &msg, fds, &nfds))
+				return 0;
+			ret = handle_msg(d, &msg, fds, nfds);
+			if (ret < 0)
+				return -1;
+			if (!ret && (msg.flags & VHOST_USER_NEED_REPLY) &&
+			    (d->protocol_features &
+			     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK))) {
+				msg.payload.u64 = 0;
+				msg.size = sizeof(msg.payload.u64);
+				ret = 1;
+			}
+			if (ret && send_reply(d->sock, &msg))
+				return -1;
+		}
+	}
+}
+
+/*
+ * The staging buffers are msize each. Back them with huge pages so that
+ * copying a multi-megabyte message does not go through a TLB entry per
+ * 4K: hugetlbfs pages if some are reserved, transparent ones otherwise.
+ */
+static void *alloc_msg_buf(size_t len)
+{
+	size_t huge = 2 * 1024 * 1024;
+	void *p;
+
+	len = (len + huge - 1) & ~(huge - 1);
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED)
+		return p;
+	if (posix_memalign(&p, huge, len))
+		return NULL;
+	madvise(p, len, MADV_HUGEPAGE);
+	return p;
+}
+
+/* Plain 9P: a 4 byte little endian size leads every message. */
+static int serve_9p(struct dev *d)
+{
+	for (;;) {
+		uint32_t size;
+		size_t len;
+
+		if (recv(d->sock, d->req, 4, MSG_WAITALL) != 4)
+			return 0;
+		size = d->req[0] | d->req[1] << 8 | d->req[2] << 16 |
+		       (uint32_t)d->req[3] << 24;
+		if (size < 7 || size > P9_USER_MSIZE)
+			return -1;
+		if (recv(d->sock, d->req + 4, size - 4, MSG_WAITALL) !=
+		    (ssize_t)size - 4)
+			return 0;
+
+		len = p9_user_request(d->server, d->req, size, d->resp,
+				      P9_USER_MSIZE);
+		if (send(d->sock, d->resp, len, MSG_NOSIGNAL) != (ssize_t)len)
+			return 0;
+	}
+}
+
+static int listen_unix(const char *path)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, "vhost-user-9p: path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) ||
+	    listen(fd, 1)) {
+		perror("vhost-user-9p: socket");
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-t tag] (-s vhost-user-socket | -p 9p-socket) root\n",
+		prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *vu_path = NULL, *p9_path = NULL;
+	struct dev d = { .tag = "share" };
+	void *fs;
+	int opt, lfd;
+
+	while ((opt = getopt(argc, argv, "t:s:p:")) != -1) {
+		switch (opt) {
+		case 't':
+			d.tag = optarg;
+			break;
+		case 's':
+			vu_path = optarg;
+			break;
+		case 'p':
+			p9_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || !vu_path == !p9_path ||
+	    strlen(d.tag) > VHOST_USER_MAX_CONFIG - 2)
+		usage(argv[0]);
+
+	fs = p9_vfs_posix_create(argv[optind]);
+	if (!fs) {
+		perror(argv[optind]);
+		return 1;
+	}
+	d.req = alloc_msg_buf(P9_USER_MSIZE);
+	d.resp = alloc_msg_buf(P9_USER_MSIZE);
+	if (!d.req || !d.resp)
+		return 1;
+
+	lfd = listen_unix(vu_path ? vu_path : p9_path);
+	if (lfd < 0)
+		return 1;
+
+	for (;;) {
+		int ret;
+
+		d.sock = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (d.sock < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("vhost-user-9p: accept");
+			return 1;
+		}
+
+		d.server = p9_user_server_create(&p9_vfs_posix_ops, fs);
+		if (!d.server)
+			return 1;
+		d.vq.kick = d.vq.call = -1;
+		d.features = d.protocol_features = 0;
+
+		ret = vu_path ? serve_vhost_user(&d) : serve_9p(&d);
+		if (ret)
+			fprintf(stderr, "vhost-user-9p: connection dropped\n");
+
+		p9_user_server_destroy(d.server);
+		reset_vring(&d.vq);
+		unmap_regions(&d);
+		close(d.sock);
+	}
+}
@@ -0,0 +1,1503 @@
+/*
+ *	The kernel backend of the 9p server: files are paths under the
+ *	exported directory, and I/O goes through the VFS. Also holds the
+ *	module's side of the server, its checkpoint and teardown.
+ *
+ *	Copyright (C) 2016 by Yuankai Guo <yuankai.guo@intel.com>
+ *	Copyright (C) 2017 by Anthony Xu <anthony.xu@intel.com>
+ *	Copyright (C) 2017 by Yu-chu Yang <yu-chu.yang@intel.com>
+ *
+ *	This program is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License version 2
+ *	as published by the Free Software Foundation.
+ *
+ *	This program is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ */
+
+#include <linux/fs.h>
+#include <linux/stat.h>
+#include <linux/statfs.h>
+#include <linux/namei.h>
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/uaccess.h>
+#include <linux/kref.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/ioprio.h>
+#include <linux/iocontext.h>
+#include <linux/math64.h>
+#include <linux/pagemap.h>
+#include <linux/fsnotify.h>
+#include <net/9p/9p.h>
+
+#include "vhost-9p.h"
+#include "9p-vfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "vhost-9p-trace.h"
+
+#define MAX_FILE_NAME (NAME_MAX + 1)
+
+/* Large I/O is done in chunks of this size, checking for Tflush between. */
+#define P9_IO_CHUNK 0x20000
+/* How long a flushed request may keep waiting for a file to be ready. */
+#define P9_CANCEL_POLL_MSECS 100
+
+/*
+ * Routes Tread and Twrite data can take between the file and the
+ * descriptors: straight through, or staged in a PDU buffer.
+ */
+enum {
+	P9_DATA_DIRECT,
+	P9_DATA_BOUNCE,
+	P9_DATA_ROUTES,
+};
+
+/* Direction x three sizes up to a PDU x fragmented or not. */
+#define P9_DATA_CLASSES 12
+
+/* Moving average cost of each route for a class of transfers, 0 until
+ * measured. Updated without locking, it only steers the choice.
+ */
+struct p9_data_cost {
+	u32 ns_per_kb[P9_DATA_ROUTES];
+	u32 uses;
+};
+
+struct p9_vfs_kernel {
+	struct path root;
+	struct p9_server *server;
+	struct work_struct close_work;
+	/* I/O priority of data operations on files without their own, or 0
+	 * for the worker's.
+	 */
+	int ioprio;
+	struct p9_data_cost data_cost[P9_DATA_CLASSES];
+};
+
+/*
+ * A file holds a reference on its path. The path only changes in a walk,
+ * on a private clone; filp is set once, by open. A fid that moves to
+ * another file gets a new file instead, see p9_fid_replace().
+ */
+struct p9_vfs_file {
+	struct p9_vfs_kernel *fs;
+	struct path path;
+	struct file *filp;
+	/* filp was made nonblocking, see p9_set_poll_io(). */
+	bool poll_io;
+	/* Set by Tioprio, 0 for the server's. */
+	u16 ioprio;
+};
+
+static struct p9_vfs_file *file_new(struct p9_vfs_kernel *fs,
+				    struct path *path)
+{
+	struct p9_vfs_file *f;
+
+	f = kmalloc_node(sizeof(*f), GFP_KERNEL, READ_ONCE(fs->server->node));
+	if (!f)
+		return NULL;
+	f->fs = fs;
+	f->path = *path;
+	path_get(&f->path);
+	f->filp = NULL;
+	f->poll_io = false;
+	f->ioprio = 0;
+	return f;
+}
+
+static struct dentry *p9_lookup_one_len(
+		const char *name, struct dentry *dentry, int len)
+{
+
+	if (!inode_is_locked(dentry->d_inode)) {
+		p9s_debug("lookup_one_len: inode %s is not locked\n",
+				dentry->d_name.name);
+		return lookup_one_len_unlocked(name, dentry, len);
+	}
+	p9s_debug("lookup_one_len: inode %s is locked\n",
+			dentry->d_name.name);
+	return lookup_one_len(name, dentry, len);
+}
+
+/* A name to make in dir, EEXIST if it is there already. */
+static struct dentry *p9_lookup_new(struct p9_vfs_file *dir,
+				    const char *name, int len)
+{
+	struct dentry *dentry = p9_lookup_one_len(name, dir->path.dentry, len);
+
+	if (!IS_ERR(dentry) && d_really_is_positive(dentry)) {
+		dput(dentry);
+		return ERR_PTR(-EEXIST);
+	}
+	return dentry;
+}
+
+/*
+ * One step of a walk: name in the directory at path, without following
+ * symlinks or crossing into mounts. Replaces path->dentry on success.
+ */
+static int p9_walk_one(struct path *path, const char *name, int len)
+{
+	struct dentry *dentry;
+
+	if (!d_can_lookup(path->dentry))
+		return -ENOTDIR;
+	dentry = p9_lookup_one_len(name, path->dentry, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	if (d_really_is_negative(dentry)) {
+		dput(dentry);
+		return -ENOENT;
+	}
+	dput(path->dentry);
+	path->dentry = dentry;
+	return 0;
+}
+
+static void p9_kstat_attr(struct kstat *st, struct p9_vfs_attr *attr)
+{
+	attr->mode = st->mode;
+	attr->uid = from_kuid(&init_user_ns, st->uid);
+	attr->gid = from_kgid(&init_user_ns, st->gid);
+	attr->ino = st->ino;
+	attr->nlink = st->nlink;
+	attr->rdev = new_encode_dev(st->rdev);
+	attr->size = st->size;
+	attr->blksize = st->blksize;
+	attr->blocks = st->blocks;
+	attr->atime_sec = st->atime.tv_sec;
+	attr->atime_nsec = st->atime.tv_nsec;
+	attr->mtime_sec = st->mtime.tv_sec;
+	attr->mtime_nsec = st->mtime.tv_nsec;
+	attr->ctime_sec = st->ctime.tv_sec;
+	attr->ctime_nsec = st->ctime.tv_nsec;
+}
+
+static int p9_path_attr(struct path *path, struct p9_vfs_attr *attr)
+{
+	struct kstat st;
+	int err;
+
+	err = vfs_getattr(path, &st);
+	if (err)
+		return err;
+	p9_kstat_attr(&st, attr);
+	return 0;
+}
+
+static int set_owner(struct dentry *d, int uid, int gid)
+{
+	int err = 0;
+	struct iattr iattr;
+
+	p9s_debug("set_owner : uid %d, gid %d\n", uid, gid);
+
+	memset(&iattr, 0, sizeof(struct iattr));
+
+	if (uid >= 0) {
+		iattr.ia_valid |= ATTR_UID;
+		iattr.ia_uid.val = uid;
+	}
+	if (gid >= 0) {
+		iattr.ia_valid |= ATTR_GID;
+		iattr.ia_gid.val = gid;
+	}
+	if (iattr.ia_valid) {
+		inode_lock(d->d_inode);
+		err = notify_change(d, &iattr, NULL);
+		inode_unlock(d->d_inode);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+/* Gives a made entry of dir its owner and returns its attributes. */
+static int p9_made(struct p9_vfs_file *dir, struct dentry *dentry,
+		   u32 uid, u32 gid, struct p9_vfs_attr *attr)
+{
+	struct path path = { .mnt = dir->path.mnt, .dentry = dentry };
+
+	set_owner(dentry, uid, gid);
+	return p9_path_attr(&path, attr);
+}
+/*
+ * Blocking I/O on pipes, sockets and devices may wait forever, out of
+ * reach of Tflush. Such files are made nonblocking and the server waits
+ * for them itself, see p9_wait_ready().
+ */
+static void p9_set_poll_io(struct p9_vfs_file *f, struct file *filp,
+			   u32 flags)
+{
+	umode_t mode = file_inode(filp)->i_mode;
+
+	if (S_ISREG(mode) || S_ISDIR(mode) || (flags & O_NONBLOCK) ||
+	    !filp->f_op->poll)
+		return;
+
+	spin_lock(&filp->f_lock);
+	filp->f_flags |= O_NONBLOCK;
+	spin_unlock(&filp->f_lock);
+	f->poll_io = true;
+}
+
+/* Wait until filp has one of events, or the request is flushed. */
+static int p9_wait_ready(struct file *filp, unsigned int events,
+			 struct p9_fcall *in)
+{
+	struct poll_wqueues table;
+	ktime_t expire;
+	int err = 0;
+
+	poll_initwait(&table);
+	for (;;) {
+		if (filp->f_op->poll(filp, &table.pt) & (events | POLLERR |
+							 POLLHUP))
+			break;
+		/* Only queue on the wait queues the first time. */
+		table.pt._qproc = NULL;
+		if (p9_cancelled(in)) {
+			err = -EINTR;
+			break;
+		}
+		expire = ktime_add_ms(ktime_get(), P9_CANCEL_POLL_MSECS);
+		poll_schedule_timeout(&table, TASK_INTERRUPTIBLE, &expire, 0);
+	}
+	poll_freewait(&table);
+	return err;
+}
+
+/*
+ * Block I/O is tagged with the priority in the issuing task's io_context,
+ * and this kernel has no per-kiocb priority. So the thread takes on that
+ * of the file for the duration of a data operation. That is only done on
+ * the module's own threads, which run one request at a time: the exec
+ * or pool threads of a device, or a socket's thread. A shared kworker
+ * would carry the priority into other work. Returns the priority to
+ * restore, or -1.
+ */
+static int p9_ioprio_enter(struct p9_vfs_file *f)
+{
+	int prio = READ_ONCE(f->ioprio) ?: READ_ONCE(f->fs->ioprio);
+	int old;
+
+	if (!prio || WARN_ON_ONCE(current->flags & PF_WQ_WORKER))
+		return -1;
+	old = current->io_context ? current->io_context->ioprio : 0;
+	if (old == prio || set_task_ioprio(current, prio))
+		return -1;
+	return old;
+}
+
+static void p9_ioprio_exit(int old)
+{
+	if (old >= 0)
+		set_task_ioprio(current, old);
+}
+
+/* Every this many transfers of a class, the slower route is measured. */
+#define P9_DATA_PROBE 64
+
+static bool p9_has_iter(struct file *filp, bool write)
+{
+	return write ? !!filp->f_op->write_iter : !!filp->f_op->read_iter;
+}
+
+static bool p9_page_cached(struct address_space *mapping, pgoff_t index)
+{
+	struct page *page = find_get_page(mapping, index);
+	bool ret = page && PageUptodate(page);
+
+	if (page)
+		put_page(page);
+	return ret;
+}
+
+/* Whether the first and last page of a read are already in memory. */
+static bool p9_data_cached(struct file *filp, loff_t pos, size_t count)
+{
+	pgoff_t first = pos >> PAGE_SHIFT;
+	pgoff_t last = (pos + count - 1) >> PAGE_SHIFT;
+
+	return p9_page_cached(filp->f_mapping, first) &&
+		(last == first || p9_page_cached(filp->f_mapping, last));
+}
+
+static int p9_data_class(struct iov_iter *data, size_t count, bool write)
+{
+	int size = count <= 512 ? 0 : count <= 2048 ? 1 : 2;
+	bool frag = data->nr_segs > 1 && count / data->nr_segs < 1024;
+
+	return ((write ? 3 : 0) + size) * 2 + frag;
+}
+
+/*
+ * Picks how to move the data of a file with iter ops. Copying through a
+ * PDU buffer pays a memcpy to save the per-segment overhead of the
+ * file's iter ops, so it can only win for small or fragmented transfers
+ * that don't wait on the disk. Where both routes can win, the cheaper
+ * one measured so far is taken and *cost is set to the class to account
+ * the transfer to.
+ */
+static int p9_data_route(struct p9_vfs_file *f, struct iov_iter *data,
+			 loff_t pos, bool write, struct p9_data_cost **cost)
+{
+	struct file *filp = f->filp;
+	size_t count = iov_iter_count(data);
+	struct p9_data_cost *c;
+	u32 direct, bounce, uses;
+	int route;
+
+	*cost = NULL;
+	if (!count || count > P9_PDU_MAX || f->poll_io ||
+	    (filp->f_flags & O_DIRECT))
+		return P9_DATA_DIRECT;
+	if (!write && S_ISREG(file_inode(filp)->i_mode) &&
+	    !p9_data_cached(filp, pos, count))
+		return P9_DATA_DIRECT;
+
+	c = &f->fs->data_cost[p9_data_class(data, count, write)];
+	*cost = c;
+	direct = READ_ONCE(c->ns_per_kb[P9_DATA_DIRECT]);
+	bounce = READ_ONCE(c->ns_per_kb[P9_DATA_BOUNCE]);
+	if (!direct)
+		return P9_DATA_DIRECT;
+	if (!bounce)
+		return P9_DATA_BOUNCE;
+
+	route = bounce < direct ? P9_DATA_BOUNCE : P9_DATA_DIRECT;
+	uses = READ_ONCE(c->uses) + 1;
+	WRITE_ONCE(c->uses, uses);
+	if (!(uses % P9_DATA_PROBE))
+		route = !route;
+	return route;
+}
+
+static void p9_data_account(struct p9_data_cost *c, int route, u64 ns,
+			    size_t len)
+{
+	u32 old = READ_ONCE(c->ns_per_kb[route]);
+	u32 val = min_t(u64, div_u64(ns << 10, len), U32_MAX) ?: 1;
+
+	/* An average over the last eight or so transfers. */
+	if (old)
+		val = old - (old >> 3) + (val >> 3);
+	WRITE_ONCE(c->ns_per_kb[route], val);
+}
+
+/*
+ * Moves one chunk, buf is NULL for the direct route. Files without iter
+ * ops only come with a buffer, see p9_data_io().
+ */
+static ssize_t p9_chunk_io(struct file *filp, struct iov_iter *chunk,
+			   void *buf, loff_t *pos, bool write)
+{
+	size_t len = iov_iter_count(chunk);
+	struct iov_iter iter;
+	struct kvec kv;
+	ssize_t ret;
+
+	if (!buf)
+		return write ? vfs_iter_write(filp, chunk, pos) :
+			       vfs_iter_read(filp, chunk, pos);
+
+	if (write && copy_from_iter(buf, len, chunk) != len)
+		return -EFAULT;
+
+	if (p9_has_iter(filp, write)) {
+		kv.iov_base = buf;
+		kv.iov_len = len;
+		iov_iter_kvec(&iter, ITER_KVEC | (write ? WRITE : READ),
+			      &kv, 1, len);
+		ret = write ? vfs_iter_write(filp, &iter, pos) :
+			      vfs_iter_read(filp, &iter, pos);
+	} else {
+		ret = write ? kernel_write(filp, buf, len, *pos) :
+			      kernel_read(filp, *pos, buf, len);
+		if (ret > 0)
+			*pos += ret;
+	}
+
+	if (!write && ret > 0 && copy_to_iter(buf, ret, chunk) != ret)
+		return -EFAULT;
+	return ret;
+}
+
+/*
+ * The checks vfs_read()/vfs_write() make, which vfs_iter_read() and
+ * vfs_iter_write() leave to their callers.
+ */
+static int p9_data_allowed(struct file *filp, loff_t *pos, size_t count,
+			   bool write)
+{
+	int ret;
+
+	if (!(filp->f_mode & (write ? FMODE_WRITE : FMODE_READ)))
+		return -EBADF;
+	if (!(filp->f_mode & (write ? FMODE_CAN_WRITE : FMODE_CAN_READ)))
+		return -EINVAL;
+	ret = rw_verify_area(write ? WRITE : READ, filp, pos, count);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * I/O between the file and data, a chunk at a time so that a Tflush
+ * stops it in between. A flushed request returns what was done.
+ */
+static ssize_t p9_data_io(struct p9_vfs_file *f, struct iov_iter *data,
+			  u64 offset, struct p9_fcall *in, bool write)
+{
+	struct p9_pdu_pool *pool = p9_pdu_pool_of(in);
+	struct file *filp = f->filp;
+	struct p9_fcall *bounce = NULL;
+	struct p9_data_cost *cost;
+	struct iov_iter chunk;
+	loff_t pos = offset;
+	size_t len, max = P9_IO_CHUNK;
+	ssize_t ret, done = 0;
+	u64 start = 0;
+	int route;
+
+	ret = p9_data_allowed(filp, &pos, iov_iter_count(data), write);
+	if (ret)
+		return ret;
+
+	/*
+	 * Files with only ->read or ->write, such as some device files,
+	 * always go through a buffer and kernel_read()/kernel_write().
+	 */
+	if (p9_has_iter(filp, write)) {
+		route = p9_data_route(f, data, pos, write, &cost);
+	} else {
+		route = P9_DATA_BOUNCE;
+		cost = NULL;
+	}
+	if (route == P9_DATA_BOUNCE) {
+		bounce = p9_pdu_new(P9_PDU_MAX, READ_ONCE(f->fs->server->node),
+				    NULL, NULL, pool);
+		if (!bounce && !p9_has_iter(filp, write))
+			return -ENOMEM;
+		if (bounce)
+			max = bounce->capacity;
+		else
+			cost = NULL;
+	}
+	if (cost)
+		start = ktime_get_ns();
+	if (write)
+		file_start_write(filp);
+
+	while (iov_iter_count(data)) {
+		chunk = *data;
+		iov_iter_truncate(&chunk, max);
+		len = iov_iter_count(&chunk);
+
+		ret = p9_chunk_io(filp, &chunk, bounce ? bounce->sdata : NULL,
+				  &pos, write);
+		if (ret == -EAGAIN && f->poll_io && !done) {
+			ret = p9_wait_ready(filp, write ? POLLOUT : POLLIN, in);
+			if (!ret)
+				continue;
+		}
+		if (ret <= 0) {
+			if (!done)
+				done = ret;
+			break;
+		}
+
+		iov_iter_advance(data, ret);
+		done += ret;
+		/* Pipes and sockets return what they have, don't wait. */
+		if (ret < len || f->poll_io)
+			break;
+		if (p9_cancelled(in))
+			break;
+	}
+
+	if (write)
+		file_end_write(filp);
+	/* kernel_read() and kernel_write() notify on their own. */
+	if (done > 0 && p9_has_iter(filp, write)) {
+		if (write)
+			fsnotify_modify(filp);
+		else
+			fsnotify_access(filp);
+	}
+
+	if (cost && done > 0)
+		p9_data_account(cost, bounce ? P9_DATA_BOUNCE : P9_DATA_DIRECT,
+				ktime_get_ns() - start, done);
+	if (bounce)
+		p9_pdu_free(bounce);
+	return done;
+}
+
+/* p9_vfs_ops */
+
+static int kvfs_root(void *fs, struct p9_vfs_file **f)
+{
+	struct p9_vfs_kernel *k = fs;
+
+	*f = file_new(k, &k->root);
+	return *f ? 0 : -ENOMEM;
+}
+
+static int kvfs_walk(struct p9_vfs_file *f, const char *name, u16 len)
+{
+	return p9_walk_one(&f->path, name, len);
+}
+
+static int kvfs_clone(struct p9_vfs_file *f, struct p9_vfs_file **nf)
+{
+	*nf = file_new(f->fs, &f->path);
+	if (!*nf)
+		return -ENOMEM;
+	(*nf)->ioprio = READ_ONCE(f->ioprio);
+	return 0;
+}
+
+static void kvfs_release(struct p9_vfs_file *f)
+{
+	if (f->filp)
+		filp_close(f->filp, NULL);
+	path_put(&f->path);
+	kfree(f);
+}
+
+static int kvfs_getattr(struct p9_vfs_file *f, struct p9_vfs_attr *attr)
+{
+	return p9_path_attr(&f->path, attr);
+}
+
+static int kvfs_setattr(struct p9_vfs_file *f, struct p9_vfs_iattr *ia)
+{
+	int err;
+	struct iattr iattr;
+	struct dentry *dentry = f->path.dentry;
+
+	memset(&iattr, 0, sizeof(struct iattr));
+
+	if (ia->valid & P9_ATTR_MODE) {
+		iattr.ia_valid |= ATTR_MODE | ATTR_CTIME;
+		iattr.ia_mode = ia->mode;
+		iattr.ia_ctime = current_time(dentry->d_inode);
+	}
+
+	if (ia->valid & P9_ATTR_ATIME) {
+		iattr.ia_valid |= ATTR_ATIME;
+		if (ia->valid & P9_ATTR_ATIME_SET) {
+			iattr.ia_valid |= ATTR_ATIME_SET;
+			iattr.ia_atime.tv_sec = ia->atime_sec;
+			iattr.ia_atime.tv_nsec = ia->atime_nsec;
+		} else
+			iattr.ia_atime.tv_nsec = UTIME_NOW;
+	} else
+		iattr.ia_atime.tv_nsec = UTIME_OMIT;
+
+	if (ia->valid & P9_ATTR_MTIME) {
+		iattr.ia_valid |= ATTR_MTIME;
+		if (ia->valid & P9_ATTR_MTIME_SET) {
+			iattr.ia_valid |= ATTR_MTIME_SET;
+			iattr.ia_mtime.tv_sec = ia->mtime_sec;
+			iattr.ia_mtime.tv_nsec = ia->mtime_nsec;
+		} else
+			iattr.ia_mtime.tv_nsec = UTIME_NOW;
+	} else
+		iattr.ia_mtime.tv_nsec = UTIME_OMIT;
+
+	if (ia->valid & P9_ATTR_UID) {
+		iattr.ia_valid |= ATTR_UID;
+		iattr.ia_uid.val = ia->uid;
+	}
+	if (ia->valid & P9_ATTR_GID) {
+		iattr.ia_valid |= ATTR_GID;
+		iattr.ia_gid.val = ia->gid;
+	}
+	if (ia->valid & P9_ATTR_CTIME) {
+		iattr.ia_valid |= ATTR_CTIME;
+		iattr.ia_ctime = current_time(dentry->d_inode);
+	}
+	if (iattr.ia_valid) {
+		inode_lock(dentry->d_inode);
+		err = notify_change(dentry, &iattr, NULL);
+		inode_unlock(dentry->d_inode);
+		if (err < 0)
+			return err;
+	}
+	if (ia->valid & P9_ATTR_SIZE) {
+		err = vfs_truncate(&f->path, ia->size);
+		if (err < 0)
+			return err;
+	}
+	return 0;
+}
+
+static int kvfs_statfs(struct p9_vfs_file *f, struct p9_vfs_statfs *st)
+{
+	struct kstatfs kst;
+	int err;
+
+	err = vfs_statfs(&f->path, &kst);
+	if (err)
+		return err;
+
+	st->type = kst.f_type;
+	st->bsize = kst.f_bsize;
+	st->blocks = kst.f_blocks;
+	st->bfree = kst.f_bfree;
+	st->bavail = kst.f_bavail;
+	st->files = kst.f_files;
+	st->ffree = kst.f_ffree;
+	st->fsid = (unsigned int) kst.f_fsid.val[0] |
+		(unsigned long long)kst.f_fsid.val[1] << 32;
+	st->namelen = kst.f_namelen;
+	return 0;
+}
+
+static int kvfs_open(struct p9_vfs_file *f, int flags)
+{
+	struct file *filp;
+
+	// TODO: verify if being error is also considered busy
+	if (f->filp)
+		return -EBUSY;
+
+	filp = dentry_open(&f->path, flags, current_cred());
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+	p9_set_poll_io(f, filp, flags);
+	if (cmpxchg(&f->filp, NULL, filp)) {
+		filp_close(filp, NULL);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+static int kvfs_create(struct p9_vfs_file *dir, const char *name, u16 len,
+			 int flags, u32 mode, u32 uid, u32 gid,
+			 struct p9_vfs_file **nf, struct p9_vfs_attr *attr)
+{
+	int err;
+	struct path new_path;
+	struct file *new_filp;
+	struct dentry *dentry = dir->path.dentry;
+
+	if (dir->filp)
+		return -EBUSY;
+
+	new_path.mnt = dir->path.mnt;
+	new_path.dentry = p9_lookup_new(dir, name, len);
+	if (IS_ERR(new_path.dentry))
+		return PTR_ERR(new_path.dentry);
+
+	err = vfs_create(dentry->d_inode, new_path.dentry, mode,
+			 flags & O_EXCL);
+	if (err)
+		goto out_dput;
+
+	set_owner(new_path.dentry, uid, gid);
+	new_filp = dentry_open(&new_path, flags | O_CREAT, current_cred());
+	if (IS_ERR(new_filp)) {
+		err = PTR_ERR(new_filp);
+		goto out_dput;
+	}
+
+	err = p9_path_attr(&new_path, attr);
+	if (!err) {
+		*nf = file_new(dir->fs, &new_path);
+		if (!*nf)
+			err = -ENOMEM;
+	}
+	if (err) {
+		filp_close(new_filp, NULL);
+		goto out_dput;
+	}
+	(*nf)->filp = new_filp;
+	(*nf)->ioprio = READ_ONCE(dir->ioprio);
+
+out_dput:
+	dput(new_path.dentry);
+	return err;
+}
+
+static ssize_t kvfs_read(struct p9_vfs_file *f, struct iov_iter *data,
+			   u64 off, struct p9_fcall *in)
+{
+	ssize_t len;
+	int prio;
+
+	if (!f->filp)
+		return -EBADF;
+
+	prio = p9_ioprio_enter(f);
+	len = p9_data_io(f, data, off, in, false);
+	p9_ioprio_exit(prio);
+	return len;
+}
+
+static ssize_t kvfs_write(struct p9_vfs_file *f, struct iov_iter *data,
+			    u64 off, struct p9_fcall *in)
+{
+	ssize_t len;
+	int prio;
+
+	if (!f->filp)
+		return -EBADF;
+
+	prio = p9_ioprio_enter(f);
+	len = p9_data_io(f, data, off, in, true);
+	p9_ioprio_exit(prio);
+	return len;
+}
+
+struct p9_readdir_ctx {
+	struct dir_context ctx;
+	struct p9_vfs_file *dir;
+	bool is_root;
+	int err;
+	bool stopped;
+
+	p9_vfs_filldir_t fill;
+	void *fill_ctx;
+
+	bool has_prev;
+	struct {
+		struct p9_qid qid;
+		char name[MAX_FILE_NAME];
+		int namlen;
+		unsigned int d_type;
+	} prev;
+};
+
+/* Hand the previous element, which ends at offset, to the filler. */
+static bool p9_readdir_emit(struct p9_readdir_ctx *_ctx, u64 offset)
+{
+	_ctx->has_prev = false;
+	return !_ctx->fill(_ctx->fill_ctx, _ctx->prev.name, _ctx->prev.namlen,
+			   &_ctx->prev.qid, _ctx->prev.d_type, offset);
+}
+
+/*
+ *	The callback function from iterate_dir.
+ *
+ *	Note: returning non-zero terminates the executing of iterate_dir.
+ *		  However, iterate_dir will still return zero.
+ *
+ *	Note: weird logic: the offset is of the previous element. So we
+ *		  deal with the previous element in each iteration.
+ */
+
+static int p9_readdir_cb(struct dir_context *ctx, const char *name, int namlen,
+		loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct path path;
+	struct p9_vfs_attr attr;
+	struct p9_readdir_ctx *_ctx =
+		container_of(ctx, struct p9_readdir_ctx, ctx);
+	struct dentry *parent = _ctx->dir->path.dentry;
+
+	// Hand over the previous element with current offset
+	if (_ctx->has_prev && !p9_readdir_emit(_ctx, (u64) offset)) {
+		_ctx->stopped = true;
+		return 1;
+	}
+
+	if (namlen >= MAX_FILE_NAME) {
+		pr_err("max file name is %d, this file name is %d\n",
+				MAX_FILE_NAME - 1, namlen);
+		_ctx->stopped = true;
+		return 1;
+	}
+
+	/* Prepare the dirent for the next iteration. */
+
+	path.mnt = _ctx->dir->path.mnt;
+
+	// lookup_one_len doesn't allow the lookup of "." and "..".i
+	// We have to do it ourselves.
+	if (namlen == 1 && name[0] == '.')
+		path.dentry = dget(parent);
+	else if (namlen == 2 && name[0] == '.' && name[1] == '.')
+		// No ".." allowed on the mount root
+		path.dentry = _ctx->is_root ? dget(parent) : dget_parent(parent);
+	else
+		path.dentry = p9_lookup_one_len(name, parent, namlen);
+
+	if (IS_ERR(path.dentry)) {
+		_ctx->err = PTR_ERR(path.dentry);
+		return 1;
+	} else if (d_really_is_negative(path.dentry)) {
+		_ctx->err = -ENOENT;
+		goto out;
+	}
+
+	_ctx->err = p9_path_attr(&path, &attr);
+	if (_ctx->err)
+		goto out;
+	p9_vfs_qid(&attr, &_ctx->prev.qid);
+
+	memcpy(_ctx->prev.name, name, namlen);
+	_ctx->prev.name[namlen] = 0;
+	_ctx->prev.namlen = namlen;
+	_ctx->prev.d_type = d_type;
+	_ctx->has_prev = true;
+out:
+	dput(path.dentry);
+	return _ctx->err ? 1 : 0;
+}
+
+static int kvfs_readdir(struct p9_vfs_file *f, u64 off,
+			  p9_vfs_filldir_t fill, void *ctx)
+{
+	int err;
+	loff_t pos;
+	struct p9_readdir_ctx _ctx = {
+		.ctx.actor = p9_readdir_cb,
+		.dir = f,
+		.is_root = f->path.dentry == f->fs->root.dentry,
+		.fill = fill,
+		.fill_ctx = ctx,
+	};
+
+	if (!f->filp)
+		return -EBADF;
+
+	pos = vfs_llseek(f->filp, off, SEEK_SET);
+	if (pos < 0)
+		return pos;
+
+	err = iterate_dir(f->filp, &_ctx.ctx);
+	if (err)
+		return err;
+	if (_ctx.err)
+		return _ctx.err;
+
+	// Hand over the last element
+	if (_ctx.has_prev && !_ctx.stopped)
+		p9_readdir_emit(&_ctx, (u64) _ctx.ctx.pos);
+	return 0;
+}
+
+static int kvfs_fsync(struct p9_vfs_file *f, int datasync)
+{
+	int err, prio;
+
+	if (!f->filp)
+		return -EBADF;
+
+	prio = p9_ioprio_enter(f);
+	err = vfs_fsync(f->filp, datasync);
+	p9_ioprio_exit(prio);
+	return err;
+}
+
+static int kvfs_mkdir(struct p9_vfs_file *dir, const char *name, u16 len,
+			u32 mode, u32 uid, u32 gid, struct p9_vfs_attr *attr)
+{
+	int err;
+	struct dentry *dentry;
+
+	dentry = p9_lookup_new(dir, name, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	// TODO: verify dir's inode is valid
+
+	err = vfs_mkdir(dir->path.dentry->d_inode, dentry, mode);
+	if (!err)
+		err = p9_made(dir, dentry, uid, gid, attr);
+	dput(dentry);
+	return err;
+}
+
+static int kvfs_symlink(struct p9_vfs_file *dir, const char *name, u16 len,
+			  const char *target, u32 uid, u32 gid,
+			  struct p9_vfs_attr *attr)
+{
+	int err;
+	struct dentry *dentry;
+
+	dentry = p9_lookup_new(dir, name, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	err = vfs_symlink(dir->path.dentry->d_inode, dentry, target);
+	if (!err)
+		err = p9_made(dir, dentry, uid, gid, attr);
+	dput(dentry);
+	return err;
+}
+
+static int kvfs_mknod(struct p9_vfs_file *dir, const char *name, u16 len,
+			u32 mode, u32 major, u32 minor, u32 uid, u32 gid,
+			struct p9_vfs_attr *attr)
+{
+	int err;
+	struct dentry *dentry;
+
+	dentry = p9_lookup_new(dir, name, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	err = vfs_mknod(dir->path.dentry->d_inode, dentry, mode,
+			MKDEV(major, minor));
+	if (!err)
+		err = p9_made(dir, dentry, uid, gid, attr);
+	dput(dentry);
+	return err;
+}
+
+static int kvfs_link(struct p9_vfs_file *dir, const char *name, u16 len,
+		       struct p9_vfs_file *target)
+{
+	int err;
+	struct dentry *dentry;
+
+	dentry = p9_lookup_new(dir, name, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+
+	// TODO: make sure dir dentry is positive
+
+	err = vfs_link(target->path.dentry, dir->path.dentry->d_inode,
+		       dentry, NULL);
+	dput(dentry);
+	return err;
+}
+
+static ssize_t kvfs_readlink(struct p9_vfs_file *f, char *buf, size_t len)
+{
+	const char *link;
+	size_t n;
+	DEFINE_DELAYED_CALL(done);
+
+	link = vfs_get_link(f->path.dentry, &done);
+	if (IS_ERR(link))
+		return PTR_ERR(link);
+
+	n = strlen(link);
+	memcpy(buf, link, min(n, len));
+	do_delayed_call(&done);
+	return n;
+}
+
+static int p9_unlink(struct dentry *dentry, int flags)
+{
+	struct inode *dir = dentry->d_parent->d_inode;
+
+	if (d_really_is_negative(dentry))
+		return -ENOENT;
+	if (d_is_dir(dentry))
+		return flags & AT_REMOVEDIR ? vfs_rmdir(dir, dentry) : -EISDIR;
+	return flags & AT_REMOVEDIR ? -ENOTDIR : vfs_unlink(dir, dentry, NULL);
+}
+
+static int kvfs_unlinkat(struct p9_vfs_file *dir, const char *name,
+			   u16 len, int flags)
+{
+	struct dentry *dentry;
+	int err;
+
+	dentry = p9_lookup_one_len(name, dir->path.dentry, len);
+	if (IS_ERR(dentry))
+		return PTR_ERR(dentry);
+	err = p9_unlink(dentry, flags);
+	dput(dentry);
+	return err;
+}
+
+static int kvfs_remove(struct p9_vfs_file *f)
+{
+	struct dentry *dentry = f->path.dentry;
+
+	return p9_unlink(dentry, d_is_dir(dentry) ? AT_REMOVEDIR : 0);
+}
+
+/* Move old_dentry to name in ndir. */
+static int p9_rename(struct dentry *old_dentry, struct p9_vfs_file *ndir,
+		     const char *name, u16 len)
+{
+	struct dentry *new_dentry;
+	int err;
+
+	new_dentry = p9_lookup_one_len(name, ndir->path.dentry, len);
+	if (IS_ERR(new_dentry))
+		return PTR_ERR(new_dentry);
+
+	// TODO: security: new dir under the root
+
+	err = vfs_rename(old_dentry->d_parent->d_inode, old_dentry,
+			 ndir->path.dentry->d_inode, new_dentry, NULL, 0);
+	dput(new_dentry);
+	return err;
+}
+
+static int kvfs_rename(struct p9_vfs_file *f, struct p9_vfs_file *ndir,
+			 const char *name, u16 len)
+{
+	return p9_rename(f->path.dentry, ndir, name, len);
+}
+
+static int kvfs_renameat(struct p9_vfs_file *odir, const char *oname,
+			   u16 olen, struct p9_vfs_file *ndir,
+			   const char *nname, u16 nlen)
+{
+	struct dentry *old_dentry;
+	int err;
+
+	old_dentry = p9_lookup_one_len(oname, odir->path.dentry, olen);
+	if (IS_ERR(old_dentry))
+		return PTR_ERR(old_dentry);
+	if (d_really_is_negative(old_dentry))
+		err = -ENOENT;
+	else
+		err = p9_rename(old_dentry, ndir, nname, nlen);
+	dput(old_dentry);
+	return err;
+}
+
+static int kvfs_ioprio(struct p9_vfs_file *f, u16 prio)
+{
+	switch (IOPRIO_PRIO_CLASS(prio)) {
+	case IOPRIO_CLASS_NONE:
+		if (prio)
+			return -EINVAL;
+		break;
+	case IOPRIO_CLASS_BE:
+		if (IOPRIO_PRIO_DATA(prio) >= IOPRIO_BE_NR)
+			return -EINVAL;
+		break;
+	case IOPRIO_CLASS_IDLE:
+		break;
+	case IOPRIO_CLASS_RT:
+		return -EPERM;
+	default:
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(f->ioprio, prio);
+	return 0;
+}
+
+static const struct p9_vfs_ops p9_vfs_kernel_ops = {
+	.root		= kvfs_root,
+	.walk		= kvfs_walk,
+	.clone		= kvfs_clone,
+	.release	= kvfs_release,
+	.getattr	= kvfs_getattr,
+	.setattr	= kvfs_setattr,
+	.statfs		= kvfs_statfs,
+	.open		= kvfs_open,
+	.create		= kvfs_create,
+	.read		= kvfs_read,
+	.write		= kvfs_write,
+	.readdir	= kvfs_readdir,
+	.fsync		= kvfs_fsync,
+	.mkdir		= kvfs_mkdir,
+	.symlink	= kvfs_symlink,
+	.mknod		= kvfs_mknod,
+	.link		= kvfs_link,
+	.readlink	= kvfs_readlink,
+	.unlinkat	= kvfs_unlinkat,
+	.remove		= kvfs_remove,
+	.rename		= kvfs_rename,
+	.renameat	= kvfs_renameat,
+	.ioprio		= kvfs_ioprio,
+};
+
+/* The server takes over the reference on root, even on failure. */
+struct p9_server *p9_server_create(struct path *root)
+{
+	struct p9_vfs_kernel *fs;
+	struct p9_server *s;
+
+	fs = kzalloc(sizeof(struct p9_vfs_kernel), GFP_KERNEL);
+	if (!fs)
+		goto fail;
+	s = p9_server_new(&p9_vfs_kernel_ops, fs);
+	if (!s) {
+		kfree(fs);
+		goto fail;
+	}
+
+	fs->root = *root;
+	fs->server = s;
+	return s;
+
+fail:
+	path_put(root);
+	return ERR_PTR(-ENOMEM);
+}
+
+void p9_server_set_ioprio(struct p9_server *s, int ioprio)
+{
+	struct p9_vfs_kernel *fs = s->fs;
+
+	WRITE_ONCE(fs->ioprio, ioprio);
+}
+
+/*
+ * Checkpoint of the fid table. Fids are saved by their path relative to
+ * the export, so they can be restored on another host exporting the same
+ * tree. Fids on another mount than the export root or on unlinked files
+ * cannot be found again by path; they are saved as stale, and the guest
+ * gets ESTALE on them after the restore.
+ */
+
+static int fid_rel_path(struct p9_vfs_kernel *fs, struct p9_vfs_file *f,
+			char *buf, const char *root, size_t rootlen,
+			const char **rel)
+{
+	char *p;
+
+	if (f->path.mnt != fs->root.mnt || d_unlinked(f->path.dentry))
+		return -EXDEV;
+
+	p = dentry_path_raw(f->path.dentry, buf, PATH_MAX);
+	if (IS_ERR(p))
+		return PTR_ERR(p);
+
+	/* root is "/" or has no trailing slash. */
+	if (rootlen == 1) {
+		*rel = p + 1;
+		return 0;
+	}
+	if (strncmp(p, root, rootlen) ||
+	    (p[rootlen] != '/' && p[rootlen] != '\0'))
+		return -EXDEV;
+	p += rootlen;
+	*rel = *p == '/' ? p + 1 : p;
+	return 0;
+}
+
+/* Returns the length of the checkpoint, written only if it fits. */
+long p9_server_save(struct p9_server *s, void __user *buf, size_t size)
+{
+	struct p9_vfs_kernel *fs = s->fs;
+	struct vhost_9p_fids_hdr hdr = {
+		.magic = VHOST_9P_FIDS_MAGIC,
+		.uid = s->uid,
+	};
+	struct vhost_9p_fid_rec *rec;
+	struct p9_server_fid **fids;
+	struct p9_server_fid *fid;
+	struct p9_vfs_file *f;
+	char *rootbuf, *root;
+	const char *rel;
+	size_t len = sizeof(hdr), rlen, rootlen;
+	unsigned int i, max, count = 0;
+	long err = 0;
+	unsigned int bkt;
+
+	spin_lock(&s->fid_lock);
+	count = s->nr_fids;
+	spin_unlock(&s->fid_lock);
+	max = count;
+
+	fids = kcalloc(count ?: 1, sizeof(*fids), GFP_KERNEL);
+	rootbuf = kmalloc(PATH_MAX, GFP_KERNEL);
+	rec = kmalloc(sizeof(*rec) + PATH_MAX + 8, GFP_KERNEL);
+	if (!fids || !rootbuf || !rec) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* Pin the fids, the table may change while we copy out. */
+	count = 0;
+	spin_lock(&s->fid_lock);
+	p9_for_each_fid(s, bkt, fid) {
+		if (count < max) {
+			fids[count] = fid;
+			kref_get(&fids[count++]->ref);
+		}
+	}
+	spin_unlock(&s->fid_lock);
+
+	root = dentry_path_raw(fs->root.dentry, rootbuf, PATH_MAX);
+	if (IS_ERR(root)) {
+		err = PTR_ERR(root);
+		goto out_put;
+	}
+	rootlen = strlen(root);
+
+	for (i = 0; i < count; i++) {
+		fid = fids[i];
+		f = fid->file;
+		err = fid->stale ? -EXDEV :
+			fid_rel_path(fs, f, rec->path, root, rootlen, &rel);
+		if (err && err != -EXDEV)
+			goto out_put;
+
+		rec->stale = !!err;
+		if (rec->stale)
+			rel = "";
+		err = 0;
+		rec->path_len = strlen(rel);
+		memmove(rec->path, rel, rec->path_len + 1);
+		rec->fid = fid->fid;
+		rec->uid = fid->uid;
+		rec->opened = !rec->stale && f->filp;
+		rec->flags = rec->opened ? f->filp->f_flags : 0;
+		if (f->poll_io)
+			rec->flags &= ~O_NONBLOCK;
+		rec->pos = rec->opened ? f->filp->f_pos : 0;
+
+		rlen = ALIGN(sizeof(*rec) + rec->path_len + 1, 8);
+		memset(rec->path + rec->path_len, 0,
+		       rlen - sizeof(*rec) - rec->path_len);
+		if (len + rlen <= size && copy_to_user(buf + len, rec, rlen)) {
+			err = -EFAULT;
+			goto out_put;
+		}
+		len += rlen;
+	}
+
+	hdr.count = count;
+	if (len <= size && copy_to_user(buf, &hdr, sizeof(hdr)))
+		err = -EFAULT;
+
+out_put:
+	for (i = 0; i < count; i++)
+		p9_fid_put(fids[i]);
+out:
+	kfree(rec);
+	kfree(rootbuf);
+	kfree(fids);
+	return err ? err : len;
+}
+
+static bool path_has_dotdot(const char *p)
+{
+	const char *c;
+
+	for (c = p; *c; c++)
+		if (c[0] == '.' && c[1] == '.' && (c == p || c[-1] == '/') &&
+		    (c[2] == '/' || c[2] == '\0'))
+			return true;
+	return false;
+}
+
+/*
+ * Finds the file at p, relative to the export, the way Twalk would: a
+ * component at a time, without following symlinks on the way.
+ */
+static int restore_path(struct p9_vfs_kernel *fs, const char *p,
+			struct path *path)
+{
+	const char *end;
+	int err;
+
+	*path = fs->root;
+	path_get(path);
+	while (*p) {
+		end = strchrnul(p, '/');
+		err = p9_walk_one(path, p, end - p);
+		if (err) {
+			path_put(path);
+			return err;
+		}
+		p = *end ? end + 1 : end;
+	}
+	return 0;
+}
+
+static int restore_fid(struct p9_server *s, struct vhost_9p_fid_rec *rec)
+{
+	struct p9_vfs_kernel *fs = s->fs;
+	struct p9_server_fid *fid;
+	struct p9_vfs_file *f;
+	struct file *filp;
+	struct path path;
+	loff_t pos;
+	int err;
+
+	if (rec->stale) {
+		/* Only there to be clunked, it never reaches a file. */
+		path = fs->root;
+		path_get(&path);
+	} else {
+		err = restore_path(fs, rec->path, &path);
+		if (err)
+			return err;
+	}
+
+	f = file_new(fs, &path);
+	path_put(&path);
+	if (!f)
+		return -ENOMEM;
+	fid = p9_fid_new(s, rec->fid, f);
+	if (IS_ERR(fid))
+		return PTR_ERR(fid);
+	fid->uid = rec->uid;
+	fid->stale = rec->stale;
+
+	err = 0;
+	if (rec->opened && !rec->stale) {
+		filp = dentry_open(&f->path,
+				   rec->flags & ~(O_CREAT | O_EXCL | O_TRUNC),
+				   current_cred());
+		if (IS_ERR(filp)) {
+			err = PTR_ERR(filp);
+			goto out;
+		}
+		pos = vfs_llseek(filp, rec->pos, SEEK_SET);
+		if (pos < 0) {
+			filp_close(filp, NULL);
+			err = pos;
+			goto out;
+		}
+		p9_set_poll_io(f, filp, rec->flags);
+		if (cmpxchg(&f->filp, NULL, filp)) {
+			filp_close(filp, NULL);
+			err = -EBUSY;
+		}
+	}
+
+out:
+	p9_fid_put(fid);
+	return err;
+}
+
+/* Rebuild the fid table from a checkpoint. The table must be empty. */
+int p9_server_restore(struct p9_server *s, const void __user *buf,
+		size_t size)
+{
+	struct vhost_9p_fids_hdr hdr;
+	struct vhost_9p_fid_rec *rec;
+	size_t off = sizeof(hdr), rlen;
+	unsigned int i;
+	int err = 0;
+
+	if (size < sizeof(hdr))
+		return -EINVAL;
+	if (copy_from_user(&hdr, buf, sizeof(hdr)))
+		return -EFAULT;
+	if (hdr.magic != VHOST_9P_FIDS_MAGIC)
+		return -EINVAL;
+	if (s->nr_fids)
+		return -EBUSY;
+
+	rec = kmalloc(sizeof(*rec) + PATH_MAX, GFP_KERNEL);
+	if (!rec)
+		return -ENOMEM;
+
+	for (i = 0; i < hdr.count; i++) {
+		err = -EINVAL;
+		if (size - off < sizeof(*rec))
+			goto fail;
+		if (copy_from_user(rec, buf + off, sizeof(*rec))) {
+			err = -EFAULT;
+			goto fail;
+		}
+		if (rec->path_len >= PATH_MAX)
+			goto fail;
+		rlen = ALIGN(sizeof(*rec) + rec->path_len + 1, 8);
+		if (size - off < rlen)
+			goto fail;
+		if (copy_from_user(rec->path, buf + off + sizeof(*rec),
+				   rec->path_len)) {
+			err = -EFAULT;
+			goto fail;
+		}
+		rec->path[rec->path_len] = '\0';
+		if (strlen(rec->path) != rec->path_len ||
+		    rec->path[0] == '/' || path_has_dotdot(rec->path))
+			goto fail;
+
+		err = restore_fid(s, rec);
+		if (err)
+			goto fail;
+		off += rlen;
+	}
+
+	s->uid = hdr.uid;
+	kfree(rec);
+	return 0;
+
+fail:
+	p9_server_clear(s);
+	kfree(rec);
+	return err;
+}
+
+size_t p9_server_mem(struct p9_server *s)
+{
+	size_t bytes = sizeof(*s) + sizeof(struct p9_vfs_kernel);
+
+	spin_lock(&s->fid_lock);
+	bytes += sizeof(struct hlist_head) << s->fid_bits;
+	bytes += s->nr_fids * (sizeof(struct p9_server_fid) +
+			       sizeof(struct p9_vfs_file));
+	spin_unlock(&s->fid_lock);
+	return bytes;
+}
+
+/* Servers being torn down in the background. */
+static struct workqueue_struct *p9_close_wq;
+
+static void p9_server_close_work(struct work_struct *work)
+{
+	struct p9_vfs_kernel *fs =
+		container_of(work, struct p9_vfs_kernel, close_work);
+	struct p9_server *s = fs->server;
+	struct p9_server_fid *fid;
+	struct hlist_node *tmp;
+	unsigned long count = 0;
+	ktime_t start = ktime_get();
+	s64 us;
+	unsigned int bkt;
+
+	p9_for_each_fid_safe(s, bkt, tmp, fid) {
+		hlist_del_init(&fid->node);
+		s->nr_fids--;
+		p9_fid_put(fid);
+		if (!(++count % 1024))
+			cond_resched();
+	}
+	p9_server_free(s);
+
+	path_put(&fs->root);
+	us = ktime_us_delta(ktime_get(), start);
+	trace_p9_server_teardown(count, us);
+	pr_debug("9p server closed %lu fids in %lld us\n", count, us);
+	kfree(fs);
+}
+
+/*
+ * Closing files and dropping dentries for a large fid table takes long,
+ * so release only hands the server over to a worker. No request may be
+ * running on the server any more.
+ */
+void p9_server_close(struct p9_server *s)
+{
+	struct p9_vfs_kernel *fs;
+
+	if (IS_ERR_OR_NULL(s))
+		return;
+
+	fs = s->fs;
+	INIT_WORK(&fs->close_work, p9_server_close_work);
+	queue_work(p9_close_wq, &fs->close_work);
+}
+
+int p9_server_init(void)
+{
+	p9_close_wq = alloc_workqueue("vhost-9p-close", WQ_UNBOUND, 0);
+	return p9_close_wq ? 0 : -ENOMEM;
+}
+
+/* Waits for pending teardowns. */
+void p9_server_exit(void)
+{
+	destroy_workqueue(p9_close_wq);
+}
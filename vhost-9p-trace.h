@@ -0,0 +1,35 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM vhost_9p
+
+#if !defined(_VHOST_9P_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VHOST_9P_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A released server's fid table is gone: how many fids it closed, and
+ * how long the background teardown took.
+ */
+TRACE_EVENT(p9_server_teardown,
+	TP_PROTO(unsigned long fids, s64 usecs),
+	TP_ARGS(fids, usecs),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, fids)
+		__field(s64, usecs)
+	),
+
+	TP_fast_assign(
+		__entry->fids = fids;
+		__entry->usecs = usecs;
+	),
+
+	TP_printk("fids=%lu usecs=%lld", __entry->fids, __entry->usecs)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE vhost-9p-trace
+#include <trace/define_trace.h>
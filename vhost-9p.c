@@ -12,6 +12,17 @@
 #include <linux/namei.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/cgroup.h>
+#include <linux/mmu_context.h>
+#include <linux/sched.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/poll.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/math64.h>
+#include <linux/ioprio.h>
 
 #include <linux/virtio_9p.h>
 #include <net/9p/9p.h>
@@ -19,42 +30,827 @@
 #include "vhost.h"
 #include "vhost-9p.h"
 
-/* Max number of bytes transferred before requeueing the job.
- * Using this limit prevents one virtqueue from starving others.
+/* Default work done by a queue worker before requeueing the job, and
+ * bytes a queue may have in flight: sixteen reads of the default msize.
+ * Using these limits prevents one virtqueue from starving others.
  */
-#define VHOST_9P_WEIGHT 0x80000
+#define VHOST_9P_BUDGET_REQS 256
+#define VHOST_9P_BUDGET_BYTES 0x800000
+#define VHOST_9P_BUDGET_USECS 500
 #define VHOST_SET_PATH 3
+/* Number of request queues. Only valid before VHOST_SET_OWNER. */
+#define VHOST_9P_SET_NUM_QUEUES _IOW(VHOST_VIRTIO, 0x90, int)
+/* Max number of requests of the device executing at a time. */
+#define VHOST_9P_SET_MAX_INFLIGHT _IOW(VHOST_VIRTIO, 0x91, int)
+#define VHOST_9P_SET_COALESCE _IOW(VHOST_VIRTIO, 0x92, \
+				   struct vhost_9p_coalesce)
+#define VHOST_9P_GET_STATS _IOR(VHOST_VIRTIO, 0x93, struct vhost_9p_stats)
+#define VHOST_9P_SET_BUDGET _IOW(VHOST_VIRTIO, 0x94, struct vhost_9p_budget)
+/* Serve the device from the shared pool of a NUMA node, -1 for the
+ * caller's node. Only valid before VHOST_SET_OWNER. The pool threads
+ * are shared by devices of several owners and execute their requests
+ * too, so that work is not charged to the owner's cgroups.
+ */
+#define VHOST_9P_SET_POOL _IOW(VHOST_VIRTIO, 0x95, int)
+#define VHOST_9P_SET_AFFINITY _IOW(VHOST_VIRTIO, 0x96, struct vhost_9p_affinity)
+/* Checkpoint and restore the fid table, see struct vhost_9p_fids. */
+#define VHOST_9P_GET_FIDS _IOWR(VHOST_VIRTIO, 0x97, struct vhost_9p_fids)
+#define VHOST_9P_SET_FIDS _IOW(VHOST_VIRTIO, 0x98, struct vhost_9p_fids)
+/* Low-footprint mode: free per-queue scratch memory after this many ms
+ * without requests, 0 to keep it. Only valid before VHOST_SET_OWNER.
+ */
+#define VHOST_9P_SET_IDLE_TRIM _IOW(VHOST_VIRTIO, 0x99, int)
+/* Also serve the device's export on a connected AF_UNIX stream socket,
+ * for clients without a virtqueue. Needs VHOST_SET_PATH first.
+ */
+#define VHOST_9P_ATTACH_SOCKET _IOW(VHOST_VIRTIO, 0x9a, int)
+#define VHOST_9P_SET_QOS _IOW(VHOST_VIRTIO, 0x9b, struct vhost_9p_qos)
+#define VHOST_9P_SET_SCHED _IOW(VHOST_VIRTIO, 0x9c, struct vhost_9p_sched)
+/* Default I/O priority of data operations, an ioprio_set(2) value. Fids
+ * may override it with Tioprio. Requests issue their I/O at it; the
+ * writeback of buffered writes is not covered.
+ */
+#define VHOST_9P_SET_IOPRIO _IOW(VHOST_VIRTIO, 0x9d, int)
+/* Largest msize Tversion agrees to, P9_MIN_MSIZE to P9_MAX_MSIZE. Only
+ * valid before VHOST_SET_PATH.
+ */
+#define VHOST_9P_SET_MSIZE _IOW(VHOST_VIRTIO, 0x9e, int)
+
+/* Used ring entries batched on the stack when vq->heads is trimmed. */
+#define VHOST_9P_STACK_HEADS 32
+
+#define VHOST_9P_QOS_DEF_BURST_MSECS 100
+#define VHOST_9P_QOS_MAX_BURST_MSECS 10000
+/* Keeps the bucket arithmetic within 64 bits. */
+#define VHOST_9P_QOS_MAX_RATE (1ULL << 40)
+
+/* Reads and writes from this size on are bulk requests, see
+ * vhost_9p_req_bulk().
+ */
+#define VHOST_9P_BULK_BYTES 0x4000
+#define VHOST_9P_DEF_WINDOW 8
+
+#define VHOST_9P_DEF_INFLIGHT 128
+#define VHOST_9P_MAX_INFLIGHT 1024
+
+/* An exec thread idle for this long leaves, unless it is the last. */
+#define VHOST_9P_EXEC_IDLE_MSECS 5000
 
 enum {
 	VHOST_9P_FEATURES = VHOST_FEATURES | (1ULL << VIRTIO_9P_MOUNT_TAG)
 };
 
-/* Expects to be always run from workqueue - which acts as
- * read-size critical section for our kind of RCU.
+static unsigned int exec_threads = 8;
+module_param(exec_threads, uint, 0444);
+MODULE_PARM_DESC(exec_threads,
+	"Most threads per device executing its 9P requests, started on demand");
+
+static unsigned int pool_threads = 4;
+module_param(pool_threads, uint, 0444);
+MODULE_PARM_DESC(pool_threads,
+	"Threads per NUMA node serving queues of pooled devices, 0 to disable");
+
+/* Threads shared by the pooled devices of a NUMA node, in place of a
+ * vhost worker, queue workers and exec threads per device. Devices with
+ * ready queues take turns, one queue run each. Runs go before requests,
+ * and the first thread only does runs, so rings keep moving and a Tflush
+ * gets in while the other threads are blocked in requests.
  */
+struct vhost_9p_pool {
+	int nid;
+	spinlock_t lock;
+	/* Devices with queues ready to run. */
+	struct list_head ready;
+	/* Requests waiting for a thread. */
+	struct list_head exec;
+	wait_queue_head_t wait;
+	wait_queue_head_t idle;
+	unsigned int nthreads;
+	struct task_struct *threads[];
+};
 
-static void handle_vq(struct vhost_9p *n)
-{
-	struct vhost_virtqueue *vq = &n->vqs[VHOST_9P_VQ];
+#define VHOST_9P_POOL_PENDING	1
+#define VHOST_9P_POOL_RUNNING	2
+
+static DEFINE_MUTEX(vhost_9p_pools_mutex);
+static struct vhost_9p_pool *vhost_9p_pools[MAX_NUMNODES];
+
+/* A request taken off a virtqueue and handed to the exec threads. */
+struct vhost_9p_req {
+	/* Waiting for an exec thread, under exec_lock. */
+	struct list_head exec_node;
+	struct llist_node node;
+	struct hlist_node hnode;
+	struct vhost_9p_virtqueue *nvq;
+	struct p9_server *server;
+	int head;
+	u16 tag;
+	/* Set by a Tflush for this request, under req_lock. */
+	struct p9_cancel cancel;
+	/* Waiting for an execution slot, under sched_lock. */
+	struct list_head sched_node;
+	bool bulk;
+	bool slotted;
+	/* Bytes written to the guest. */
+	u32 len;
+	/* Charged to the queue's max_bytes while in flight. */
+	u32 cost;
+	/* Time an exec thread spent on the request. */
+	u64 exec_ns;
+	/* Tflush requests waiting for this request to finish. */
+	struct vhost_9p_req *flushes;
+	struct vhost_9p_req *next_flush;
+	/* Guest pages behind the in buffers, while dirty logging is on. */
+	struct vhost_log *log;
+	unsigned int log_num;
 	unsigned int out, in;
+	struct iovec iov[];
+};
+
+static void __vhost_9p_pool_add(struct vhost_9p_pool *pool,
+				struct vhost_9p_virtqueue *nvq)
+{
+	struct vhost_9p *n = container_of(nvq->vq.dev, struct vhost_9p, dev);
+
+	list_add_tail(&nvq->pool_node, &n->pool_ready);
+	if (list_empty(&n->pool_node))
+		list_add_tail(&n->pool_node, &pool->ready);
+	wake_up(&pool->wait);
+}
+
+/* Like queueing a work: a queue that is already running is run again. */
+static void vhost_9p_pool_queue(struct vhost_9p_pool *pool,
+				struct vhost_9p_virtqueue *nvq)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	if (!(nvq->pool_state & VHOST_9P_POOL_PENDING)) {
+		nvq->pool_state |= VHOST_9P_POOL_PENDING;
+		if (!(nvq->pool_state & VHOST_9P_POOL_RUNNING))
+			__vhost_9p_pool_add(pool, nvq);
+	}
+	spin_unlock_irqrestore(&pool->lock, flags);
+}
+
+static void vhost_9p_queue_vq(struct vhost_9p_virtqueue *nvq)
+{
+	if (nvq->worker)
+		kthread_queue_work(nvq->worker, &nvq->work);
+	else if (nvq->pool)
+		vhost_9p_pool_queue(nvq->pool, nvq);
+}
+
+static inline bool vhost_9p_inflight_full(struct vhost_9p *n)
+{
+	return atomic_read(&n->inflight) >= READ_ONCE(n->max_inflight);
+}
+
+static void vhost_9p_wake_stalled(struct vhost_9p *n)
+{
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++)
+		if (test_and_clear_bit(i, &n->stalled))
+			vhost_9p_queue_vq(to_nvq(n->dev.vqs[i]));
+}
+
+/* Hand a request to the exec threads of its device, or of its pool. A
+ * device short of idle threads gets one more.
+ */
+static void vhost_9p_exec_queue(struct vhost_9p *n, struct vhost_9p_req *req)
+{
+	struct vhost_9p_pool *pool = req->nvq->pool;
+	unsigned long flags;
+	bool spawn;
+
+	if (pool) {
+		spin_lock_irqsave(&pool->lock, flags);
+		list_add_tail(&req->exec_node, &pool->exec);
+		spin_unlock_irqrestore(&pool->lock, flags);
+		wake_up(&pool->wait);
+		return;
+	}
+
+	spin_lock(&n->exec_lock);
+	list_add_tail(&req->exec_node, &n->exec_queue);
+	spawn = ++n->exec_queued > n->exec_idle &&
+		READ_ONCE(n->nr_exec) < exec_threads;
+	spin_unlock(&n->exec_lock);
+	wake_up(&n->exec_wait);
+	if (spawn)
+		vhost_work_queue(&n->dev, &n->exec_spawn);
+}
+
+/* Start waiting requests while the device has free slots. Cheap requests
+ * go first, unless a bulk request has been overtaken window times.
+ */
+static void vhost_9p_sched_run(struct vhost_9p *n)
+{
+	struct vhost_9p_req *req;
+	bool bulk;
+
+	while (n->sched_running < n->sched.slots) {
+		if (list_empty(&n->sched_cheap) && list_empty(&n->sched_bulk))
+			break;
+		bulk = list_empty(&n->sched_cheap) ||
+		       (!list_empty(&n->sched_bulk) &&
+			n->sched_overtaken >= n->sched.window);
+		if (bulk) {
+			req = list_first_entry(&n->sched_bulk,
+					       struct vhost_9p_req, sched_node);
+			n->sched_overtaken = 0;
+		} else {
+			req = list_first_entry(&n->sched_cheap,
+					       struct vhost_9p_req, sched_node);
+			if (!list_empty(&n->sched_bulk)) {
+				n->sched_overtaken++;
+				n->sched_overtakes++;
+			}
+		}
+		list_del_init(&req->sched_node);
+		req->slotted = true;
+		n->sched_running++;
+		vhost_9p_exec_queue(n, req);
+	}
+}
+
+static void vhost_9p_queue_req(struct vhost_9p_req *req)
+{
+	struct vhost_9p *n = container_of(req->nvq->vq.dev,
+					  struct vhost_9p, dev);
+
+	req->slotted = false;
+	spin_lock(&n->sched_lock);
+	if (n->sched.slots) {
+		list_add_tail(&req->sched_node, req->bulk ? &n->sched_bulk :
+							    &n->sched_cheap);
+		vhost_9p_sched_run(n);
+		spin_unlock(&n->sched_lock);
+		return;
+	}
+	spin_unlock(&n->sched_lock);
+
+	vhost_9p_exec_queue(n, req);
+}
+
+/* A flushed request still waiting for a slot only has to fail, it goes
+ * to the front.
+ */
+static void vhost_9p_sched_promote(struct vhost_9p *n,
+				   struct vhost_9p_req *req)
+{
+	spin_lock(&n->sched_lock);
+	if (!list_empty(&req->sched_node)) {
+		list_move(&req->sched_node, &n->sched_cheap);
+		vhost_9p_sched_run(n);
+	}
+	spin_unlock(&n->sched_lock);
+}
+
+static void vhost_9p_sched_done(struct vhost_9p *n)
+{
+	spin_lock(&n->sched_lock);
+	n->sched_running--;
+	vhost_9p_sched_run(n);
+	spin_unlock(&n->sched_lock);
+}
+
+/* Requests are decoded and their replies encoded through the owner's
+ * mapping, which the threads executing them hold. Pinning the pages
+ * instead does not pay for the small buffers of most requests, and pages
+ * kept pinned across requests would need an mmu notifier to follow the
+ * owner's mappings.
+ */
+static void vhost_9p_req_iter(struct vhost_9p_req *req,
+			      struct iov_iter *iter_req,
+			      struct iov_iter *iter_resp)
+{
+	iov_iter_init(iter_req, WRITE, req->iov, req->out,
+		      iov_length(req->iov, req->out));
+	iov_iter_init(iter_resp, READ, &req->iov[req->out], req->in,
+		      iov_length(&req->iov[req->out], req->in));
+}
+
+/* Runs on an exec or pool thread, which holds the owner's mm. */
+static void vhost_9p_req_exec(struct vhost_9p_req *req)
+{
+	struct vhost_9p_virtqueue *nvq = req->nvq;
+	struct vhost_9p *n = container_of(nvq->vq.dev, struct vhost_9p, dev);
+	struct vhost_9p_req *flush, *next;
+	struct iov_iter iter_req, iter_resp;
+	u64 start = local_clock();
+
+	vhost_9p_req_iter(req, &iter_req, &iter_resp);
+	req->len = do_9p_request(req->server, &n->session, &iter_req,
+				 &iter_resp, &req->cancel, &nvq->pdus);
+	req->exec_ns = local_clock() - start;
+	atomic64_add(req->exec_ns, &n->exec_ns);
+
+	if (req->slotted)
+		vhost_9p_sched_done(n);
+
+	spin_lock(&n->req_lock);
+	hash_del(&req->hnode);
+	flush = req->flushes;
+	req->flushes = NULL;
+	spin_unlock(&n->req_lock);
+
+	/* Queue our reply before releasing the Tflush waiting for it. */
+	llist_add(&req->node, &nvq->done);
+	vhost_9p_queue_vq(nvq);
+
+	for (; flush; flush = next) {
+		next = flush->next_flush;
+		vhost_9p_queue_req(flush);
+	}
+}
+
+static struct vhost_9p_req *vhost_9p_new_req(struct vhost_9p_virtqueue *nvq,
+					     struct p9_server *s, int head,
+					     unsigned int out, unsigned int in,
+					     unsigned int log_num)
+{
+	struct vhost_9p *n = container_of(nvq->vq.dev, struct vhost_9p, dev);
+	struct vhost_9p_req *req;
+
+	req = kmalloc_node(sizeof(*req) + (out + in) * sizeof(struct iovec) +
+			   log_num * sizeof(struct vhost_log),
+			   GFP_KERNEL, READ_ONCE(n->node));
+	if (!req)
+		return NULL;
+
+	INIT_LIST_HEAD(&req->exec_node);
+	INIT_HLIST_NODE(&req->hnode);
+	INIT_LIST_HEAD(&req->sched_node);
+	req->cancel.cancelled = false;
+	req->bulk = false;
+	req->nvq = nvq;
+	req->server = s;
+	req->head = head;
+	req->len = 0;
+	req->cost = 0;
+	req->exec_ns = 0;
+	req->flushes = NULL;
+	req->next_flush = NULL;
+	req->out = out;
+	req->in = in;
+	memcpy(req->iov, nvq->vq.iov, (out + in) * sizeof(struct iovec));
+	req->log = (struct vhost_log *)&req->iov[out + in];
+	req->log_num = log_num;
+	memcpy(req->log, nvq->vq.log, log_num * sizeof(struct vhost_log));
+
+	return req;
+}
+
+/* Moving data in bulk, or syncing it, takes long enough that a request
+ * for metadata should not wait behind it.
+ */
+static bool vhost_9p_req_bulk(struct p9_io_header *hdr, size_t len)
+{
+	switch (hdr->id) {
+	case P9_TREAD:
+	case P9_TWRITE:
+	case P9_TREADDIR:
+		return len >= sizeof(*hdr) &&
+		       le32_to_cpu(hdr->count) >= VHOST_9P_BULK_BYTES;
+	case P9_TFSYNC:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Hand a request to the exec threads. Replies may complete in any
+ * order, except that a Tflush is held back until the request it flushes
+ * has replied.
+ */
+ */
+static void vhost_9p_submit(struct vhost_9p *n, struct vhost_9p_req *req)
+{
+	struct vhost_9p_req *old;
+	struct iov_iter iter, resp;
+	union {
+		struct p9_io_header io;
+		struct {
+			struct p9_header hdr;
+			uint16_t oldtag;
+		} __packed flush;
+	} msg;
+	size_t len;
+
+	atomic_inc(&n->inflight);
+	atomic_inc(&req->nvq->inflight);
+
+	vhost_9p_req_iter(req, &iter, &resp);
+	req->cost = min_t(size_t, iov_iter_count(&iter), U32_MAX);
+	len = copy_from_iter(&msg, sizeof(msg), &iter);
+	/* A request too short for a header is left to the server to fail. */
+	if (len >= sizeof(msg.flush.hdr)) {
+		req->tag = msg.flush.hdr.tag;
+		req->bulk = vhost_9p_req_bulk(&msg.io, len);
+	}
+	if (len >= sizeof(msg.io) &&
+	    (msg.io.id == P9_TREAD || msg.io.id == P9_TREADDIR))
+		req->cost = min_t(u64, (u64)req->cost +
+				  le32_to_cpu(msg.io.count), U32_MAX);
+	req->nvq->inflight_bytes += req->cost;
+
+	spin_lock(&n->req_lock);
+	if (len >= sizeof(msg.flush) && msg.flush.hdr.id == P9_TFLUSH) {
+		hash_for_each_possible(n->reqs, old, hnode, msg.flush.oldtag) {
+			if (old->tag != msg.flush.oldtag)
+				continue;
+			/* The reply to the flush waits for the old request,
+			 * which stops at its next safe point.
+			 */
+			WRITE_ONCE(old->cancel.cancelled, true);
+			req->next_flush = old->flushes;
+			old->flushes = req;
+			vhost_9p_sched_promote(n, old);
+			spin_unlock(&n->req_lock);
+			return;
+		}
+	} else if (len >= sizeof(msg.flush.hdr)) {
+		hash_add(n->reqs, &req->hnode, req->tag);
+	}
+	spin_unlock(&n->req_lock);
+
+	vhost_9p_queue_req(req);
+}
+
+static enum hrtimer_restart vhost_9p_signal_timeout(struct hrtimer *timer)
+{
+	struct vhost_9p_virtqueue *nvq = container_of(timer,
+				struct vhost_9p_virtqueue, signal_timer);
+
+	vhost_9p_queue_vq(nvq);
+	return HRTIMER_NORESTART;
+}
+
+static bool vhost_9p_should_signal(struct vhost_9p *n,
+				   struct vhost_9p_virtqueue *nvq, u64 now)
+{
+	u32 max_replies = READ_ONCE(n->coalesce.max_replies);
+	u32 usecs = READ_ONCE(n->coalesce.usecs);
+
+	if (!max_replies || !usecs)
+		return true;
+	if (nvq->unsignalled >= max_replies)
+		return true;
+	/* Nothing left in flight to share the interrupt with. */
+	if (!atomic_read(&nvq->inflight))
+		return true;
+	return now - nvq->first_unsignalled >= (u64)usecs * NSEC_PER_USEC;
+}
+
+/* Put the replies finished by the exec threads on the used ring in one
+ * batch and signal the guest as the moderation policy allows. Returns the
+ * time the exec threads spent on the replies published.
+ */
+static u64 vhost_9p_complete(struct vhost_9p *n,
+			     struct vhost_9p_virtqueue *nvq)
+{
+	struct vhost_virtqueue *vq = &nvq->vq;
+	struct llist_node *done = llist_del_all(&nvq->done);
+	struct vring_used_elem stack_heads[VHOST_9P_STACK_HEADS];
+	struct vring_used_elem *heads = vq->heads ?: stack_heads;
+	unsigned int max = vq->heads ? UIO_MAXIOV : ARRAY_SIZE(stack_heads);
+	struct vhost_9p_req *req, *tmp;
+	unsigned int count = 0, total = 0;
+	u64 exec_ns = 0, now;
+
+	if (done) {
+		done = llist_reverse_order(done);
+		llist_for_each_entry_safe(req, tmp, done, node) {
+			/* The used ring itself is logged by vhost. */
+			if (unlikely(req->log_num) && req->len)
+				vhost_log_write(vq, req->log, req->log_num,
+						req->len);
+			heads[count].id = cpu_to_vhost32(vq, req->head);
+			heads[count].len = cpu_to_vhost32(vq, req->len);
+			nvq->inflight_bytes -= req->cost;
+			exec_ns += req->exec_ns;
+			kfree(req);
+			if (++count == max) {
+				vhost_add_used_n(vq, heads, count);
+				total += count;
+				count = 0;
+			}
+		}
+		if (count)
+			vhost_add_used_n(vq, heads, count);
+		total += count;
+
+		atomic_sub(total, &nvq->inflight);
+		if (atomic_sub_and_test(total, &n->inflight))
+			wake_up(&n->inflight_wait);
+	}
+
+	if (!total && !nvq->unsignalled)
+		return 0;
+
+	now = ktime_get_ns();
+	if (total && !nvq->unsignalled)
+		nvq->first_unsignalled = now;
+	nvq->unsignalled += total;
+
+	if (vhost_9p_should_signal(n, nvq, now)) {
+		vhost_signal(&n->dev, vq);
+		nvq->unsignalled = 0;
+		hrtimer_try_to_cancel(&nvq->signal_timer);
+	} else if (!hrtimer_is_queued(&nvq->signal_timer)) {
+		u64 timeout = (u64)READ_ONCE(n->coalesce.usecs) * NSEC_PER_USEC;
+
+		hrtimer_start(&nvq->signal_timer,
+			ns_to_ktime(nvq->first_unsignalled + timeout - now),
+			HRTIMER_MODE_REL);
+	}
+
+	if (total) {
+		smp_mb__after_atomic();
+		vhost_9p_wake_stalled(n);
+	}
+
+	return exec_ns;
+}
+
+static inline unsigned long busy_clock(void)
+{
+	return local_clock() >> 10;
+}
+
+static bool vhost_9p_can_busy_poll(struct vhost_9p_virtqueue *nvq,
+				   unsigned long endtime)
+{
+	return likely(!need_resched()) &&
+	       likely(!time_after(busy_clock(), endtime)) &&
+	       likely(!signal_pending(current)) &&
+	       llist_empty(&nvq->done);
+}
+
+/* Spin on the avail ring for up to busyloop_timeout us before going back
+ * to notifications. Returns true if the guest added a request meanwhile.
+ * Polling stops early when replies are ready to be published.
+ */
+static bool vhost_9p_busy_poll(struct vhost_9p *n,
+			       struct vhost_9p_virtqueue *nvq)
+{
+	struct vhost_virtqueue *vq = &nvq->vq;
+	unsigned long endtime;
+	bool hit;
+
+	preempt_disable();
+	endtime = busy_clock() + vq->busyloop_timeout;
+	while (vhost_9p_can_busy_poll(nvq, endtime) &&
+	       vhost_vq_avail_empty(&n->dev, vq))
+		cpu_relax_lowlatency();
+	preempt_enable();
+
+	hit = !vhost_vq_avail_empty(&n->dev, vq);
+	if (hit)
+		nvq->poll_hits++;
+	else
+		nvq->poll_misses++;
+	return hit;
+}
+
+/* ns is the worker's time in the run plus that of the exec threads on
+ * the replies it published.
+ */
+static bool vhost_9p_budget_exceeded(struct vhost_9p *n, unsigned int reqs,
+				     u64 ns)
+{
+	u32 max;
+
+	max = READ_ONCE(n->budget.max_reqs);
+	if (max && reqs >= max)
+		return true;
+	max = READ_ONCE(n->budget.max_usecs);
+	return max && ns >= (u64)max * NSEC_PER_USEC;
+}
+
+/* Enough of the queue's work is in flight. Its completions requeue it. */
+static bool vhost_9p_bytes_full(struct vhost_9p *n,
+				struct vhost_9p_virtqueue *nvq)
+{
+	u32 max = READ_ONCE(n->budget.max_bytes);
+
+	return max && nvq->inflight_bytes >= max;
+}
+
+static void vhost_9p_bucket_refill(struct vhost_9p_bucket *b, u64 now)
+{
+	u32 rem;
+	u64 secs = div_u64_rem(now - b->stamp, NSEC_PER_SEC, &rem);
+
+	b->stamp = now;
+	if (secs > div64_u64(b->cap - b->tokens, b->rate)) {
+		b->tokens = b->cap;
+		return;
+	}
+	b->tokens += b->rate * secs + mul_u64_u32_div(b->rate, rem,
+						      NSEC_PER_SEC);
+	if (b->tokens > (s64)b->cap)
+		b->tokens = b->cap;
+}
+
+/* Charge the request at the head of the ring to the QoS buckets. Returns
+ * 0 if it may go, or the nanoseconds until the buckets allow it.
+ */
+static u64 vhost_9p_qos_charge(struct vhost_9p *n, struct vhost_virtqueue *vq,
+			       unsigned int out)
+{
+	u64 cost[VHOST_9P_QOS_MAX] = { 0 };
+	struct vhost_9p_bucket *b;
+	struct p9_io_header hdr;
+	struct iov_iter iter;
+	u64 now, wait = 0;
+	size_t len;
+	int i;
+
+	iov_iter_init(&iter, WRITE, vq->iov, out, iov_length(vq->iov, out));
+	len = copy_from_iter(&hdr, sizeof(hdr), &iter);
+	/* Malformed requests are left to the server to fail. */
+	if (len < sizeof(struct p9_header))
+		return 0;
+
+	switch (hdr.id) {
+	case P9_TFLUSH:
+		/* Flushing must not wait behind what it flushes. */
+		return 0;
+	case P9_TREAD:
+	case P9_TWRITE:
+		if (len < sizeof(hdr))
+			return 0;
+		cost[hdr.id == P9_TREAD ? VHOST_9P_QOS_READ :
+		     VHOST_9P_QOS_WRITE] = le32_to_cpu(hdr.count);
+		cost[VHOST_9P_QOS_DATA] = 1;
+		break;
+	default:
+		cost[VHOST_9P_QOS_META] = 1;
+	}
+
+	spin_lock(&n->qos_lock);
+	now = ktime_get_ns();
+	for (i = 0; i < VHOST_9P_QOS_MAX; i++) {
+		b = &n->qos[i];
+		if (!cost[i] || !b->rate)
+			continue;
+		vhost_9p_bucket_refill(b, now);
+		if (b->tokens < 0)
+			wait = max(wait, div64_u64((u64)-b->tokens * NSEC_PER_SEC,
+						   b->rate) + 1);
+	}
+	if (!wait) {
+		for (i = 0; i < VHOST_9P_QOS_MAX; i++)
+			if (n->qos[i].rate)
+				n->qos[i].tokens -= cost[i];
+	}
+	spin_unlock(&n->qos_lock);
+
+	return wait;
+}
+
+static enum hrtimer_restart vhost_9p_qos_timeout(struct hrtimer *timer)
+{
+	struct vhost_9p_virtqueue *nvq = container_of(timer,
+				struct vhost_9p_virtqueue, qos_timer);
+
+	vhost_9p_queue_vq(nvq);
+	return HRTIMER_NORESTART;
+}
+
+
+/*
+ * Low-footprint mode. vhost allocates indirect, log and heads arrays of
+ * UIO_MAXIOV entries for every queue. Only the indirect table is needed
+ * to take requests off the ring, log only while migrating, and used
+ * entries can be batched on the stack, so an idle queue keeps none.
+ */
+static void vhost_9p_trim_vq(struct vhost_virtqueue *vq)
+{
+	p9_pdu_pool_drain(&to_nvq(vq)->pdus);
+	kfree(vq->indirect);
+	vq->indirect = NULL;
+	kfree(vq->heads);
+	vq->heads = NULL;
+	if (!vhost_has_feature(vq, VHOST_F_LOG_ALL)) {
+		kfree(vq->log);
+		vq->log = NULL;
+	}
+}
+
+static int vhost_9p_untrim_vq(struct vhost_9p *n, struct vhost_virtqueue *vq)
+{
+	vq->indirect = kmalloc_node(UIO_MAXIOV * sizeof(*vq->indirect),
+				    GFP_KERNEL, READ_ONCE(n->node));
+	if (!vq->indirect)
+		return -ENOMEM;
+
+	queue_delayed_work(system_unbound_wq, &n->trim_work,
+			   msecs_to_jiffies(n->trim_msecs));
+	return 0;
+}
+
+static void vhost_9p_trim_work(struct work_struct *work)
+{
+	struct vhost_9p *n = container_of(to_delayed_work(work),
+					  struct vhost_9p, trim_work);
+	unsigned long idle = msecs_to_jiffies(n->trim_msecs);
+	struct vhost_9p_virtqueue *nvq;
+	struct vhost_virtqueue *vq;
+	bool busy = false;
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++) {
+		nvq = to_nvq(n->dev.vqs[i]);
+		vq = &nvq->vq;
+		if (!mutex_trylock(&vq->mutex)) {
+			busy = true;
+			continue;
+		}
+		if (vq->indirect) {
+			if (atomic_read(&nvq->inflight) ||
+			    time_before(jiffies, nvq->last_used + idle))
+				busy = true;
+			else
+				vhost_9p_trim_vq(vq);
+		}
+		mutex_unlock(&vq->mutex);
+	}
+
+	if (busy)
+		queue_delayed_work(system_unbound_wq, &n->trim_work, idle);
+}
+
+/* Expects to be always run from the queue's worker, which holds
+ * the owner's mm.
+ */
+static void handle_vq(struct vhost_9p *n, struct vhost_virtqueue *vq)
+{
+	struct vhost_9p_virtqueue *nvq = to_nvq(vq);
+	struct vhost_9p_req *req;
+	struct p9_server *s;
+	unsigned int out, in, log_num = 0, reqs = 0;
+	struct vhost_log *log;
 	int head;
-	size_t out_len, in_len, total_len = 0;
-	struct iov_iter req, resp;
+	u64 start = local_clock(), exec_ns;
 
 	mutex_lock(&vq->mutex);
+	exec_ns = vhost_9p_complete(n, nvq);
+
+	s = vq->private_data;
+	if (!s)
+		goto out;
+
+	if (unlikely(!vq->indirect) && vhost_9p_untrim_vq(n, vq)) {
+		vhost_9p_queue_vq(nvq);
+		goto out;
+	}
+	nvq->last_used = jiffies;
+
+	/* Only collect the log while migration has it switched on. */
+	log = unlikely(vhost_has_feature(vq, VHOST_F_LOG_ALL)) ?
+		vq->log : NULL;
+
 	vhost_disable_notify(&n->dev, vq);
 
 	for (;;) {
+		/* The device is waiting for what is in flight to finish. */
+		if (unlikely(READ_ONCE(n->draining)))
+			break;
+		/* Leave the rest on the ring until requests complete. */
+		if (unlikely(vhost_9p_inflight_full(n))) {
+			set_bit(nvq->index, &n->stalled);
+			smp_mb__after_atomic();
+			if (vhost_9p_inflight_full(n))
+				break;
+			clear_bit(nvq->index, &n->stalled);
+		}
+		if (unlikely(vhost_9p_bytes_full(n, nvq))) {
+			nvq->budget_yields++;
+			break;
+		}
+
 		head = vhost_get_vq_desc(vq, vq->iov,
 					 ARRAY_SIZE(vq->iov),
 					 &out, &in,
-					 NULL, NULL);
+					 log, log ? &log_num : NULL);
 
 		/* On error, stop handling until the next kick. */
 		if (unlikely(head < 0))
 			break;
 		/* Nothing new? Wait for eventfd to tell us they refilled. */
 		if (head == vq->num) {
+			/* Pool threads are shared, they must not spin. */
+			if (vq->busyloop_timeout && !nvq->pool &&
+			    vhost_9p_busy_poll(n, nvq))
+				continue;
+			if (!llist_empty(&nvq->done)) {
+				exec_ns += vhost_9p_complete(n, nvq);
+				continue;
+			}
 			if (unlikely(vhost_enable_notify(&n->dev, vq))) {
 				vhost_disable_notify(&n->dev, vq);
 				continue;
@@ -62,115 +858,855 @@ static void handle_vq(struct vhost_9p *n)
 			break;
 		}
 
-		out_len = iov_length(vq->iov, out);
-		in_len = iov_length(&vq->iov[out], in);
+		/* Over the limits, the request stays on the ring until the
+		 * buckets have refilled.
+		 */
+		if (unlikely(READ_ONCE(n->qos_on))) {
+			u64 wait = vhost_9p_qos_charge(n, vq, out);
 
-		iov_iter_init(&req, WRITE, vq->iov, out, out_len);
-		iov_iter_init(&resp, READ, &vq->iov[out], in, in_len);
+			if (wait) {
+				vhost_discard_vq_desc(vq, 1);
+				nvq->qos_delays++;
+				if (!hrtimer_is_queued(&nvq->qos_timer)) {
+					nvq->qos_delay_ns += wait;
+					hrtimer_start(&nvq->qos_timer,
+						      ns_to_ktime(wait),
+						      HRTIMER_MODE_REL);
+				}
+				break;
+			}
+		}
 
-		do_9p_request(n->server, &req, &resp);
+		req = vhost_9p_new_req(nvq, s, head, out, in, log_num);
+		if (unlikely(!req)) {
+			vhost_discard_vq_desc(vq, 1);
+			vhost_9p_queue_vq(nvq);
+			break;
+		}
+		reqs++;
 
-		vhost_add_used_and_signal(&n->dev, vq, head, in + out);
+		vhost_9p_submit(n, req);
 
-		total_len += out_len;
-		if (unlikely(total_len >= VHOST_9P_WEIGHT)) {
-			vhost_poll_queue(&vq->poll);
+		if (!llist_empty(&nvq->done))
+			exec_ns += vhost_9p_complete(n, nvq);
+
+		if (unlikely(vhost_9p_budget_exceeded(n, reqs,
+				local_clock() - start + exec_ns))) {
+			nvq->budget_yields++;
+			vhost_9p_queue_vq(nvq);
 			break;
 		}
 	}
 
+out:
 	mutex_unlock(&vq->mutex);
 }
 
+static void vhost_9p_vq_work(struct kthread_work *work)
+{
+	struct vhost_9p_virtqueue *nvq = container_of(work,
+					struct vhost_9p_virtqueue, work);
+	struct vhost_9p *n = container_of(nvq->vq.dev, struct vhost_9p, dev);
+
+	handle_vq(n, &nvq->vq);
+	if (need_resched())
+		schedule();
+}
+
+/* An idle exec thread leaves, unless it is the last of the device or
+ * the device is stopping them. Returns true if it may exit.
+ */
+static bool vhost_9p_exec_retire(struct vhost_9p *n)
+{
+	bool retire = false;
+	unsigned int i;
+
+	/* vhost_9p_stop_exec() holds it while waiting for us. */
+	if (!mutex_trylock(&n->exec_mutex))
+		return false;
+	for (i = 0; i < n->nr_exec && n->nr_exec > 1; i++) {
+		if (n->exec_threads[i] != current)
+			continue;
+		n->exec_threads[i] = n->exec_threads[--n->nr_exec];
+		retire = true;
+		break;
+	}
+	mutex_unlock(&n->exec_mutex);
+
+	/* A request may have been queued on the wakeup we timed out on. */
+	if (retire && READ_ONCE(n->exec_queued))
+		wake_up(&n->exec_wait);
+	return retire;
+}
+
+/*
+ * Executes requests of one device. The threads are in the owner's
+ * cgroups and mm, so the I/O and CPU time spent on the guest's behalf
+ * is charged to the owner.
+ */
+static int vhost_9p_exec_thread(void *data)
+{
+	struct vhost_9p *n = data;
+	struct vhost_9p_req *req;
+	long timeout;
+	DEFINE_WAIT(wait);
+
+	use_mm(n->mm);
+	while (!kthread_should_stop()) {
+		spin_lock(&n->exec_lock);
+		req = list_first_entry_or_null(&n->exec_queue,
+					       struct vhost_9p_req, exec_node);
+		if (req) {
+			list_del_init(&req->exec_node);
+			n->exec_queued--;
+			spin_unlock(&n->exec_lock);
+			vhost_9p_req_exec(req);
+			cond_resched();
+			continue;
+		}
+		n->exec_idle++;
+		spin_unlock(&n->exec_lock);
+
+		timeout = 1;
+		prepare_to_wait_exclusive(&n->exec_wait, &wait,
+					  TASK_INTERRUPTIBLE);
+		if (!READ_ONCE(n->exec_queued) && !kthread_should_stop())
+			timeout = schedule_timeout(
+				msecs_to_jiffies(VHOST_9P_EXEC_IDLE_MSECS));
+		finish_wait(&n->exec_wait, &wait);
+
+		spin_lock(&n->exec_lock);
+		n->exec_idle--;
+		spin_unlock(&n->exec_lock);
+
+		if (!timeout && vhost_9p_exec_retire(n))
+			break;
+	}
+	unuse_mm(n->mm);
+
+	return 0;
+}
+
+/* Runs on the vhost worker, so the thread joins the owner's cgroups. */
+static void vhost_9p_exec_spawn(struct vhost_work *work)
+{
+	struct vhost_9p *n = container_of(work, struct vhost_9p, exec_spawn);
+	struct task_struct *task;
+
+	mutex_lock(&n->exec_mutex);
+	/* Requests may have been picked up meanwhile. */
+	if (!n->exec_threads || n->nr_exec >= exec_threads ||
+	    READ_ONCE(n->exec_queued) <= READ_ONCE(n->exec_idle))
+		goto out;
+
+	task = kthread_create_on_node(vhost_9p_exec_thread, n, n->node,
+				      "vhost-9p-%d-x%u", n->owner_pid,
+				      n->nr_exec);
+	if (IS_ERR(task))
+		goto out;
+	if (cgroup_attach_task_all(current, task)) {
+		kthread_stop(task);
+		goto out;
+	}
+	set_cpus_allowed_ptr(task, &n->cpus);
+	n->exec_threads[n->nr_exec++] = task;
+	wake_up_process(task);
+out:
+	mutex_unlock(&n->exec_mutex);
+}
+
+/* Run the next ready queue. Called and returns with the pool lock held. */
+static void vhost_9p_pool_run(struct vhost_9p_pool *pool)
+{
+	struct vhost_9p_virtqueue *nvq;
+	struct vhost_9p *n;
+	u64 start;
+
+	n = list_first_entry(&pool->ready, struct vhost_9p, pool_node);
+	nvq = list_first_entry(&n->pool_ready,
+			       struct vhost_9p_virtqueue, pool_node);
+	list_del_init(&nvq->pool_node);
+	nvq->pool_state = VHOST_9P_POOL_RUNNING;
+	/* The device goes to the back of the line. */
+	list_del_init(&n->pool_node);
+	if (!list_empty(&n->pool_ready))
+		list_add_tail(&n->pool_node, &pool->ready);
+	spin_unlock_irq(&pool->lock);
+
+	start = local_clock();
+	use_mm(n->mm);
+	handle_vq(n, &nvq->vq);
+	unuse_mm(n->mm);
+	atomic64_add(local_clock() - start, &n->pool_ns);
+
+	spin_lock_irq(&pool->lock);
+	nvq->pool_state &= ~VHOST_9P_POOL_RUNNING;
+	if (nvq->pool_state & VHOST_9P_POOL_PENDING)
+		__vhost_9p_pool_add(pool, nvq);
+	else
+		wake_up(&pool->idle);
+}
+
+static int vhost_9p_pool_thread(void *data)
+{
+	struct vhost_9p_pool *pool = data;
+	/* Set before the threads are woken. */
+	bool runs_only = pool->nthreads > 1 && current == pool->threads[0];
+	struct vhost_9p_req *req;
+	struct vhost_9p *n;
+
+	while (!kthread_should_stop()) {
+		/* The first thread wakes for every request, the others
+		 * take turns.
+		 */
+		if (runs_only)
+			wait_event_interruptible(pool->wait,
+				!list_empty(&pool->ready) ||
+				kthread_should_stop());
+		else
+			wait_event_interruptible_exclusive(pool->wait,
+				!list_empty(&pool->ready) ||
+				!list_empty(&pool->exec) ||
+				kthread_should_stop());
+
+		spin_lock_irq(&pool->lock);
+		if (!list_empty(&pool->ready)) {
+			vhost_9p_pool_run(pool);
+			spin_unlock_irq(&pool->lock);
+			cond_resched();
+			continue;
+		}
+		req = runs_only ? NULL :
+		      list_first_entry_or_null(&pool->exec,
+					       struct vhost_9p_req, exec_node);
+		if (req)
+			list_del_init(&req->exec_node);
+		spin_unlock_irq(&pool->lock);
+
+		if (req) {
+			n = container_of(req->nvq->vq.dev, struct vhost_9p,
+					 dev);
+			use_mm(n->mm);
+			vhost_9p_req_exec(req);
+			unuse_mm(n->mm);
+		}
+		cond_resched();
+	}
+
+	return 0;
+}
+
+static struct vhost_9p_pool *vhost_9p_pool_get(int nid)
+{
+	struct vhost_9p_pool *pool;
+	struct task_struct *task;
+	unsigned int i;
+
+	mutex_lock(&vhost_9p_pools_mutex);
+	pool = vhost_9p_pools[nid];
+	if (pool)
+		goto out;
+
+	pool = kzalloc_node(sizeof(*pool) +
+			    pool_threads * sizeof(pool->threads[0]),
+			    GFP_KERNEL, nid);
+	if (!pool) {
+		pool = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+
+	pool->nid = nid;
+	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->ready);
+	INIT_LIST_HEAD(&pool->exec);
+	init_waitqueue_head(&pool->wait);
+	init_waitqueue_head(&pool->idle);
+
+	for (i = 0; i < pool_threads; i++) {
+		task = kthread_create_on_node(vhost_9p_pool_thread, pool, nid,
+					      "vhost-9p-pool/%d:%u", nid, i);
+		if (IS_ERR(task))
+			break;
+		set_cpus_allowed_ptr(task, cpumask_of_node(nid));
+		pool->threads[pool->nthreads++] = task;
+	}
+
+	if (!pool->nthreads) {
+		kfree(pool);
+		pool = ERR_PTR(-ENOMEM);
+		goto out;
+	}
+	for (i = 0; i < pool->nthreads; i++)
+		wake_up_process(pool->threads[i]);
+
+	vhost_9p_pools[nid] = pool;
+out:
+	mutex_unlock(&vhost_9p_pools_mutex);
+	return pool;
+}
+
+static void vhost_9p_pools_destroy(void)
+{
+	struct vhost_9p_pool *pool;
+	unsigned int i;
+	int nid;
+
+	for (nid = 0; nid < MAX_NUMNODES; nid++) {
+		pool = vhost_9p_pools[nid];
+		if (!pool)
+			continue;
+		for (i = 0; i < pool->nthreads; i++)
+			kthread_stop(pool->threads[i]);
+		kfree(pool);
+		vhost_9p_pools[nid] = NULL;
+	}
+}
+
+/* Wait for the queue to be idle and take it off the pool. */
+static void vhost_9p_pool_detach(struct vhost_9p_virtqueue *nvq)
+{
+	struct vhost_9p_pool *pool = nvq->pool;
+	struct vhost_9p *n = container_of(nvq->vq.dev, struct vhost_9p, dev);
+
+	wait_event(pool->idle, !READ_ONCE(nvq->pool_state));
+
+	spin_lock_irq(&pool->lock);
+	list_del_init(&nvq->pool_node);
+	if (list_empty(&n->pool_ready))
+		list_del_init(&n->pool_node);
+	nvq->pool = NULL;
+	spin_unlock_irq(&pool->lock);
+}
+
+static int vhost_9p_kick_wakeup(wait_queue_t *wait, unsigned int mode,
+				int sync, void *key)
+{
+	struct vhost_9p_virtqueue *nvq = container_of(wait,
+				struct vhost_9p_virtqueue, kick.wait);
+
+	if (!((unsigned long)key & POLLIN))
+		return 0;
+
+	vhost_9p_queue_vq(nvq);
+	return 0;
+}
+
+static void vhost_9p_kick_queue_proc(struct file *file,
+				     wait_queue_head_t *wqh, poll_table *pt)
+{
+	struct vhost_9p_kick *kick = container_of(pt, struct vhost_9p_kick,
+						  table);
+
+	kick->wqh = wqh;
+	add_wait_queue(wqh, &kick->wait);
+}
+
+static void vhost_9p_kick_init(struct vhost_9p_kick *kick)
+{
+	init_waitqueue_func_entry(&kick->wait, vhost_9p_kick_wakeup);
+	init_poll_funcptr(&kick->table, vhost_9p_kick_queue_proc);
+	kick->wqh = NULL;
+}
+
+static void vhost_9p_kick_stop(struct vhost_9p_virtqueue *nvq)
+{
+	if (nvq->kick.wqh) {
+		remove_wait_queue(nvq->kick.wqh, &nvq->kick.wait);
+		nvq->kick.wqh = NULL;
+	}
+}
+
+/* Pooled devices have no vhost worker to run vq->poll, so the kick
+ * eventfd is polled here and queues the virtqueue on the pool directly.
+ */
+static void vhost_9p_kick_start(struct vhost_9p_virtqueue *nvq)
+{
+	struct file *file = nvq->vq.kick;
+	unsigned long mask;
+
+	if (nvq->kick.wqh || !file)
+		return;
+
+	mask = file->f_op->poll(file, &nvq->kick.table);
+	if (mask & POLLIN)
+		vhost_9p_queue_vq(nvq);
+	if (mask & POLLERR)
+		vhost_9p_kick_stop(nvq);
+}
+
+/* Runs on the vhost device worker. Hand the kick over to the worker
+ * of the queue so that queues are served in parallel.
+ */
 static void handle_vq_kick(struct vhost_work *work)
 {
 	struct vhost_virtqueue *vq = container_of(work, struct vhost_virtqueue,
 						  poll.work);
-	struct vhost_9p *n = container_of(vq->dev, struct vhost_9p, dev);
 
-//	printk("VHOST_9P_HANDLE_KICK\n");
+	vhost_9p_queue_vq(to_nvq(vq));
+}
+
+struct vhost_9p_mm_work {
+	struct kthread_work work;
+	struct mm_struct *mm;
+};
+
+static void vhost_9p_mm_work_fn(struct kthread_work *work)
+{
+	struct vhost_9p_mm_work *w = container_of(work,
+					struct vhost_9p_mm_work, work);
+
+	if (w->mm)
+		use_mm(w->mm);
+	else
+		unuse_mm(current->mm);
+}
+
+/* Make the worker borrow @mm, or drop the borrowed mm if @mm is NULL. */
+static void vhost_9p_worker_set_mm(struct kthread_worker *worker,
+				   struct mm_struct *mm)
+{
+	struct vhost_9p_mm_work w;
+
+	kthread_init_work(&w.work, vhost_9p_mm_work_fn);
+	w.mm = mm;
+	kthread_queue_work(worker, &w.work);
+	kthread_flush_work(&w.work);
+}
+
+static void vhost_9p_stop_exec(struct vhost_9p *n)
+{
+	unsigned int i;
+
+	/* A thread retiring meanwhile cannot take the mutex, and waits to
+	 * be stopped instead.
+	 */
+	mutex_lock(&n->exec_mutex);
+	for (i = 0; i < n->nr_exec; i++)
+		kthread_stop(n->exec_threads[i]);
+	n->nr_exec = 0;
+	kfree(n->exec_threads);
+	n->exec_threads = NULL;
+	mutex_unlock(&n->exec_mutex);
+}
+
+/* Devices off the pool start with one exec thread, see exec_spawn. */
+static int vhost_9p_start_exec(struct vhost_9p *n)
+{
+	unsigned int nr = max(exec_threads, 1U);
+	struct task_struct *task;
+	int err;
+
+	n->exec_threads = kcalloc(nr, sizeof(*n->exec_threads), GFP_KERNEL);
+	if (!n->exec_threads)
+		return -ENOMEM;
+	n->owner_pid = current->pid;
+
+	task = kthread_create_on_node(vhost_9p_exec_thread, n, n->node,
+				      "vhost-9p-%d-x0", current->pid);
+	if (IS_ERR(task))
+		return PTR_ERR(task);
+
+	err = cgroup_attach_task_all(current, task);
+	if (err) {
+		kthread_stop(task);
+		return err;
+	}
+	n->exec_threads[n->nr_exec++] = task;
+	wake_up_process(task);
+	return 0;
+}
+
+static void vhost_9p_stop_workers(struct vhost_9p *n)
+{
+	struct vhost_9p_virtqueue *nvq;
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++) {
+		nvq = to_nvq(n->dev.vqs[i]);
+		if (nvq->pool) {
+			hrtimer_cancel(&nvq->signal_timer);
+			hrtimer_cancel(&nvq->qos_timer);
+			vhost_9p_pool_detach(nvq);
+			continue;
+		}
+		if (!nvq->worker)
+			continue;
+		kthread_flush_work(&nvq->work);
+		hrtimer_cancel(&nvq->signal_timer);
+		hrtimer_cancel(&nvq->qos_timer);
+		kthread_flush_work(&nvq->work);
+		vhost_9p_worker_set_mm(nvq->worker, NULL);
+		kthread_destroy_worker(nvq->worker);
+		nvq->worker = NULL;
+	}
+	vhost_9p_stop_exec(n);
+
+	if (n->mm) {
+		mmput(n->mm);
+		n->mm = NULL;
+	}
+}
+
+/* Pooled devices leave their queues to the threads of the pool. Kicks
+ * are polled directly, so the vhost worker is not needed either.
+ */
+static int vhost_9p_join_pool(struct vhost_9p *n)
+{
+	struct vhost_9p_pool *pool;
+	int i;
+
+	pool = vhost_9p_pool_get(n->pool_nid);
+	if (IS_ERR(pool))
+		return PTR_ERR(pool);
+
+	for (i = 0; i < n->dev.nvqs; i++)
+		to_nvq(n->dev.vqs[i])->pool = pool;
+
+	kthread_stop(n->dev.worker);
+	n->dev.worker = NULL;
+	return 0;
+}
+
+static int vhost_9p_apply_affinity(struct vhost_9p *n)
+{
+	struct vhost_9p_virtqueue *nvq;
+	int i, err = 0;
+
+	if (n->dev.worker)
+		err = set_cpus_allowed_ptr(n->dev.worker, &n->cpus);
+	for (i = 0; i < n->dev.nvqs && !err; i++) {
+		nvq = to_nvq(n->dev.vqs[i]);
+		if (nvq->worker)
+			err = set_cpus_allowed_ptr(nvq->worker->task, &n->cpus);
+	}
+	mutex_lock(&n->exec_mutex);
+	for (i = 0; i < n->nr_exec && !err; i++)
+		err = set_cpus_allowed_ptr(n->exec_threads[i], &n->cpus);
+	mutex_unlock(&n->exec_mutex);
+	if (n->server)
+		WRITE_ONCE(n->server->node, n->node);
+
+	return err;
+}
+
+/* One worker per request queue and an exec thread, in the owner's
+ * cgroups and mm.
+ */
+static int vhost_9p_start_workers(struct vhost_9p *n)
+{
+	struct vhost_9p_virtqueue *nvq;
+	struct kthread_worker *worker;
+	int i, err;
+
+	n->mm = get_task_mm(current);
+	if (!n->mm)
+		return -EINVAL;
+
+	if (n->use_pool) {
+		err = vhost_9p_join_pool(n);
+		if (err)
+			goto err;
+		return 0;
+	}
+
+	err = vhost_9p_start_exec(n);
+	if (err)
+		goto err;
+
+	for (i = 0; i < n->dev.nvqs; i++) {
+		nvq = to_nvq(n->dev.vqs[i]);
+		worker = kthread_create_worker(0, "vhost-9p-%d.%d",
+					       current->pid, i);
+		if (IS_ERR(worker)) {
+			err = PTR_ERR(worker);
+			goto err;
+		}
+
+		err = cgroup_attach_task_all(current, worker->task);
+		if (err) {
+			kthread_destroy_worker(worker);
+			goto err;
+		}
+
+		vhost_9p_worker_set_mm(worker, n->mm);
+		nvq->worker = worker;
+	}
+
+	err = vhost_9p_apply_affinity(n);
+	if (err)
+		goto err;
+	return 0;
+err:
+	vhost_9p_stop_workers(n);
+	return err;
+}
+
+static void vhost_9p_free_vqs(struct vhost_9p *n)
+{
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++) {
+		p9_pdu_pool_drain(&to_nvq(n->dev.vqs[i])->pdus);
+		kfree(to_nvq(n->dev.vqs[i]));
+	}
+	kfree(n->dev.vqs);
+	n->dev.vqs = NULL;
+	n->dev.nvqs = 0;
+}
+
+static int vhost_9p_init_vqs(struct vhost_9p *n, int nvqs)
+{
+	struct vhost_virtqueue **vqs;
+	struct vhost_9p_virtqueue *nvq;
+	int i;
+
+	vqs = kcalloc(nvqs, sizeof(*vqs), GFP_KERNEL);
+	if (!vqs)
+		return -ENOMEM;
+
+	for (i = 0; i < nvqs; i++) {
+		nvq = kzalloc(sizeof(*nvq), GFP_KERNEL);
+		if (!nvq)
+			goto err;
+		/* Pooled devices poll their kicks themselves. */
+		if (!n->use_pool)
+			nvq->vq.handle_kick = handle_vq_kick;
+		nvq->index = i;
+		INIT_LIST_HEAD(&nvq->pool_node);
+		vhost_9p_kick_init(&nvq->kick);
+		kthread_init_work(&nvq->work, vhost_9p_vq_work);
+		init_llist_head(&nvq->done);
+		atomic_set(&nvq->inflight, 0);
+		nvq->inflight_bytes = 0;
+		hrtimer_init(&nvq->signal_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		nvq->signal_timer.function = vhost_9p_signal_timeout;
+		hrtimer_init(&nvq->qos_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_REL);
+		nvq->qos_timer.function = vhost_9p_qos_timeout;
+		p9_pdu_pool_init(&nvq->pdus);
+		vqs[i] = &nvq->vq;
+	}
 
-	handle_vq(n);
+	vhost_9p_free_vqs(n);
+	vhost_dev_init(&n->dev, vqs, nvqs);
+	return 0;
+err:
+	while (i--)
+		kfree(to_nvq(vqs[i]));
+	kfree(vqs);
+	return -ENOMEM;
 }
 
 // TODO: execution flow review
 static int vhost_9p_open(struct inode *inode, struct file *f)
 {
-	struct vhost_dev *dev;
-	struct vhost_virtqueue **vqs;
-	struct vhost_9p *n = kmalloc(sizeof(*n), GFP_KERNEL);
+	struct vhost_9p *n = kzalloc(sizeof(*n), GFP_KERNEL);
+	int err;
 
 	pr_info("VHOST_9P_OPEN\n");
 
 	if (!n)
 		return -ENOMEM;
 
-	vqs = kmalloc_array(VHOST_9P_VQ_MAX, sizeof(*vqs), GFP_KERNEL);
-	if (!vqs) {
+	err = vhost_9p_init_vqs(n, 1);
+	if (err) {
 		kfree(n);
-		return -ENOMEM;
+		return err;
 	}
 
-	dev = &n->dev;
-
-	vqs[VHOST_9P_VQ] = &n->vqs[VHOST_9P_VQ];
-	n->vqs[VHOST_9P_VQ].handle_kick = handle_vq_kick;
-	vhost_dev_init(dev, vqs, VHOST_9P_VQ_MAX);
+	spin_lock_init(&n->req_lock);
+	hash_init(n->reqs);
+	atomic_set(&n->inflight, 0);
+	n->max_inflight = VHOST_9P_DEF_INFLIGHT;
+	n->budget.max_reqs = VHOST_9P_BUDGET_REQS;
+	n->budget.max_bytes = VHOST_9P_BUDGET_BYTES;
+	n->budget.max_usecs = VHOST_9P_BUDGET_USECS;
+	init_waitqueue_head(&n->inflight_wait);
+	spin_lock_init(&n->qos_lock);
+	spin_lock_init(&n->sched_lock);
+	n->sched.window = VHOST_9P_DEF_WINDOW;
+	INIT_LIST_HEAD(&n->sched_cheap);
+	INIT_LIST_HEAD(&n->sched_bulk);
+	spin_lock_init(&n->exec_lock);
+	INIT_LIST_HEAD(&n->exec_queue);
+	init_waitqueue_head(&n->exec_wait);
+	vhost_work_init(&n->exec_spawn, vhost_9p_exec_spawn);
+	mutex_init(&n->exec_mutex);
+	INIT_DELAYED_WORK(&n->trim_work, vhost_9p_trim_work);
+	spin_lock_init(&n->socks.lock);
+	INIT_LIST_HEAD(&n->socks.conns);
+	n->node = NUMA_NO_NODE;
+	cpumask_copy(&n->cpus, cpu_possible_mask);
+	n->msize = P9_DEF_MSIZE;
+	n->pool_nid = NUMA_NO_NODE;
+	INIT_LIST_HEAD(&n->pool_node);
+	INIT_LIST_HEAD(&n->pool_ready);
+	atomic64_set(&n->pool_ns, 0);
+	atomic64_set(&n->exec_ns, 0);
 
 	f->private_data = n;
 
 	return 0;
 }
 
-static void *vhost_9p_stop_vq(struct vhost_9p *n,
+static void vhost_9p_stop_vq(struct vhost_9p *n,
 				struct vhost_virtqueue *vq)
 {
-	void *private;
-
 	mutex_lock(&vq->mutex);
-	private = vq->private_data;
 	vq->private_data = NULL;
 	mutex_unlock(&vq->mutex);
-	return private;
 }
 
-static void vhost_9p_stop(struct vhost_9p *n, void **privatep)
+static void vhost_9p_stop(struct vhost_9p *n)
+{
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++) {
+		vhost_9p_stop_vq(n, n->dev.vqs[i]);
+		/* Before vhost drops the kick eventfd. */
+		vhost_9p_kick_stop(to_nvq(n->dev.vqs[i]));
+	}
+	/* Before vhost frees the scratch arrays. */
+	cancel_delayed_work_sync(&n->trim_work);
+}
+
+/* Attach the server as the backend of every queue. */
+static void vhost_9p_start(struct vhost_9p *n)
 {
-	*privatep = vhost_9p_stop_vq(n, n->vqs + VHOST_9P_VQ);
+	struct vhost_virtqueue *vq;
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++) {
+		vq = n->dev.vqs[i];
+		mutex_lock(&vq->mutex);
+		vq->private_data = n->server;
+		/* Pick up requests queued before the backend was set. */
+		if (vq->kick)
+			vhost_9p_queue_vq(to_nvq(vq));
+		mutex_unlock(&vq->mutex);
+	}
 }
 
 static void vhost_9p_flush_vq(struct vhost_9p *n, int index)
 {
-	vhost_poll_flush(&n->vqs[index].poll);
+	struct vhost_9p_virtqueue *nvq = to_nvq(n->dev.vqs[index]);
+
+	vhost_poll_flush(&nvq->vq.poll);
+	if (nvq->worker)
+		kthread_flush_work(&nvq->work);
+	else if (nvq->pool)
+		wait_event(nvq->pool->idle, !READ_ONCE(nvq->pool_state));
 }
 
 static void vhost_9p_flush(struct vhost_9p *n)
 {
-	vhost_9p_flush_vq(n, VHOST_9P_VQ);
+	int i;
+
+	for (i = 0; i < n->dev.nvqs; i++)
+		vhost_9p_flush_vq(n, i);
+	vhost_work_flush(&n->dev, &n->exec_spawn);
+}
+
+static void vhost_9p_cancel_all(struct vhost_9p *n)
+{
+	struct vhost_9p_req *req;
+	int bkt;
+
+	spin_lock(&n->req_lock);
+	hash_for_each(n->reqs, bkt, req, hnode) {
+		WRITE_ONCE(req->cancel.cancelled, true);
+		vhost_9p_sched_promote(n, req);
+	}
+	spin_unlock(&n->req_lock);
+}
+
+/* Let the queues take requests again and pick up what was left. */
+static void vhost_9p_resume(struct vhost_9p *n)
+{
+	int i;
+
+	WRITE_ONCE(n->draining, false);
+	for (i = 0; i < n->dev.nvqs; i++)
+		vhost_9p_queue_vq(to_nvq(n->dev.vqs[i]));
+}
+
+/*
+ * Wait for the replies of the requests in flight to be on the used
+ * ring. The queues take no new ones until vhost_9p_resume(). With cancel
+ * the requests are stopped first and the wait cannot be interrupted,
+ * otherwise a signal resumes the device and returns -EINTR.
+ */
+static int vhost_9p_drain(struct vhost_9p *n, bool cancel)
+{
+	int err = 0;
+
+	WRITE_ONCE(n->draining, true);
+	/* A run that missed the flag may still be taking a request. */
+	vhost_9p_flush(n);
+	if (cancel) {
+		vhost_9p_cancel_all(n);
+		wait_event(n->inflight_wait, !atomic_read(&n->inflight));
+	} else {
+		err = wait_event_interruptible(n->inflight_wait,
+					       !atomic_read(&n->inflight));
+	}
+	if (err) {
+		vhost_9p_resume(n);
+		return -EINTR;
+	}
+	return 0;
 }
 
 static int vhost_9p_release(struct inode *inode, struct file *f)
 {
 	struct vhost_9p *n = f->private_data;
-	void *private;
 
 	pr_info("VHOST_9P_RELEASE\n");
 
-	vhost_9p_stop(n, &private);
+	vhost_9p_stop(n);
+	vhost_9p_drain(n, true);
 	vhost_9p_flush(n);
 	vhost_dev_cleanup(&n->dev, false);
 	/* We do an extra flush before freeing memory,
 	 * since jobs can re-queue themselves.
 	 */
 	vhost_9p_flush(n);
+	vhost_9p_stop_workers(n);
+	vhost_9p_free_vqs(n);
+	p9_sock_detach_all(&n->socks);
+	p9_server_close(n->server);
 
 	kfree(n);
 	return 0;
 }
 
+static long vhost_9p_set_owner(struct vhost_9p *n)
+{
+	long err;
+	int i;
+
+	mutex_lock(&n->dev.mutex);
+	err = vhost_dev_set_owner(&n->dev);
+	if (err)
+		goto done;
+	err = vhost_9p_start_workers(n);
+	if (err) {
+		vhost_dev_cleanup(&n->dev, true);
+		goto done;
+	}
+	if (n->trim_msecs)
+		for (i = 0; i < n->dev.nvqs; i++)
+			vhost_9p_trim_vq(n->dev.vqs[i]);
+	if (n->server)
+		vhost_9p_start(n);
+done:
+	mutex_unlock(&n->dev.mutex);
+	return err;
+}
+
 static long vhost_9p_reset_owner(struct vhost_9p *n)
 {
-	void *priv = NULL;
 	long err;
 	struct vhost_umem *umem;
 
@@ -183,17 +1719,446 @@ static long vhost_9p_reset_owner(struct vhost_9p *n)
 		err = -ENOMEM;
 		goto done;
 	}
-	vhost_9p_stop(n, &priv);
+	vhost_9p_stop(n);
+	vhost_9p_drain(n, true);
 	vhost_9p_flush(n);
 	vhost_dev_reset_owner(&n->dev, umem);
+	vhost_9p_stop_workers(n);
+	vhost_9p_resume(n);
+	/* The next owner's guest starts over with Tversion. */
+	n->session.msize = 0;
+done:
+	mutex_unlock(&n->dev.mutex);
+	return err;
+}
+
+static long vhost_9p_set_num_queues(struct vhost_9p *n, int __user *argp)
+{
+	int nvqs;
+
+	if (get_user(nvqs, argp))
+		return -EFAULT;
+	if (nvqs < 1 || nvqs > VHOST_9P_VQ_MAX)
+		return -EINVAL;
+	/* vhost_dev_init re-initializes the device mutex, so this must
+	 * happen before the device is set up.
+	 */
+	if (vhost_dev_has_owner(&n->dev))
+		return -EBUSY;
+
+	return vhost_9p_init_vqs(n, nvqs);
+}
+
+static long vhost_9p_set_max_inflight(struct vhost_9p *n, int __user *argp)
+{
+	int max;
+
+	if (get_user(max, argp))
+		return -EFAULT;
+	if (max < 1 || max > VHOST_9P_MAX_INFLIGHT)
+		return -EINVAL;
+
+	WRITE_ONCE(n->max_inflight, max);
+	vhost_9p_wake_stalled(n);
+	return 0;
+}
+
+static long vhost_9p_set_coalesce(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_9p_coalesce c;
+
+	if (copy_from_user(&c, argp, sizeof(c)))
+		return -EFAULT;
+	if (c.usecs > USEC_PER_SEC)
+		return -EINVAL;
+
+	WRITE_ONCE(n->coalesce.max_replies, c.max_replies);
+	WRITE_ONCE(n->coalesce.usecs, c.usecs);
+	return 0;
+}
+
+static long vhost_9p_attach_socket(struct vhost_9p *n, int __user *argp)
+{
+	long err;
+	int fd;
+
+	if (get_user(fd, argp))
+		return -EFAULT;
+
+	mutex_lock(&n->dev.mutex);
+	if (n->server)
+		err = p9_sock_attach(n->server, fd, &n->socks);
+	else
+		err = -ENOENT;
+	mutex_unlock(&n->dev.mutex);
+	return err;
+}
+
+static long vhost_9p_set_idle_trim(struct vhost_9p *n, int __user *argp)
+{
+	long err = 0;
+	int msecs;
+
+	if (get_user(msecs, argp))
+		return -EFAULT;
+	if (msecs < 0)
+		return -EINVAL;
+
+	mutex_lock(&n->dev.mutex);
+	if (vhost_dev_has_owner(&n->dev))
+		err = -EBUSY;
+	else
+		n->trim_msecs = msecs;
+	mutex_unlock(&n->dev.mutex);
+	return err;
+}
+
+static long vhost_9p_set_pool(struct vhost_9p *n, int __user *argp)
+{
+	long err = 0;
+	int nid, i;
+
+	if (get_user(nid, argp))
+		return -EFAULT;
+	if (nid == -1)
+		nid = numa_node_id();
+	if (nid < 0 || nid >= MAX_NUMNODES || !node_online(nid))
+		return -EINVAL;
+	if (!pool_threads)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&n->dev.mutex);
+	if (vhost_dev_has_owner(&n->dev)) {
+		err = -EBUSY;
+		goto done;
+	}
+	n->use_pool = true;
+	n->pool_nid = nid;
+	for (i = 0; i < n->dev.nvqs; i++)
+		n->dev.vqs[i]->handle_kick = NULL;
+done:
+	mutex_unlock(&n->dev.mutex);
+	return err;
+}
+
+static long vhost_9p_set_affinity(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_9p_affinity a;
+	cpumask_var_t cpus;
+	long err;
+	int cpu;
+
+	if (copy_from_user(&a, argp, sizeof(a)))
+		return -EFAULT;
+	if (a.node != NUMA_NO_NODE &&
+	    (a.node < 0 || a.node >= MAX_NUMNODES || !node_online(a.node)))
+		return -EINVAL;
+	if (!zalloc_cpumask_var(&cpus, GFP_KERNEL))
+		return -ENOMEM;
+
+	for (cpu = 0; cpu < min(nr_cpu_ids, VHOST_9P_AFFINITY_CPUS); cpu++)
+		if (a.cpus[cpu / 64] & (1ULL << (cpu % 64)))
+			cpumask_set_cpu(cpu, cpus);
+
+	if (cpumask_empty(cpus)) {
+		if (a.node == NUMA_NO_NODE)
+			cpumask_copy(cpus, cpu_possible_mask);
+		else
+			cpumask_copy(cpus, cpumask_of_node(a.node));
+	} else if (a.node == NUMA_NO_NODE) {
+		a.node = cpu_to_node(cpumask_first(cpus));
+	}
+	if (!cpumask_intersects(cpus, cpu_online_mask)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	mutex_lock(&n->dev.mutex);
+	/* Pooled devices run on the threads of the pool's node. */
+	if (n->use_pool) {
+		err = -EBUSY;
+		goto done;
+	}
+	n->node = a.node;
+	cpumask_copy(&n->cpus, cpus);
+	err = vhost_9p_apply_affinity(n);
 done:
 	mutex_unlock(&n->dev.mutex);
+out:
+	free_cpumask_var(cpus);
+	return err;
+}
+
+static long vhost_9p_get_fids(struct vhost_9p *n,
+			      struct vhost_9p_fids __user *argp)
+{
+	struct vhost_9p_fids f;
+	long len;
+
+	if (copy_from_user(&f, argp, sizeof(f)))
+		return -EFAULT;
+
+	mutex_lock(&n->dev.mutex);
+	if (n->server)
+		len = p9_server_save(n->server, u64_to_user_ptr(f.addr),
+				     f.size);
+	else
+		len = -ENOENT;
+	mutex_unlock(&n->dev.mutex);
+
+	if (len < 0)
+		return len;
+	if (put_user(len, &argp->size))
+		return -EFAULT;
+	return len > f.size ? -E2BIG : 0;
+}
+
+static long vhost_9p_set_fids(struct vhost_9p *n,
+			      struct vhost_9p_fids __user *argp)
+{
+	struct vhost_9p_fids f;
+	long err;
+
+	if (copy_from_user(&f, argp, sizeof(f)))
+		return -EFAULT;
+
+	mutex_lock(&n->dev.mutex);
+	if (n->server)
+		err = p9_server_restore(n->server, u64_to_user_ptr(f.addr),
+					f.size);
+	else
+		err = -ENOENT;
+	mutex_unlock(&n->dev.mutex);
+
 	return err;
 }
 
+static long vhost_9p_set_vring_kick(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_vring_file f;
+	struct vhost_9p_virtqueue *nvq;
+	long r;
+
+	r = vhost_dev_check_owner(&n->dev);
+	if (r)
+		return r;
+	if (copy_from_user(&f, argp, sizeof(f)))
+		return -EFAULT;
+	if (f.index >= n->dev.nvqs)
+		return -ENOBUFS;
+
+	nvq = to_nvq(n->dev.vqs[f.index]);
+	/* Stop polling the old eventfd before vhost drops it. */
+	vhost_9p_kick_stop(nvq);
+	r = vhost_vring_ioctl(&n->dev, VHOST_SET_VRING_KICK, argp);
+	vhost_9p_kick_start(nvq);
+	return r;
+}
+
+static long vhost_9p_set_budget(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_9p_budget b;
+
+	if (copy_from_user(&b, argp, sizeof(b)))
+		return -EFAULT;
+	/* A limit on runs, or a busy queue never lets go. */
+	if (!b.max_reqs && !b.max_usecs)
+		return -EINVAL;
+
+	WRITE_ONCE(n->budget.max_reqs, b.max_reqs);
+	WRITE_ONCE(n->budget.max_bytes, b.max_bytes);
+	WRITE_ONCE(n->budget.max_usecs, b.max_usecs);
+	return 0;
+}
+
+static long vhost_9p_set_qos(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_9p_qos q;
+	u64 rates[VHOST_9P_QOS_MAX];
+	u32 burst;
+	u64 now;
+	bool on = false;
+	int i;
+
+	if (copy_from_user(&q, argp, sizeof(q)))
+		return -EFAULT;
+	burst = q.burst_msecs ?: VHOST_9P_QOS_DEF_BURST_MSECS;
+	if (burst > VHOST_9P_QOS_MAX_BURST_MSECS || q.reserved)
+		return -EINVAL;
+
+	rates[VHOST_9P_QOS_READ] = q.read_bps;
+	rates[VHOST_9P_QOS_WRITE] = q.write_bps;
+	rates[VHOST_9P_QOS_DATA] = q.data_iops;
+	rates[VHOST_9P_QOS_META] = q.meta_iops;
+	for (i = 0; i < VHOST_9P_QOS_MAX; i++)
+		if (rates[i] > VHOST_9P_QOS_MAX_RATE)
+			return -EINVAL;
+
+	spin_lock(&n->qos_lock);
+	now = ktime_get_ns();
+	for (i = 0; i < VHOST_9P_QOS_MAX; i++) {
+		struct vhost_9p_bucket *b = &n->qos[i];
+
+		b->rate = rates[i];
+		b->cap = max_t(u64, div_u64(rates[i] * burst, MSEC_PER_SEC), 1);
+		b->tokens = b->cap;
+		b->stamp = now;
+		on |= !!rates[i];
+	}
+	WRITE_ONCE(n->qos_on, on);
+	spin_unlock(&n->qos_lock);
+
+	/* Queues held back under the old limits retry under the new. */
+	mutex_lock(&n->dev.mutex);
+	for (i = 0; i < n->dev.nvqs; i++) {
+		struct vhost_9p_virtqueue *nvq = to_nvq(n->dev.vqs[i]);
+
+		if (hrtimer_try_to_cancel(&nvq->qos_timer) == 1)
+			vhost_9p_queue_vq(nvq);
+	}
+	mutex_unlock(&n->dev.mutex);
+	return 0;
+}
+
+static long vhost_9p_set_sched(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_9p_sched sc;
+
+	if (copy_from_user(&sc, argp, sizeof(sc)))
+		return -EFAULT;
+	if (sc.slots > VHOST_9P_MAX_INFLIGHT)
+		return -EINVAL;
+
+	spin_lock(&n->sched_lock);
+	/* Waiting requests need slots to get out. */
+	if (!sc.slots && n->sched.slots &&
+	    (!list_empty(&n->sched_cheap) || !list_empty(&n->sched_bulk))) {
+		spin_unlock(&n->sched_lock);
+		return -EBUSY;
+	}
+	n->sched = sc;
+	vhost_9p_sched_run(n);
+	spin_unlock(&n->sched_lock);
+	return 0;
+}
+
+static long vhost_9p_set_ioprio(struct vhost_9p *n, int __user *argp)
+{
+	int prio;
+
+	if (get_user(prio, argp))
+		return -EFAULT;
+
+	switch (IOPRIO_PRIO_CLASS(prio)) {
+	case IOPRIO_CLASS_NONE:
+		if (prio)
+			return -EINVAL;
+		break;
+	case IOPRIO_CLASS_RT:
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		/* fall through */
+	case IOPRIO_CLASS_BE:
+		if (IOPRIO_PRIO_DATA(prio) >= IOPRIO_BE_NR)
+			return -EINVAL;
+		break;
+	case IOPRIO_CLASS_IDLE:
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	mutex_lock(&n->dev.mutex);
+	n->ioprio = prio;
+	if (n->server)
+		p9_server_set_ioprio(n->server, prio);
+	mutex_unlock(&n->dev.mutex);
+	return 0;
+}
+
+/* Sockets size their buffers when attached, so the limit is set first. */
+static long vhost_9p_set_msize(struct vhost_9p *n, int __user *argp)
+{
+	int msize;
+	long r = 0;
+
+	if (get_user(msize, argp))
+		return -EFAULT;
+	if (msize < P9_MIN_MSIZE || msize > P9_MAX_MSIZE)
+		return -EINVAL;
+
+	mutex_lock(&n->dev.mutex);
+	if (n->server)
+		r = -EBUSY;
+	else
+		n->msize = msize;
+	mutex_unlock(&n->dev.mutex);
+	return r;
+}
+
+static size_t vhost_9p_vq_mem(struct vhost_virtqueue *vq)
+{
+	struct vhost_9p_virtqueue *nvq = to_nvq(vq);
+	size_t bytes = sizeof(struct vhost_9p_virtqueue);
+
+	/* The queue's own worker, off the pool. */
+	if (nvq->worker)
+		bytes += sizeof(*nvq->worker) + THREAD_SIZE;
+	bytes += p9_pdu_pool_mem(&nvq->pdus);
+
+	mutex_lock(&vq->mutex);
+	if (vq->indirect)
+		bytes += UIO_MAXIOV * sizeof(*vq->indirect);
+	if (vq->log)
+		bytes += UIO_MAXIOV * sizeof(*vq->log);
+	if (vq->heads)
+		bytes += UIO_MAXIOV * sizeof(*vq->heads);
+	mutex_unlock(&vq->mutex);
+
+	return bytes;
+}
+
+static long vhost_9p_get_stats(struct vhost_9p *n, void __user *argp)
+{
+	struct vhost_9p_stats st;
+	struct vhost_9p_virtqueue *nvq;
+	int i;
+
+	memset(&st, 0, sizeof(st));
+	st.mem_bytes = sizeof(*n) + n->dev.nvqs * sizeof(n->dev.vqs[0]);
+	mutex_lock(&n->dev.mutex);
+	for (i = 0; i < n->dev.nvqs; i++) {
+		nvq = to_nvq(n->dev.vqs[i]);
+		st.mem_bytes += vhost_9p_vq_mem(&nvq->vq);
+		st.poll_hits += READ_ONCE(nvq->poll_hits);
+		st.poll_misses += READ_ONCE(nvq->poll_misses);
+		st.budget_yields += READ_ONCE(nvq->budget_yields);
+		st.qos_delays += READ_ONCE(nvq->qos_delays);
+		st.qos_delay_ns += READ_ONCE(nvq->qos_delay_ns);
+	}
+	if (n->dev.worker)
+		st.mem_bytes += THREAD_SIZE;
+	mutex_lock(&n->exec_mutex);
+	if (n->exec_threads)
+		st.mem_bytes += max(exec_threads, 1U) *
+			sizeof(*n->exec_threads) + n->nr_exec * THREAD_SIZE;
+	mutex_unlock(&n->exec_mutex);
+	if (n->server)
+		st.mem_bytes += p9_server_mem(n->server);
+	st.mem_bytes += p9_sock_mem(&n->socks);
+	st.pool_ns = atomic64_read(&n->pool_ns);
+	st.exec_ns = atomic64_read(&n->exec_ns);
+	st.sched_overtakes = READ_ONCE(n->sched_overtakes);
+	mutex_unlock(&n->dev.mutex);
+
+	return copy_to_user(argp, &st, sizeof(st)) ? -EFAULT : 0;
+}
+
 static int vhost_9p_set_features(struct vhost_9p *n, u64 features)
 {
 	struct vhost_virtqueue *vq;
+	bool log_on;
+	int i, err = 0;
 
 	mutex_lock(&n->dev.mutex);
 	if ((features & (1 << VHOST_F_LOG_ALL)) &&
@@ -201,12 +2166,38 @@ static int vhost_9p_set_features(struct vhost_9p *n, u64 features)
 		mutex_unlock(&n->dev.mutex);
 		return -EFAULT;
 	}
-	vq = &n->vqs[VHOST_9P_VQ];
-	mutex_lock(&vq->mutex);
-	vq->acked_features = features;
-	mutex_unlock(&vq->mutex);
+	/* Requests taken off the ring before logging starts have no log,
+	 * so they must have replied before the features change.
+	 */
+	log_on = (features & (1 << VHOST_F_LOG_ALL)) &&
+		 !vhost_has_feature(n->dev.vqs[0], VHOST_F_LOG_ALL);
+	if (log_on) {
+		err = vhost_9p_drain(n, false);
+		if (err)
+			goto out;
+	}
+	for (i = 0; i < n->dev.nvqs; i++) {
+		vq = n->dev.vqs[i];
+		mutex_lock(&vq->mutex);
+		/* A trimmed queue needs its log back for migration. */
+		if ((features & (1 << VHOST_F_LOG_ALL)) && !vq->log &&
+		    vhost_dev_has_owner(&n->dev)) {
+			vq->log = kmalloc(UIO_MAXIOV * sizeof(*vq->log),
+					  GFP_KERNEL);
+			if (!vq->log) {
+				mutex_unlock(&vq->mutex);
+				err = -ENOMEM;
+				break;
+			}
+		}
+		vq->acked_features = features;
+		mutex_unlock(&vq->mutex);
+	}
+	if (log_on)
+		vhost_9p_resume(n);
+out:
 	mutex_unlock(&n->dev.mutex);
-	return 0;
+	return err;
 }
 /*
 	if (root_dir[0] != '/')
@@ -238,6 +2229,7 @@ long vhost_9p_set_path(struct vhost_9p *n, void __user *argp)
 	int err;
 	unsigned int lookup_flags = LOOKUP_FOLLOW;
 	struct path root;
+	struct p9_server *s;
 
 	// TODO: improve srtlen(src)
 	dst = kmalloc(PATH_MAX, GFP_KERNEL);
@@ -253,9 +2245,9 @@ long vhost_9p_set_path(struct vhost_9p *n, void __user *argp)
 retry:
 		err = kern_path(dst, lookup_flags, &root);
 		if (!err) {
-			n->server = p9_server_create(&root);
-			if (IS_ERR(n->server))
-				err = PTR_ERR(n->server);
+			s = p9_server_create(&root);
+			if (IS_ERR(s))
+				err = PTR_ERR(s);
 		}
 
 		if (retry_estale(err, lookup_flags)) {
@@ -263,6 +2255,24 @@ retry:
 			goto retry;
 		}
 
+	if (err)
+		goto out;
+
+	mutex_lock(&n->dev.mutex);
+	if (n->server) {
+		mutex_unlock(&n->dev.mutex);
+		p9_server_close(s);
+		err = -EBUSY;
+		goto out;
+	}
+	s->node = n->node;
+	p9_server_set_ioprio(s, n->ioprio);
+	s->msize = n->msize;
+	n->server = s;
+	if (vhost_dev_has_owner(&n->dev))
+		vhost_9p_start(n);
+	mutex_unlock(&n->dev.mutex);
+
 out:
 	kfree(dst);
 	return err;
@@ -291,15 +2301,61 @@ static long vhost_9p_ioctl(struct file *f, unsigned int ioctl,
 		if (features & ~VHOST_9P_FEATURES)
 			return -EOPNOTSUPP;
 		return vhost_9p_set_features(n, features);
+	case VHOST_SET_OWNER:
+		return vhost_9p_set_owner(n);
 	case VHOST_RESET_OWNER:
 		return vhost_9p_reset_owner(n);
+	case VHOST_9P_SET_NUM_QUEUES:
+		return vhost_9p_set_num_queues(n, argp);
+	case VHOST_9P_SET_MAX_INFLIGHT:
+		return vhost_9p_set_max_inflight(n, argp);
+	case VHOST_9P_SET_COALESCE:
+		return vhost_9p_set_coalesce(n, argp);
+	case VHOST_9P_GET_STATS:
+		return vhost_9p_get_stats(n, argp);
+	case VHOST_9P_SET_BUDGET:
+		return vhost_9p_set_budget(n, argp);
+	case VHOST_9P_SET_QOS:
+		return vhost_9p_set_qos(n, argp);
+	case VHOST_9P_SET_SCHED:
+		return vhost_9p_set_sched(n, argp);
+	case VHOST_9P_SET_IOPRIO:
+		return vhost_9p_set_ioprio(n, argp);
+	case VHOST_9P_SET_MSIZE:
+		return vhost_9p_set_msize(n, argp);
 	case VHOST_SET_PATH:
 		return vhost_9p_set_path(n, argp);
+	case VHOST_9P_SET_POOL:
+		return vhost_9p_set_pool(n, argp);
+	case VHOST_9P_SET_IDLE_TRIM:
+		return vhost_9p_set_idle_trim(n, argp);
+	case VHOST_9P_ATTACH_SOCKET:
+		return vhost_9p_attach_socket(n, argp);
+	case VHOST_9P_SET_AFFINITY:
+		return vhost_9p_set_affinity(n, argp);
+	case VHOST_9P_GET_FIDS:
+		return vhost_9p_get_fids(n, argp);
+	case VHOST_9P_SET_FIDS:
+		return vhost_9p_set_fids(n, argp);
 	default:
 		mutex_lock(&n->dev.mutex);
-		r = vhost_dev_ioctl(&n->dev, ioctl, argp);
-		if (r == -ENOIOCTLCMD)
-			r = vhost_vring_ioctl(&n->dev, ioctl, argp);
+		if (ioctl == VHOST_SET_VRING_KICK && n->use_pool) {
+			r = vhost_9p_set_vring_kick(n, argp);
+		} else {
+			/* Requests in flight hold buffers of the old table. */
+			if (ioctl == VHOST_SET_MEM_TABLE) {
+				r = vhost_9p_drain(n, false);
+				if (r) {
+					mutex_unlock(&n->dev.mutex);
+					return r;
+				}
+			}
+			r = vhost_dev_ioctl(&n->dev, ioctl, argp);
+			if (r == -ENOIOCTLCMD)
+				r = vhost_vring_ioctl(&n->dev, ioctl, argp);
+			if (ioctl == VHOST_SET_MEM_TABLE)
+				vhost_9p_resume(n);
+		}
 		vhost_9p_flush(n);
 		mutex_unlock(&n->dev.mutex);
 		return r;
@@ -333,13 +2389,24 @@ static struct miscdevice vhost_9p_misc = {
 
 static int vhost_9p_init(void)
 {
-	return misc_register(&vhost_9p_misc);
+	int err;
+
+	err = p9_server_init();
+	if (err)
+		return err;
+
+	err = misc_register(&vhost_9p_misc);
+	if (err)
+		p9_server_exit();
+	return err;
 }
 module_init(vhost_9p_init);
 
 static void vhost_9p_exit(void)
 {
 	misc_deregister(&vhost_9p_misc);
+	vhost_9p_pools_destroy();
+	p9_server_exit();
 }
 module_exit(vhost_9p_exit);
 
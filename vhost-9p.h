@@ -1,36 +1,319 @@
 #ifndef _VHOST_9P_H
 #define _VHOST_9P_H
 
+#include <linux/kthread.h>
+#include <linux/spinlock.h>
+#include <linux/hashtable.h>
+#include <linux/llist.h>
+#include <linux/wait.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+
 #include "vhost.h"
+#include "9p-server.h"
 
-//#define DEBUG 1
-#ifdef DEBUG
-#define p9s_debug(fmt, ...)           \
-    pr_info(fmt, ##__VA_ARGS__)
-#else
-#define p9s_debug(fmt, ...)           \
-    no_printk(fmt, ##__VA_ARGS__)
-#endif
+/*
+ * Limits of the msize the module negotiates, from P9_MIN_MSIZE on. A
+ * message of page-sized buffers must fit the UIO_MAXIOV iovecs of a
+ * queue, with room for the header buffers and an unaligned first and
+ * last page.
+ */
+#define P9_DEF_MSIZE (512 * 1024)
+#define P9_MAX_MSIZE ((UIO_MAXIOV - 4) * PAGE_SIZE)
+
+enum {
+	VHOST_9P_VQ = 0,
+	VHOST_9P_VQ_MAX = 16,
+};
+
+/* Interrupt moderation: the guest is signalled once max_replies replies
+ * are on the used ring, or usecs after the oldest unsignalled one.
+ * Zero in either field signals after every batch of replies.
+ */
+struct vhost_9p_coalesce {
+	__u32 max_replies;
+	__u32 usecs;
+};
+
+/* How much a queue may take on. max_reqs and max_usecs bound one run of
+ * its worker: requests taken off the ring, and time spent by the worker
+ * plus the exec threads on the replies it published. max_bytes bounds
+ * the queue's requests in flight: request bytes plus the payload asked
+ * for by Tread and Treaddir. Zero leaves that dimension unlimited, but
+ * max_reqs and max_usecs cannot both be.
+ */
+struct vhost_9p_budget {
+	__u32 max_reqs;
+	__u32 max_bytes;
+	__u32 max_usecs;
+};
+
+/* I/O limits of a device, as token buckets refilled at these rates. A
+ * bucket holds up to burst_msecs of its rate, 100ms if 0. Zero leaves
+ * that limit off. Data ops are Tread and Twrite, metadata ops all other
+ * requests but Tflush.
+ */
+struct vhost_9p_qos {
+	__u64 read_bps;
+	__u64 write_bps;
+	__u32 data_iops;
+	__u32 meta_iops;
+	__u32 burst_msecs;
+	__u32 reserved;
+};
+
+/* Request scheduling: at most slots requests of the device execute at a
+ * time, cheap ones first. A waiting bulk request lets at most window
+ * cheap ones overtake it. Zero slots, the default, runs requests in ring
+ * order. A request blocked on a FIFO or a lock keeps its slot, so slots
+ * should exceed the number of such requests the guest may have pending.
+ */
+struct vhost_9p_sched {
+	__u32 slots;
+	__u32 window;
+};
+
+#define VHOST_9P_FIDS_MAGIC 0x39504644
+
+/* A fid table checkpoint: this header, then count records. */
+struct vhost_9p_fids_hdr {
+	__u32 magic;
+	__u32 count;
+	__u32 uid;
+	__u32 reserved;
+};
+
+/* One fid. The path is relative to the export root and NUL terminated,
+ * and records are padded to 8 bytes. flags and pos are only meaningful
+ * for an opened fid. A stale fid, on an unlinked file or another mount,
+ * has no path; it is restored as a fid that fails with ESTALE until it
+ * is clunked.
+ */
+struct vhost_9p_fid_rec {
+	__u32 fid;
+	__u32 uid;
+	__u32 flags;
+	__u16 path_len;
+	__u8 opened;
+	__u8 stale;
+	__s64 pos;
+	char path[];
+};
+
+/* Buffer of VHOST_9P_GET_FIDS and VHOST_9P_SET_FIDS. GET sets size to
+ * the length of the checkpoint and fails with E2BIG if it did not fit.
+ */
+struct vhost_9p_fids {
+	__u64 addr;
+	__u64 size;
+};
+
+#define VHOST_9P_AFFINITY_CPUS 1024
 
-struct p9_server {
-	u32 uid;
-	struct path root;
-	struct rb_root fids;
+/* Where the workers of a device run and its memory is allocated. An
+ * empty CPU set means all CPUs of the node, a node of -1 the node of the
+ * first CPU in the set. Both empty undoes the binding.
+ */
+struct vhost_9p_affinity {
+	__s32 node;
+	__u32 reserved;
+	__u64 cpus[VHOST_9P_AFFINITY_CPUS / 64];
 };
 
+/* Device counters, summed over the queues. */
+struct vhost_9p_stats {
+	/* Busy polls that found a request before busyloop_timeout. */
+	__u64 poll_hits;
+	__u64 poll_misses;
+	/* Runs that ended because the budget was used up. */
+	__u64 budget_yields;
+	/* Time the shared worker pool spent on the device's rings. That
+	 * spent executing its requests, on the pool too, is in exec_ns.
+	 */
+	__u64 pool_ns;
+	/* Time spent executing the device's requests. */
+	__u64 exec_ns;
+	/* Kernel memory held by the device: its queues with their scratch
+	 * and cached PDUs, the stacks of its own threads, the fid table and
+	 * the socket connections. Requests in flight are not counted, nor
+	 * the open files, dentries and inodes the fids hold.
+	 */
+	__u64 mem_bytes;
+	/* Times a queue was held back by the QoS limits, and for how long. */
+	__u64 qos_delays;
+	__u64 qos_delay_ns;
+	/* Cheap requests that went ahead of a waiting bulk request. */
+	__u64 sched_overtakes;
+};
+
+#define VHOST_9P_REQ_HASH_BITS 7
+
+struct vhost_9p_pool;
+
 enum {
-	VHOST_9P_VQ = 0,
-	VHOST_9P_VQ_MAX = 1,
+	VHOST_9P_QOS_READ,
+	VHOST_9P_QOS_WRITE,
+	VHOST_9P_QOS_DATA,
+	VHOST_9P_QOS_META,
+	VHOST_9P_QOS_MAX,
+};
+
+/* Tokens may go negative: a request is let through when the bucket is
+ * not in debt, and the next one waits until it is paid off.
+ */
+struct vhost_9p_bucket {
+	u64 rate;
+	u64 cap;
+	s64 tokens;
+	u64 stamp;
+};
+
+/* Polls a kick eventfd for queues served by the shared pool. */
+struct vhost_9p_kick {
+	poll_table table;
+	wait_queue_head_t *wqh;
+	wait_queue_t wait;
+};
+
+/* The socket connections of a device. A connection leaves the list when
+ * its peer hangs up.
+ */
+struct p9_socks {
+	spinlock_t lock;
+	struct list_head conns;
+	unsigned int count;
+};
+
+/* A request queue and the worker thread that services it, or the shared
+ * pool it is queued on.
+ */
+struct vhost_9p_virtqueue {
+	struct vhost_virtqueue vq;
+	int index;
+	struct kthread_worker *worker;
+	struct kthread_work work;
+	struct vhost_9p_pool *pool;
+	/* Protected by the pool lock. */
+	struct list_head pool_node;
+	unsigned long pool_state;
+	struct vhost_9p_kick kick;
+	/* Executed requests, waiting to be put on the used ring. */
+	struct llist_head done;
+	atomic_t inflight;
+	/* Cost of the requests in flight, under vq->mutex. */
+	u64 inflight_bytes;
+	/* Replies on the used ring the guest was not signalled for. */
+	unsigned int unsignalled;
+	u64 first_unsignalled;
+	struct hrtimer signal_timer;
+	u64 poll_hits;
+	u64 poll_misses;
+	u64 budget_yields;
+	/* Jiffies of the last run, for releasing scratch when idle. */
+	unsigned long last_used;
+	/* Requeues the queue once the QoS buckets allow its next request. */
+	struct hrtimer qos_timer;
+	u64 qos_delays;
+	u64 qos_delay_ns;
+	/* Shared by the requests of the queue, wherever they execute. */
+	struct p9_pdu_pool pdus;
 };
 
 struct vhost_9p {
 	struct vhost_dev dev;
-	struct vhost_virtqueue vqs[VHOST_9P_VQ_MAX];
+	struct mm_struct *mm;
 	struct p9_server *server;
+	/* The guest's 9P session, over all queues of the device. */
+	struct p9_session session;
+
+	/* Requests being executed, hashed by tag. */
+	spinlock_t req_lock;
+	DECLARE_HASHTABLE(reqs, VHOST_9P_REQ_HASH_BITS);
+	/* Dispatched requests whose reply is not yet on the used ring. */
+	atomic_t inflight;
+	unsigned int max_inflight;
+	struct vhost_9p_coalesce coalesce;
+	struct vhost_9p_budget budget;
+	/* Shared by the queues of the device. */
+	spinlock_t qos_lock;
+	bool qos_on;
+	struct vhost_9p_bucket qos[VHOST_9P_QOS_MAX];
+	/* Requests waiting for an execution slot. */
+	spinlock_t sched_lock;
+	struct vhost_9p_sched sched;
+	struct list_head sched_cheap;
+	struct list_head sched_bulk;
+	unsigned int sched_running;
+	unsigned int sched_overtaken;
+	u64 sched_overtakes;
+	/* Queues that stopped dispatching because inflight hit the cap. */
+	unsigned long stalled;
+	wait_queue_head_t inflight_wait;
+	/* Set while waiting for inflight to drop to 0, see vhost_9p_drain(). */
+	bool draining;
+
+	/* Threads executing the requests of a device off the pool, in the
+	 * owner's cgroups. They are started as requests queue up, up to
+	 * exec_threads, and all but one leave again once idle.
+	 */
+	spinlock_t exec_lock;
+	struct list_head exec_queue;
+	unsigned int exec_queued;
+	unsigned int exec_idle;
+	wait_queue_head_t exec_wait;
+	/* Started on the vhost worker, which is in the owner's cgroups. */
+	struct vhost_work exec_spawn;
+	pid_t owner_pid;
+	/* The threads, under exec_mutex. */
+	struct mutex exec_mutex;
+	unsigned int nr_exec;
+	struct task_struct **exec_threads;
+
+	/* Worker placement, see struct vhost_9p_affinity. */
+	int node;
+	struct cpumask cpus;
+
+	/* Default I/O priority handed to the server. */
+	int ioprio;
+	/* msize limit handed to the server. */
+	u32 msize;
+
+	/* Release per-queue scratch after this long idle, 0 keeps it. */
+	unsigned int trim_msecs;
+	struct delayed_work trim_work;
+
+	/* Sockets served by the server besides the virtqueues. */
+	struct p9_socks socks;
+
+	/* Serve the queues from the shared pool of NUMA node pool_nid. */
+	bool use_pool;
+	int pool_nid;
+	/* Protected by the pool lock. */
+	struct list_head pool_node;
+	struct list_head pool_ready;
+	atomic64_t pool_ns;
+	atomic64_t exec_ns;
 };
 
+static inline struct vhost_9p_virtqueue *to_nvq(struct vhost_virtqueue *vq)
+{
+	return container_of(vq, struct vhost_9p_virtqueue, vq);
+}
+
 struct p9_server *p9_server_create(struct path *root);
 void p9_server_close(struct p9_server *s);
-void do_9p_request(struct p9_server *s, struct iov_iter *req, struct iov_iter *resp);
+
+int p9_sock_attach(struct p9_server *s, int fd, struct p9_socks *socks);
+void p9_sock_detach_all(struct p9_socks *socks);
+size_t p9_sock_mem(struct p9_socks *socks);
+int p9_server_init(void);
+void p9_server_exit(void);
+long p9_server_save(struct p9_server *s, void __user *buf, size_t size);
+int p9_server_restore(struct p9_server *s, const void __user *buf,
+		size_t size);
+/* Memory held by the server and its fid table. */
+size_t p9_server_mem(struct p9_server *s);
+/* Default I/O priority of the fids, see P9_TIOPRIO. */
+void p9_server_set_ioprio(struct p9_server *s, int ioprio);
 
 #endif